@@ -35,7 +35,11 @@ int main(int argc, char **argv)
 	const char *tree_fn = 0;
 	const char *cvt_tree_fn = 0;
 	const char *db_fn = "visual.db";
+	const char *heldout_fn = 0;
+	kmean_tree::centroid_format_t format = kmean_tree::CENTROID_FLOAT;
 	int stop=0;
+	int max_in_memory=0;
+	const char *spill_dir=0;
 		
 	for (int i=1; i<argc; i++) {
 		if (i<argc-1) {
@@ -60,6 +64,27 @@ int main(int argc, char **argv)
 			} else if (strcmp(argv[i],"-s")==0) {
 				stop = atoi(argv[++i]);
 				continue;
+			} else if (strcmp(argv[i],"-m")==0) {
+				max_in_memory = atoi(argv[++i]);
+				continue;
+			} else if (strcmp(argv[i],"-T")==0) {
+				spill_dir = argv[++i];
+				continue;
+			} else if (strcmp(argv[i],"-H")==0) {
+				heldout_fn = argv[++i];
+				continue;
+			} else if (strcmp(argv[i],"-f")==0) {
+				++i;
+				if (strcmp(argv[i],"float")==0) {
+					format = kmean_tree::CENTROID_FLOAT;
+					continue;
+				} else if (strcmp(argv[i],"half")==0) {
+					format = kmean_tree::CENTROID_HALF;
+					continue;
+				} else if (strcmp(argv[i],"int8")==0) {
+					format = kmean_tree::CENTROID_INT8;
+					continue;
+				}
 			} 
 		}
 		cout << "Available options:\n"
@@ -69,6 +94,10 @@ int main(int argc, char **argv)
 		        " -r <max recursion>\n"
 		        " -e <min number of elements>\n"
 		        " -s <max elements to process>\n"
+		        " -m <max descriptors in memory> stream the descriptor file, using spill files\n"
+		        " -T <directory> where to write spill files (default: next to the descriptor file)\n"
+		        " -f <float|half|int8> precision of the means saved in the database\n"
+		        " -H <descriptor file> compare float, half and int8 quantization on held-out descriptors\n"
 			" -C <tree file> convert the tree file to sqlite3 database\n"
 		       ;
 
@@ -84,7 +113,9 @@ int main(int argc, char **argv)
 		return -1;
 	}
 	kmean_tree::node_t *root;
-	if (!cvt_tree_fn)
+	if (!cvt_tree_fn && max_in_memory>0)
+		root = kmean_tree::build_from_data_streaming(descr_fn, max_level, min_elem, max_in_memory, spill_dir);
+	else if (!cvt_tree_fn)
 		root = kmean_tree::build_from_data(descr_fn, max_level, min_elem, stop);
 	else
 		root = kmean_tree::load(cvt_tree_fn);
@@ -93,11 +124,14 @@ int main(int argc, char **argv)
 		std::cerr << descr_fn << ": unable to build tree from descriptor file\n";
 		return -1;
 	}
+	if (heldout_fn)
+		kmean_tree::compare_centroid_formats(root, heldout_fn);
+
 	std::cout << "Done. Saving result..." << std::endl;
 	if (tree_fn)
 		root->save(tree_fn);
 	else {
-		if (!root->save_to_database(db_fn)) {
+		if (!root->save_to_database(db_fn, format)) {
 			cerr << db_fn << ": error.\n";
 			return -1;
 		}
@@ -21,30 +21,137 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <vector>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 #include <polyora/polyora.h>
+#include <polyora/timer.h>
 using namespace std;
 
-bool load_patch_track(id_cluster_collection *clusters, const char *descr_fn, kmean_tree::node_t *root)
+typedef kmean_tree::descr_file_packet packet_t;
+
+//! Quantizes n packets. Chunks of 4096 packets are spread over threads.
+static void quantize_packets(const kmean_tree::flat_tree *tree, const packet_t *p, unsigned n, unsigned *ids)
+{
+	const int chunk = 4096;
+	const int nb_chunks = (n + chunk - 1) / chunk;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int c=0; c<nb_chunks; ++c) {
+		const kmean_tree::descriptor_t *d[chunk];
+		unsigned start = c*chunk;
+		unsigned m = std::min((unsigned)chunk, n-start);
+		for (unsigned i=0; i<m; ++i) d[i] = &p[start+i].d;
+		tree->get_ids(m, d, ids+start);
+	}
+}
+
+/*! Reads tracks of descriptors and adds one cluster per track. The file is
+ * mapped in memory and quantized by blocks, in parallel. A negative ptr
+ * marks the beginning of a new track.
+ */
+bool load_patch_track(id_cluster_collection *clusters, const char *descr_fn, const kmean_tree::flat_tree *tree)
 {
+	const unsigned block = 64*4096;
+	long nb_packets;
+#ifdef WIN32
 	FILE *descr_f = fopen(descr_fn, "rb");
 	if (!descr_f) {
 		perror(descr_fn);
 		return false;
 	}
+	fseek(descr_f, 0, SEEK_END);
+	nb_packets = ftell(descr_f) / sizeof(packet_t);
+	fseek(descr_f, 0, SEEK_SET);
+	std::vector<packet_t> buffer(block);
+#else
+	int fd = open(descr_fn, O_RDONLY);
+	if (fd<0) {
+		perror(descr_fn);
+		return false;
+	}
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) < 0) {
+		perror(descr_fn);
+		close(fd);
+		return false;
+	}
+	nb_packets = statbuf.st_size / sizeof(packet_t);
+	packet_t *data = 0;
+	if (nb_packets > 0) {
+		data = (packet_t *) mmap(0, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (data == (packet_t *)-1) {
+			perror("mmap");
+			close(fd);
+			return false;
+		}
+		madvise(data, statbuf.st_size, MADV_SEQUENTIAL);
+	}
+#endif
 
+	std::vector<unsigned> ids(block);
 	id_cluster *c = new id_cluster();
+	unsigned nb_tracks=0;
+	bool ok=true;
+	Timer timer;
 
-	kmean_tree::descr_file_packet packet;
-	while(fread(&packet, sizeof(packet), 1, descr_f) == 1) {
-		unsigned id = root->get_id(&packet.d);
-		if (packet.ptr <0 && c->total>0) {
-			clusters->add_cluster(c);
-			c = new id_cluster();
+	for (long start=0; start<nb_packets; start+=block) {
+		unsigned n = (unsigned) std::min((long)block, nb_packets-start);
+#ifdef WIN32
+		const packet_t *p = &buffer[0];
+		if (fread(&buffer[0], sizeof(packet_t), n, descr_f) != n) {
+			perror(descr_fn);
+			ok=false;
+			break;
+		}
+#else
+		const packet_t *p = data + start;
+		// pages already quantized will not be needed again.
+		size_t done = (start * sizeof(packet_t)) & ~(size_t)(getpagesize()-1);
+		if (done > 0) madvise(data, done, MADV_DONTNEED);
+#endif
+		quantize_packets(tree, p, n, &ids[0]);
+
+		for (unsigned i=0; i<n; ++i) {
+			if (p[i].ptr <0 && c->total>0) {
+				clusters->add_cluster(c);
+				c = new id_cluster();
+				nb_tracks++;
+			}
+			c->add(ids[i], 1);
 		}
-		c->add(id, 1);
+
+		double sec = timer.value() / 1000.0;
+		double mb = (start+n) * (double)sizeof(packet_t) / (1024.0*1024.0);
+		printf("%s: % 3d%% - %d tracks, %.1f MB/s\r", descr_fn,
+				(int)(100.0 * (start+n) / nb_packets), nb_tracks,
+				(sec > 0 ? mb/sec : 0.0));
+		fflush(stdout);
 	}
+
+	if (ok && c->total>0) {
+		clusters->add_cluster(c);
+		nb_tracks++;
+	} else
+		delete c;
+
+	printf("\n%s: %ld descriptors, %d tracks in %.1f s\n", descr_fn, nb_packets,
+			nb_tracks, timer.value()/1000.0);
+
+#ifdef WIN32
 	fclose(descr_f);
-	return true;
+#else
+	if (data) munmap(data, statbuf.st_size);
+	close(fd);
+#endif
+	return ok;
 }
 
 int main(int argc, char **argv) 
@@ -110,12 +217,14 @@ int main(int argc, char **argv)
 		return -1;
 	}
 	
+	kmean_tree::flat_tree quantizer(root);
+
 	id_cluster_collection *clusters = new id_cluster_collection(id_cluster_collection::QUERY_NORMALIZED_FREQ);
 
 	for (int i=1; i<argc; i++) {
 		if (i<argc-1) {
 			if (strcmp(argv[i],"-d")==0) {
-				if (!load_patch_track(clusters, argv[++i], root)) {
+				if (!load_patch_track(clusters, argv[++i], &quantizer)) {
 					cerr << argv[i] << ": loading failed.\n";
 				} else {
 					cerr << argv[i] << ": loaded successfully.\n";
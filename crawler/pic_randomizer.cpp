@@ -458,14 +458,14 @@ bool write_descriptor(FILE *descrf, pyr_keypoint *k, long ptr)
 
 
 #ifdef WITH_YAPE
-	if (k->descriptor.total==0) {
+	if (k->descriptor==0 || k->descriptor->total==0) {
 		std::cout << "save_descriptors: total==0!\n";
 		return false;
 	}
 
 	fwrite(&ptr, sizeof(long), 1, descrf);
 	float array[descr_size];
-	k->descriptor.array(array);
+	k->descriptor->array(array);
 	fwrite(array, descr_size * sizeof(float), 1,descrf);
 #endif
 
@@ -500,7 +500,7 @@ void pic_randomizer::group_ids()
 
 	pyr_frame *frame = (pyr_frame *)tracker->get_nth_frame(0);
 
-	assert(tracker->tree!=0);
+	assert(tracker->quantizer!=0);
 	for (tracks::keypoint_frame_iterator it(frame->points.begin()); !it.end(); ++it) {
 
 		float _u = it.elem()->u;
@@ -0,0 +1,153 @@
+/*  This file is part of Polyora, a multi-target tracking library.
+    Copyright (C) 2010 Julien Pilet
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program. If not, see <http://www.gnu.org/licenses/>.
+
+    To contact the author of this program, please send an e-mail to:
+    julien.pilet(at)calodox.org
+*/
+/*! \file yapecheck.cpp
+ * Regression check of the vectorized YAPE detector: detects keypoints on a
+ * fixed image with and without yape::set_use_simd, and reports any
+ * difference. Returns 0 if both agree.
+ *
+ * Without argument, a synthetic image is used.
+ */
+
+#include <iostream>
+#include <string.h>
+#include <highgui.h>
+
+#include <polyora/polyora.h>
+
+using namespace std;
+
+static unsigned next_rand(unsigned &state)
+{
+	state = state*1103515245u + 12345u;
+	return (state >> 16) & 0x7fff;
+}
+
+//! A deterministic noisy image with corners and blobs of various contrasts.
+static IplImage *synthetic_image(int width, int height)
+{
+	IplImage *im = cvCreateImage(cvSize(width, height), IPL_DEPTH_8U, 1);
+
+	unsigned state = 1;
+	for (int y=0; y<height; y++)
+		for (int x=0; x<width; x++)
+			CV_IMAGE_ELEM(im, unsigned char, y, x) = 108 + next_rand(state) % 40;
+
+	for (int i=0; i<400; i++) {
+		int v[5];
+		for (int j=0; j<5; j++) v[j] = next_rand(state);
+		CvPoint p = cvPoint(v[0] % width, v[1] % height);
+		int size = 3 + v[2] % 40;
+		CvScalar color = cvScalarAll(v[3] % 256);
+		if (v[4] & 1)
+			cvRectangle(im, p, cvPoint(p.x + size, p.y + size/2 + 2), color, CV_FILLED);
+		else
+			cvCircle(im, p, size/2, color, CV_FILLED);
+	}
+	return im;
+}
+
+//! Both paths must give the same bits, NaN included.
+static bool same(float a, float b)
+{
+	return memcmp(&a, &b, sizeof(float)) == 0;
+}
+
+//! Detects keypoints on im, and compares the scalar and vectorized paths.
+static int check(IplImage *im, int tau, int levels)
+{
+	const int max_pts = 5000;
+	static keypoint scalar_pts[max_pts], simd_pts[max_pts];
+
+	pyr_yape detector(im->width, im->height, levels);
+	detector.set_tau(tau);
+
+	detector.set_use_simd(false);
+	int n_scalar = detector.detect(im, scalar_pts, max_pts);
+	PyrImage *scalar_scores = detector.pscores->clone();
+	detector.set_use_simd(true);
+	int n_simd = detector.detect(im, simd_pts, max_pts);
+
+	int errors = 0;
+	for (int l=0; l<levels; l++) {
+		IplImage *a = (*scalar_scores)[l];
+		IplImage *b = (*detector.pscores)[l];
+		for (int y=0; y<a->height; y++)
+			if (memcmp(a->imageData + y*a->widthStep, b->imageData + y*b->widthStep,
+						a->width*sizeof(short)) != 0) {
+				cerr << "tau " << tau << ": scores differ at level " << l << ", row " << y << endl;
+				errors++;
+				break;
+			}
+	}
+	delete scalar_scores;
+	if (n_scalar != n_simd) {
+		cerr << "tau " << tau << ": " << n_scalar << " keypoints without SIMD, "
+			<< n_simd << " with SIMD.\n";
+		errors++;
+	}
+	int n = (n_scalar < n_simd ? n_scalar : n_simd);
+	for (int i=0; i<n; i++) {
+		const keypoint &a = scalar_pts[i];
+		const keypoint &b = simd_pts[i];
+		if (!same(a.u, b.u) || !same(a.v, b.v) || a.scale != b.scale || !same(a.score, b.score)) {
+			if (errors < 10)
+				cerr << "tau " << tau << ", keypoint " << i << ": ("
+					<< a.u << "," << a.v << "," << a.scale << "," << a.score << ") != ("
+					<< b.u << "," << b.v << "," << b.scale << "," << b.score << ")\n";
+			errors++;
+		}
+	}
+	cout << "tau " << tau << ": " << n_simd << " keypoints, "
+		<< (errors ? "MISMATCH" : "ok") << endl;
+	return errors;
+}
+
+int main(int argc, char *argv[]) {
+
+	if (!yape::simd_available()) {
+		cout << "No vectorized path on this CPU: nothing to compare.\n";
+		return 0;
+	}
+
+	IplImage *im;
+	if (argc > 1) {
+		// the detector works on single channel images.
+		im = cvLoadImage(argv[1], 0);
+		if (!im) {
+			cerr << argv[1] << ": can't load image\n";
+			return -1;
+		}
+	} else {
+		im = synthetic_image(640, 480);
+	}
+
+	const int taus[] = { 2, 5, 10, 20, 40, 100 };
+	int errors = 0;
+	for (unsigned i=0; i<sizeof(taus)/sizeof(taus[0]); i++)
+		errors += check(im, taus[i], 3);
+
+	cvReleaseImage(&im);
+
+	if (errors) {
+		cerr << errors << " differences between the scalar and vectorized YAPE.\n";
+		return 1;
+	}
+	return 0;
+}
@@ -178,15 +178,25 @@ void homography4_from_4corresp(
 #endif
 }
 
-static inline float rand_range(unsigned long n) {
+static inline float rand_range(unsigned long n, unsigned *state) {
 	// not smart at all.
+	if (state) {
+		// the generator of rand_r(), on a state owned by the caller
+		*state = *state * 1103515245u + 12345u;
+		unsigned rnd = (*state >> 16) & 0x7fff;
+		return (float)floor(double(n)*double(rnd)/32768.0);
+	}
 	int rnd = rand();
 	float r = (float)floor(double(n)*double(rnd)/(double(RAND_MAX)+1.0));
 	return r;
 }
 
-static inline fvec4 rand_range4(int n) {
-	return fvec4( rand_range(n), rand_range(n), rand_range(n), rand_range(n) );
+static inline fvec4 rand_range4(int n, unsigned *state) {
+	float a = rand_range(n, state);
+	float b = rand_range(n, state);
+	float c = rand_range(n, state);
+	float d = rand_range(n, state);
+	return fvec4(a, b, c, d);
 }
 
 static inline const float *row(int row, const float *array, int stride)
@@ -199,7 +209,8 @@ static inline float dist2(const float a[2], const float b[2]) { float dx(a[0]-b[
 
 int ransac_h4(const float *uv1, int stride1, const float *uv2, int stride2, int n, 
 		int maxiter, float dist_threshold, int stop_support, 
-		float result[3][3], char *inliers_mask, float *inliers1, float *inliers2)
+		float result[3][3], char *inliers_mask, float *inliers1, float *inliers2,
+		unsigned *rng_state)
 {
 	fvec4 bestH[3][3];
 	fvec4 best_support(0);
@@ -212,7 +223,7 @@ int ransac_h4(const float *uv1, int stride1, const float *uv2, int stride2, int
 		fvec4 corresp[4];
 		//std::cout << "Raw random:\n";
 		for (int i=0;i<4;i++) {
-			corresp[i] = rand_range4(std::min(6  + iter, n) -i);
+			corresp[i] = rand_range4(std::min(6  + iter, n) -i, rng_state);
 			//std::cout << corresp[i] << "\n";
 			for (int j=0; j<i; j++) {
 				corresp[i] += ((corresp[j] <= corresp[i]) & fvec4(1));
@@ -37,11 +37,14 @@ void homography4_from_4corresp(
   dist_threshold is a reprojection distrance threshold used to differenciate inliers from outliers
   inliers_mask is either 0 or a pointer to an array of n chars set to 0xff for inliers and to 0 for outliers.
   inliers1 and inliers2 are optional pointers to array that will be filled with inlier correspondences.
+  rng_state, if not null, is the state of a private random generator: concurrent
+  calls with their own states do not share rand() and give reproducible results.
 
   the function return the number of correspondances supporting the returned homography.
 */
 
 int ransac_h4(const float *uv1, int stride1, const float *uv2, int stride2, int n, 
 		int maxiter, float dist_threshold, int stop_support, 
-		float result[3][3], char *inliers_mask, float *inliers1, float *inliers2);
+		float result[3][3], char *inliers_mask, float *inliers1, float *inliers2,
+		unsigned *rng_state=0);
 #endif
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <math.h>
 #include <vector>
+#include <algorithm>
 
 using namespace std;
 //using namespace __gnu_cxx;
@@ -35,11 +36,72 @@ void id_cluster::clear()
 	id=0;
 }
 
-id_cluster_collection::id_cluster_collection(id_cluster_collection::query_flags flags) : flags(flags), version(0)
+id_cluster_collection::id_cluster_collection(id_cluster_collection::query_flags flags) : idf_nb_clusters(0), idf_full(true), version(0), flags(flags)
 {
 	is_idf_normalized=false;
 }
 
+void id_cluster_collection::set_posting(unsigned id, unsigned handle, float tf)
+{
+	if (id >= inverted.size()) {
+		if (tf==0) return;
+		inverted.resize(id+1);
+	}
+	posting_list &l = inverted[id];
+	posting_list::iterator it = lower_bound(l.begin(), l.end(), posting(handle, 0));
+	bool df_changed = false;
+	if (it != l.end() && it->cluster == handle) {
+		if (tf==0) {
+			l.erase(it);
+			df_changed = true;
+		} else it->tf = tf;
+	} else if (tf != 0) {
+		l.insert(it, posting(handle, tf));
+		df_changed = true;
+	}
+
+	// only the idf of id depends on its postings, as long as the number
+	// of clusters does not change.
+	if (!df_changed || idf_full) return;
+	if (idf_nb_clusters != clusters.size() || idf_dirty.size() > inverted.size()/4) {
+		idf_full = true;
+		idf_dirty.clear();
+	} else
+		idf_dirty.push_back(id);
+}
+
+float id_cluster_collection::cmp_idf(unsigned id) const
+{
+	if (id >= inverted.size() || inverted[id].empty())
+		return 0;
+	else if (clusters.size()<2)
+		return 1;
+	return logf(clusters.size()/inverted[id].size());
+}
+
+void id_cluster_collection::cmp_idf()
+{
+	idf_table.resize(inverted.size());
+	for (unsigned i=0; i<inverted.size(); ++i)
+		idf_table[i] = cmp_idf(i);
+	idf_nb_clusters = clusters.size();
+	idf_dirty.clear();
+	idf_full = false;
+}
+
+void id_cluster_collection::update_idf()
+{
+	if (idf_full || idf_nb_clusters != clusters.size()) {
+		cmp_idf();
+		return;
+	}
+	if (idf_table.size() < inverted.size())
+		idf_table.resize(inverted.size(), 0);
+	for (unsigned i=0; i<idf_dirty.size(); ++i)
+		idf_table[idf_dirty[i]] = cmp_idf(idf_dirty[i]);
+	idf_dirty.clear();
+}
+
 void id_cluster_collection::merge_clusters(id_cluster *a, id_cluster *b)
 {
 	//cout << "merging " << a->id << " and " << b->id << endl;
@@ -48,10 +110,9 @@ void id_cluster_collection::merge_clusters(id_cluster *a, id_cluster *b)
 	remove_cluster(b);
 	delete b;
 
-	// update the id2cluster map
-	for (id_cluster::uumap::iterator it = a->histo.begin(); it!=a->histo.end(); ++it) {
-		id2cluster[it->first][a] = (float)a->histo[it->first]; // /(float)a->total;
-	}
+	// update the inverted index
+	for (id_cluster::uumap::iterator it = a->histo.begin(); it!=a->histo.end(); ++it)
+		set_posting(it->first, a->handle, (float)it->second);
 	is_idf_normalized = false;
 	version++;
 }
@@ -105,35 +166,36 @@ void id_cluster_collection::get_scores(id_cluster *c, cluster_score_map &scores,
 
 	for (id_cluster::uumap::iterator it = c->histo.begin(); it!=c->histo.end(); ++it)
 	{
-		id2cluster_map::iterator id_it = id2cluster.find(it->first);
+		const posting_list *postings = get_postings(it->first);
+		if (!postings) continue;
+
 		double w_e = it->second;
 		
 		if (flags & QUERY_NORMALIZED_FREQ)
 			w_e = w_e / (double)c->total;
 
 		if (flags & QUERY_IDF)
-			w_e *= idf(id_it);
-
-		if (id_it!=id2cluster.end()) {
-			for (cluster_map::iterator cit=id_it->second.begin(); cit!=id_it->second.end(); ++cit) {
-				if (cit->first != c) {
-
-					double n = cit->second;
-					if (flags & QUERY_NORMALIZED_FREQ)
-						n = n / (double)cit->first->total;
-					assert(n>0);
-					double p = w_e * n;
-
-					cluster_score_map::iterator __i = scores.lower_bound(cit->first);
-					if (__i == scores.end() || cit->first<(*__i).first) {
-						scores.insert(__i, pair<id_cluster *, double>(cit->first, p));
-					} else {
-						p = __i->second += p;
-					}
-					if (best_c && p > best_s) {
-						best_s = p;
-						*best_c = cit->first;
-					}
+			w_e *= idf(it->first);
+
+		for (posting_list::const_iterator pit=postings->begin(); pit!=postings->end(); ++pit) {
+			id_cluster *other = handles[pit->cluster];
+			if (other != c) {
+
+				double n = pit->tf;
+				if (flags & QUERY_NORMALIZED_FREQ)
+					n = n / (double)other->total;
+				assert(n>0);
+				double p = w_e * n;
+
+				cluster_score_map::iterator __i = scores.lower_bound(other);
+				if (__i == scores.end() || other<(*__i).first) {
+					scores.insert(__i, pair<id_cluster *, double>(other, p));
+				} else {
+					p = __i->second += p;
+				}
+				if (best_c && p > best_s) {
+					best_s = p;
+					*best_c = other;
 				}
 			}
 		}
@@ -152,14 +214,22 @@ void id_cluster_collection::add_cluster(id_cluster *c)
 	version++;
 	is_idf_normalized=false;
 
-	if (clusters.insert(c).second) c->id = clusters.size();
+	if (clusters.insert(c).second) {
+		c->id = clusters.size();
+		if (free_handles.empty()) {
+			c->handle = handles.size();
+			handles.push_back(c);
+		} else {
+			c->handle = free_handles.back();
+			free_handles.pop_back();
+			handles[c->handle] = c;
+		}
+	}
 	assert(c->id!=0);
 
-	// update the id2cluster map
-	for (id_cluster::uumap::iterator it = c->histo.begin(); it!=c->histo.end(); ++it) {
-		id2cluster[it->first][c] = (float)c->histo[it->first]; 
-		//id2cluster[it->first][c] = (float)c->histo[it->first]/(float)c->total; 
-	}
+	// update the inverted index
+	for (id_cluster::uumap::iterator it = c->histo.begin(); it!=c->histo.end(); ++it)
+		set_posting(it->first, c->handle, (float)it->second);
 }
 
 float id_cluster::dotprod(const id_cluster &a) const
@@ -235,19 +305,20 @@ void id_cluster_collection::print()
 {
 	unsigned non_ambig=0;
 	cout << "Ambiguities:\n";
-	for (id2cluster_map::iterator it(id2cluster.begin()); it!=id2cluster.end(); ++it)
+	unsigned nb_ids=0;
+	for (inverted_index::iterator it(inverted.begin()); it!=inverted.end(); ++it)
 	{
+		if (it->empty()) continue;
+		nb_ids++;
 		int n=0;
-		for (cluster_map::iterator cit=it->second.begin(); cit!=it->second.end(); ++cit) {
-			float p = cit->second;
+		for (posting_list::iterator pit=it->begin(); pit!=it->end(); ++pit) {
+			float p = pit->tf;
 			if (p>.1) n++;
 		}
-		if (it->second.size()>0) {
-			cout << " " << it->second.size() << "("<<n<<") ";
-			if (it->second.size()==1) non_ambig++;
-		}
+		cout << " " << it->size() << "("<<n<<") ";
+		if (it->size()==1) non_ambig++;
 	}
-	cout << "\n.. and " << non_ambig << " non-ambiguous nodes, over " << id2cluster.size() 
+	cout << "\n.. and " << non_ambig << " non-ambiguous nodes, over " << nb_ids 
 		<< ". Total number of clusters: " << clusters.size()
 		<< endl;
 }
@@ -440,78 +511,154 @@ id_cluster_collection::~id_cluster_collection()
 
 void id_cluster_collection::cmp_best_clusters()
 {
-	best_cluster.clear();
-	for (id2cluster_map::iterator it(id2cluster.begin()); it!=id2cluster.end(); ++it)
+	best_cluster.assign(inverted.size(), 0);
+	for (unsigned id=0; id<inverted.size(); ++id)
 	{
 		float best_p=0;
 		id_cluster *best_c=0;
 
-		for (cluster_map::iterator cit=it->second.begin(); cit!=it->second.end(); ++cit) {
-			float p = cit->second;
-			//float p = (*cit)->histo[it->first];
+		for (posting_list::iterator pit=inverted[id].begin(); pit!=inverted[id].end(); ++pit) {
+			float p = pit->tf;
 			if (p>best_p) {
 				best_p=p;
-				best_c=cit->first;
+				best_c=handles[pit->cluster];
 			}
 		}
-		best_cluster[it->first] = best_c;
+		best_cluster[id] = best_c;
 	}
 }
 
 unsigned id_cluster_collection::get_best_cluster(unsigned id)
 {
-	map<unsigned, id_cluster *>::iterator it = best_cluster.find(id);
-	if (it != best_cluster.end()) return it->second->id;
+	if (id < best_cluster.size() && best_cluster[id]) return best_cluster[id]->id;
 	return 0;
 }
 
-// perform aglomerative clustering
-void id_cluster_collection::reduce(float threshold)
+unsigned id_cluster_collection::nearest_cluster(const id_cluster *c, float threshold,
+		score_accumulator &acc, float *sim) const
 {
-	/*
-	for (id2cluster_map::iterator it(id2cluster.begin()); it!=id2cluster.end(); ++it) {
-		for (cluster_map::iterator j(it->second.begin()); j!=it->second.end(); ++j) {
-			j->second = j->first->histo[it->first] / (float) j->first->total; 
+	if (acc.score.size() < handles.size()) acc.score.resize(handles.size(), 0);
+	acc.touched.clear();
+
+	for (id_cluster::uumap::const_iterator it = c->histo.begin(); it!=c->histo.end(); ++it)
+	{
+		const posting_list *postings = get_postings(it->first);
+		if (!postings) continue;
+
+		double w_e = it->second;
+		if (flags & QUERY_NORMALIZED_FREQ)
+			w_e = w_e / (double)c->total;
+		if (flags & QUERY_IDF)
+			w_e *= idf_table[it->first];
+
+		for (posting_list::const_iterator pit=postings->begin(); pit!=postings->end(); ++pit) {
+			if (pit->cluster == c->handle) continue;
+			double n = pit->tf;
+			if (flags & QUERY_NORMALIZED_FREQ)
+				n = n / (double)handles[pit->cluster]->total;
+			if (acc.score[pit->cluster] == 0) acc.touched.push_back(pit->cluster);
+			acc.score[pit->cluster] += w_e * n;
 		}
 	}
-	*/
 
-	cout << "Building initial distance matrix...\n";
-	build_distance_matrix(threshold);
-	cout << "\ndone. ";
+	unsigned best=~0u;
+	double best_s=threshold;
+	for (std::vector<unsigned>::iterator it(acc.touched.begin()); it!=acc.touched.end(); ++it) {
+		double s = acc.score[*it];
+		acc.score[*it] = 0;
+		if (s > best_s || (s == best_s && best != ~0u && *it < best)) {
+			best_s = s;
+			best = *it;
+		}
+	}
+	if (sim) *sim = (float)best_s;
+	return best;
+}
+
+/*! Agglomerative clustering with reciprocal nearest neighbours. With
+ * normalized frequencies and no idf, merging two clusters never makes the
+ * result closer to a third one than the closest of the two was, so pairs of
+ * clusters that are each other's nearest neighbour can be merged right away,
+ * all in one batch, and only the clusters that pointed to a merged one need
+ * a new nearest neighbour. Without normalization, merging increases
+ * similarities, and with QUERY_IDF every merge changes the idf weights:
+ * in both cases all clusters are searched again after each batch. Memory is
+ * linear in the number of clusters.
+ */
+void id_cluster_collection::reduce(float threshold)
+{
+	cout << "Building nearest neighbour graph...\n";
+
+	// nn[h]: handle of the nearest neighbour of cluster h, ~0u if none.
+	std::vector<unsigned> nn(handles.size(), ~0u);
+	std::vector<float> nn_sim(handles.size(), 0);
+	std::vector<char> changed(handles.size(), 0);
+	std::vector<unsigned> dirty;
+	for (unsigned h=0; h<handles.size(); ++h)
+		if (handles[h]) dirty.push_back(h);
 
 	unsigned start = clusters.size();
 	unsigned merged=0;
-	cout << "Starting clustering...\n";
-	do {
-		// find the two closest clusters
-		set<cluster_dist_t>::reverse_iterator closest_it = distance_matrix.rbegin();
-
-		if (closest_it == distance_matrix.rend()) {
-			cout << "Empty distance matrix.\n";
-			break;
+	int batch=0;
+	std::vector<std::pair<float, std::pair<unsigned, unsigned> > > pairs;
+
+	while (!dirty.empty()) {
+		// nearest neighbours of modified clusters, in parallel.
+		set_query_rules(flags);
+		update_idf();
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+		{
+			score_accumulator acc;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 64)
+#endif
+			for (int i=0; i<(int)dirty.size(); ++i) {
+				unsigned h = dirty[i];
+				nn[h] = nearest_cluster(handles[h], threshold, acc, &nn_sim[h]);
+			}
 		}
-		cluster_dist_t closest = *closest_it;
 
-		// if the are too far away, stop here.
-		if (closest.d < threshold) {
-			cout << "highest dotprod is " << closest.d <<  ", stopping clustering.\n";
-			break;
+		// reciprocal pairs, best first.
+		pairs.clear();
+		for (unsigned h=0; h<handles.size(); ++h) {
+			if (!handles[h] || nn[h] == ~0u) continue;
+			if (h < nn[h] && nn[nn[h]] == h)
+				pairs.push_back(std::make_pair(nn_sim[h], std::make_pair(h, nn[h])));
+		}
+		if (pairs.empty()) break;
+		std::sort(pairs.rbegin(), pairs.rend());
+
+		for (unsigned i=0; i<pairs.size(); ++i) {
+			unsigned a = pairs[i].second.first;
+			unsigned b = pairs[i].second.second;
+			// the smallest histogram is merged into the largest.
+			if (handles[a]->histo.size() < handles[b]->histo.size()) std::swap(a,b);
+			merge_clusters(handles[a], handles[b]);
+			changed[a] = changed[b] = 1;
 		}
-		merged++;
-		//cout << "Merging clusters " << closest.a->id << " and " <<
-		//	closest.b->id << " with distance " << closest.d << endl;
-
-		// otherwise merge clusters and update distance matrix
-		remove_from_distance_matrix(closest.a);
-		remove_from_distance_matrix(closest.b);
-
-		//cout << "Merging clusters.." << flush;
-		merge_clusters(closest.a, closest.b);
-		//cout << "done.\n";
-		add_to_distance_matrix(closest.a, threshold);
-	} while(1);
-	cout << merged << " merges. " << clusters.size() << " clusters left, over " << start << endl;
+		merged += pairs.size();
+
+		/* clusters whose neighbour has been merged have to be searched
+		 * again. Without normalization, merging increases similarities,
+		 * and with idf, it changes the weights of the other clusters:
+		 * all clusters are searched again.
+		 */
+		dirty.clear();
+		bool all = (flags & QUERY_NORMALIZED_FREQ) == 0 || (flags & QUERY_IDF) != 0;
+		for (unsigned h=0; h<handles.size(); ++h) {
+			if (handles[h] && (all || changed[h] || (nn[h] != ~0u && changed[nn[h]])))
+				dirty.push_back(h);
+		}
+		for (unsigned i=0; i<pairs.size(); ++i) {
+			changed[pairs[i].second.first] = changed[pairs[i].second.second] = 0;
+			nn[pairs[i].second.first] = nn[pairs[i].second.second] = ~0u;
+		}
+		printf("batch % 4d: % 8d merges, % 8d clusters left\r", ++batch, (int)pairs.size(), (int)clusters.size());
+		fflush(stdout);
+	}
+	cout << "\n" << merged << " merges. " << clusters.size() << " clusters left, over " << start << endl;
 	version++;
 
 	int i=0;
@@ -525,14 +672,15 @@ void id_cluster_collection::remove_cluster(id_cluster *c)
 	if (it != clusters.end()) {
 		clusters.erase(it);
 
-		// update the id2cluster map
-		for (id_cluster::uumap::iterator i = c->histo.begin(); i!=c->histo.end(); ++i) {
-			id2cluster_map::iterator id2c( id2cluster.find(i->first) );
+		// update the inverted index
+		for (id_cluster::uumap::iterator i = c->histo.begin(); i!=c->histo.end(); ++i)
+			set_posting(i->first, c->handle, 0);
 
-			id2c->second.erase(c);
-			if (id2c->second.size() == 0)
-				id2cluster.erase(id2c);
+		if (is_indexed(c)) {
+			handles[c->handle] = 0;
+			free_handles.push_back(c->handle);
 		}
+		c->handle = ~0u;
 	}
 	version++;
 }
@@ -547,163 +695,96 @@ void id_cluster_collection::update_cluster(id_cluster *c, unsigned id, int amoun
 	else c->weighted_sum = c->total;
 	version++;
 
-	if (clusters.find(c) != clusters.end()) {
-		// the cluster is indexed. Let's update the id2cluster table.
-
-		if (val==0) {
-			// remove entry for 'id'
-			id2cluster_map::iterator id2c( id2cluster.find(id) );
-			if (id2c != id2cluster.end()) {
-				// this can be heavy for vecmaps!
-				id2c->second.erase(c);
-			}
-		} else {
-			// update the entry for 'id'
-			// this can be heavy for vecmaps!
-			id2cluster[id][c]=val;
-		}
+	if (is_indexed(c)) {
+		// the cluster is indexed. Let's update its posting for 'id'.
+		set_posting(id, c->handle, (float)val);
 	}
 }
 
-void id_cluster_collection::build_distance_matrix(float t)
-{
-	distance_matrix.clear();
-	int n=0;
-	float tot = clusters.size();
-	for (cluster_set::iterator i=clusters.begin(); i!=clusters.end(); ++i) {
-		add_to_distance_matrix(*i, t);
-		printf("% 3d%% - % 8d elements\r", (int)(100.0f* (++n)/tot), (int)distance_matrix.size());
-		fflush(stdout);
-	}
-}
-
-void id_cluster_collection::remove_from_distance_matrix(id_cluster *c)
-{
-	cluster_score_map similar;
-	get_scores(c, similar);
-	//cout << "Removing " << similar.size() << " entries in dist matrix for " << c->id << flush ;
-	for (cluster_score_map::iterator i=similar.begin(); i!=similar.end(); ++i) {
-		cluster_dist_t cd(i->first, c, i->second);
-		distance_matrix.erase(cd);
-	}
-	
-	/*
-	//cout << "done. Second check:\n";
-	for (set<cluster_dist_t>::iterator it=distance_matrix.begin(); it!=distance_matrix.end(); ++it)
-	{
-		if (it->a == c || it->b == c) {
-			cout << "bug in remove_from_distance_matrix. Buggy element:"
-				<< " d="<<it->d << " a=" << it->a->id 
-				<< " b=" << it->b->id 
-				<< ", while removing " << c->id << endl;
-			cluster_dist_t cd1(it->a, it->b, it->a->dotprod(*(it->b)));
-			cluster_dist_t cd2(it->b, it->a, it->b->dotprod(*(it->a)));
-			assert(!(cd1<cd2) && !(cd2<cd1));
-
-			cout << "Cluster a: " << it->a->id << ":\n";
-			it->a->print();
-			cout << "Cluster b: " << it->b->id << ":\n";
-			it->b->print();
-
-			cout << "*it < cd1: " << ( *it < cd1 ? "yes" : "no" ) << endl;
-			cout << "cd1 < *it: " << ( cd1 < *it ? "yes" : "no" ) << endl;
-
-			cout << "Searching dist mat for: " 
-				<< " d="<<cd1.d << " a=" << cd1.a->id 
-				<< " b=" << cd1.b->id << endl;
-			set<cluster_dist_t>::iterator entry1 = distance_matrix.find(cd1);
-			assert (entry1 != distance_matrix.end());
-			set<cluster_dist_t>::iterator entry2 = distance_matrix.find(cd2);
-			assert (entry2 != distance_matrix.end());
-			assert (entry1->a == entry2->a);
-			assert(false);
-		}
-	}
-	*/
-	
-}
-
-void id_cluster_collection::add_to_distance_matrix(id_cluster *c, float threshold)
-{
-	cluster_score_map similar;
-	get_scores(c, similar);
-	//cout << "Adding " << similar.size() << " entries in dist matrix.. " << flush;
-	for (cluster_score_map::iterator i=similar.begin(); i!=similar.end(); ++i) {
-		cluster_dist_t cd(i->first, c, i->second);
-		if (cd.d > threshold)
-			distance_matrix.insert(cd);
-	}
-	//cout << "done.\n";
-}
-
-
-id_cluster_collection::cluster_dist_t::cluster_dist_t(id_cluster *_a, id_cluster *_b, float _d) 
-{
-	assert(_a!=_b);
-	if (_a < _b) {
-		a = _a;
-		b = _b;
-	} else {
-		a=_b;
-		b=_a;
-	}
-	//d = a->dotprod(*b);
-	d = _d;
-}
-
-bool id_cluster_collection::cluster_dist_t::operator < (const cluster_dist_t &c) const
-{
-	if (d == c.d) {
-	//if (fabs(d-c.d) < 1e-7) {
-		if (a < c.a) return true;
-		else {
-			if (a==c.a) 
-				return b < c.b;
-			else 
-				return false;
-		}
-	} 
-	if (d<c.d) return true;
-	return false;
-}
-
 void id_cluster_collection::clear()
 {
 	for (cluster_set::iterator it(clusters.begin()); it!=clusters.end(); it++) 
 		delete *it;
 	clusters.clear();
-	id2cluster.clear();
+	inverted.clear();
+	idf_full = true;
+	idf_dirty.clear();
+	handles.clear();
+	free_handles.clear();
 	best_cluster.clear();
-	distance_matrix.clear();
 	version++;
 }
 
-float id_cluster_collection::idf(id_cluster_collection::id2cluster_map::iterator &id_it)
-{
-	if (clusters.size()<2) return 1;
-	return logf(clusters.size()/id_it->second.size());
-}
-
-float id_cluster_collection::idf(unsigned id)
-{
-	id2cluster_map::iterator id_it = id2cluster.find(id);
-	if (id_it == id2cluster.end()) return 0;
-	return idf(id_it);
-}
-
 incremental_query::incremental_query(id_cluster_collection *db) 
-	: database(db)
+	: database(db), score_index_bits(0), results_dirty(false), results_ratio(1),
+	best(-1), best_valid(true)
 {
 	if (db) version=db->version;
 }
 
 void incremental_query::clear() {
 	results.clear();
+	results_dirty=false;
 	query_cluster.clear();
 	scores.clear();
+	std::fill(score_index.begin(), score_index.end(), 0);
+	best=-1;
+	best_valid=true;
 	if (database) version=database->version;
 }
 
+static inline unsigned hash_slot(unsigned handle, unsigned bits)
+{
+	return (handle * 2654435761u) >> (32 - bits);
+}
+
+void incremental_query::rehash_scores(unsigned bits)
+{
+	score_index_bits = bits;
+	score_index.assign(1u << bits, 0);
+	const unsigned mask = (1u << bits) - 1;
+	for (unsigned i=0; i<scores.size(); ++i) {
+		unsigned slot = hash_slot(scores[i].cluster, bits);
+		while (score_index[slot]) slot = (slot+1) & mask;
+		score_index[slot] = i+1;
+	}
+}
+
+incremental_query::score_entry *incremental_query::find_score(unsigned handle, bool create)
+{
+	if (score_index.empty()) {
+		if (!create) return 0;
+		rehash_scores(6);
+	}
+	const unsigned mask = (1u << score_index_bits) - 1;
+	unsigned slot = hash_slot(handle, score_index_bits);
+	while (score_index[slot]) {
+		score_entry &e = scores[score_index[slot]-1];
+		if (e.cluster == handle) return &e;
+		slot = (slot+1) & mask;
+	}
+	if (!create) return 0;
+
+	// keep the table at most half full.
+	if (2*(scores.size()+1) > score_index.size()) {
+		rehash_scores(score_index_bits+1);
+		return find_score(handle, true);
+	}
+	scores.push_back(score_entry(handle, 0));
+	score_index[slot] = scores.size();
+	return &scores.back();
+}
+
+float incremental_query::normalized_score(const score_entry &e) const
+{
+	float s = e.score;
+	if (database->flags & id_cluster_collection::QUERY_NORMALIZED_FREQ) {
+		if ((database->flags & (id_cluster_collection::QUERY_MIN_FREQ | id_cluster_collection::QUERY_BIN_FREQ)) ==0)
+			s = s/(float)query_cluster.total;
+	}
+	return s;
+}
+
 //template <typename T> T min(const T a, const T b) { return (a<b?a:b); }
 
 void incremental_query::modify(unsigned id, int amount)
@@ -717,29 +798,30 @@ void incremental_query::modify(unsigned id, int amount)
 	unsigned amount_to_add = query_cluster.add(id,amount);
 	unsigned amount_to_remove = amount_to_add - amount;
 
-	id_cluster_collection::id2cluster_map::iterator id_it = database->id2cluster.find(id);
-	if (id_it==database->id2cluster.end()) 
+	const id_cluster_collection::posting_list *postings = database->get_postings(id);
+	if (!postings) 
 		return;
 	float idf =  1;
 	
 	if (database->flags & id_cluster_collection::QUERY_IDF)
-		idf = database->idf(id_it);
+		idf = database->idf(id);
 
 	database->set_query_rules(database->flags);
 
 
-	for (id_cluster_collection::cluster_map::iterator cit=id_it->second.begin(); 
-			cit!=id_it->second.end(); ++cit) 
+	for (id_cluster_collection::posting_list::const_iterator pit=postings->begin(); 
+			pit!=postings->end(); ++pit) 
 	{
+		id_cluster *c = database->handles[pit->cluster];
 		float idf_n = idf;
 
 		if (database->flags & id_cluster_collection::QUERY_NORMALIZED_FREQ) 
-			idf_n = idf/cit->first->weighted_sum;
+			idf_n = idf/c->weighted_sum;
 
 		float score_to_add;
 		float score_to_remove;
 
-		float tf = cit->second;
+		float tf = pit->tf;
 		if (database->flags & id_cluster_collection::QUERY_BIN_FREQ) {
 			amount_to_remove = min(amount_to_remove, (unsigned)1);
 			amount_to_add = min(amount_to_add, (unsigned)1);
@@ -754,77 +836,90 @@ void incremental_query::modify(unsigned id, int amount)
 			score_to_remove = amount_to_remove * tf * idf_n;
 		}
 
-		cluster_score_map::iterator __i = scores.lower_bound(cit->first);
+		score_entry *e = find_score(pit->cluster, false);
 
-		float s;
-		if (__i == scores.end() || cit->first<(*__i).first) {
-			// the dot product does not contain an entry for cit->first
-			s = score_to_add;
-			if (s>0) scores.insert(__i, pair<id_cluster *, double>(cit->first, s));
+		if (!e) {
+			// the dot product does not contain an entry for c
+			if (score_to_add>0) {
+				e = find_score(pit->cluster, true);
+				e->score = score_to_add;
+				update_best(e - &scores[0], 0);
+			}
 			//assert(amount_to_remove==0);
 		} else {
-			s = __i->second + score_to_add - score_to_remove;
-			__i->second= s;
+			double old_score = e->score;
+			e->score = (float)(e->score + score_to_add - score_to_remove);
+			update_best(e - &scores[0], old_score);
 		}
 	}
 }
 
+bool incremental_query::ranks_before(unsigned a, unsigned b) const
+{
+	// same order as ranked_cluster. Normalization does not change it.
+	if (scores[a].score != scores[b].score) return scores[a].score > scores[b].score;
+	return database->handles[scores[a].cluster] < database->handles[scores[b].cluster];
+}
+
+void incremental_query::update_best(unsigned i, double old_score)
+{
+	if (!best_valid) return;
+	if (best < 0) {
+		best = i;
+	} else if ((int)i == best) {
+		// another cluster might now be ahead.
+		if (scores[i].score < old_score) best_valid = false;
+	} else if (ranks_before(i, best)) {
+		best = i;
+	}
+}
+
 incremental_query::iterator incremental_query::sort_results(unsigned max_results)
 {
-	if (!database) return end();
 	results.clear();
-	for (cluster_score_map::iterator it(scores.begin()); it!=scores.end(); ++it)
+	results_dirty=false;
+	if (!database) return end();
+	results.reserve(scores.size());
+	for (score_vector::iterator it(scores.begin()); it!=scores.end(); ++it)
 	{
-		float s = it->second;
-	        if (database->flags & id_cluster_collection::QUERY_NORMALIZED_FREQ) {
-			if ((database->flags & (id_cluster_collection::QUERY_MIN_FREQ | id_cluster_collection::QUERY_BIN_FREQ)) ==0)
-				s = s/(float)query_cluster.total;
-		}
-
-		if (results.size() < max_results) {
-			results.insert(ranked_cluster(it->first, s));
-		} else if (results.rbegin()->score < s) {
-			std::set< ranked_cluster >::iterator last(results.end());
-			--last;
-			results.erase(last);
-			results.insert(ranked_cluster(it->first, s));
-		}
+		id_cluster *c = database->handles[it->cluster];
+		if (c) results.push_back(ranked_cluster(c, normalized_score(*it)));
 	}
 
-	/*
-	for (set<ranked_cluster>::const_iterator it(results.begin()); it!=results.end(); ++it)
-	{
-		cout << "Entry " << it->c << " has score: " << it->score << endl;
+	// only the best max_results need to be sorted.
+	if (results.size() > max_results) {
+		std::partial_sort(results.begin(), results.begin() + max_results, results.end());
+		results.erase(results.begin() + max_results, results.end());
+	} else {
+		std::sort(results.begin(), results.end());
 	}
-	*/
 	return begin();
 }
 
 incremental_query::iterator incremental_query::sort_results_min_ratio(float ratio)
 {
-	if (!database) return end();
 	results.clear();
-	for (cluster_score_map::iterator it(scores.begin()); it!=scores.end(); ++it)
-	{
-		float s = it->second;
-	        if (database->flags & id_cluster_collection::QUERY_NORMALIZED_FREQ) {
-			if ((database->flags & (id_cluster_collection::QUERY_MIN_FREQ | id_cluster_collection::QUERY_BIN_FREQ)) ==0)
-				s = s/(float)query_cluster.total;
-		}
+	results_dirty=false;
+	if (!database) return end();
 
-		iterator first = begin();
-		if (first == end()) {
-			results.insert(ranked_cluster(it->first, s));
-		} else if (first->score*ratio < s) {
-			results.insert(ranked_cluster(it->first, s));
-		}
+	float best=0;
+	bool first=true;
+	for (score_vector::iterator it(scores.begin()); it!=scores.end(); ++it) {
+		if (database->handles[it->cluster] == 0) continue;
+		float s = normalized_score(*it);
+		if (first || s > best) best = s;
+		first = false;
 	}
 
-	iterator first = begin();
-	if (first != end()) {
-		ranked_cluster limit(0,first->score * ratio);
-		results.erase(lower_bound(begin(),end(), limit), end());
+	const float limit = best * ratio;
+	for (score_vector::iterator it(scores.begin()); it!=scores.end(); ++it)
+	{
+		id_cluster *c = database->handles[it->cluster];
+		if (c == 0) continue;
+		float s = normalized_score(*it);
+		if (s > limit) results.push_back(ranked_cluster(c, s));
 	}
+	std::sort(results.begin(), results.end());
 	return begin();
 }
 
@@ -888,12 +983,17 @@ void incremental_query::set(id_cluster *q)
 id_cluster *incremental_query::get_best(float *score)
 {
 	if (!database) return 0;
-	sort_results(5);
-	std::set< ranked_cluster >::iterator it = results.begin();
-	if (it!=results.end()) {
-		if (score) *score = it->score;
-		return it->c;
+
+	if (!best_valid || (best>=0 && database->handles[scores[best].cluster]==0)) {
+		best=-1;
+		for (unsigned i=0; i<scores.size(); ++i) {
+			if (database->handles[scores[i].cluster]==0) continue;
+			if (best<0 || ranks_before(i, best)) best=i;
+		}
+		best_valid=true;
 	}
-	return 0;
+	if (best<0) return 0;
+	if (score) *score = normalized_score(scores[best]);
+	return database->handles[scores[best].cluster];
 }
 
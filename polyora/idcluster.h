@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <map>
 #include <set>
+#include <vector>
 #include "vecmap.h"
 #include "preallocated.h"
 #include "sqlite3.h"
@@ -35,7 +36,7 @@ typedef unsigned cluster_id_t;
 class id_cluster {
 public:
 
-	id_cluster() : total(0), id(0), weighted_sum(0) {}
+	id_cluster() : total(0), id(0), weighted_sum(0), handle(~0u) {}
 	virtual ~id_cluster() {}
 
 	typedef std::map<unsigned, unsigned> uumap;
@@ -43,6 +44,8 @@ public:
 	unsigned total;
 	cluster_id_t id;
 	float weighted_sum;
+	//! index in id_cluster_collection::handles, when part of a collection.
+	unsigned handle;
 
 	// return the total cumulated in the bin 'id', after adding 'amount'.
 	unsigned add(unsigned id, int amount=1);
@@ -69,15 +72,22 @@ class id_cluster_collection {
 public:
 
 	typedef std::set<id_cluster *> cluster_set;
-	//typedef std::map<id_cluster *, float> cluster_map;
-	typedef vecmap<id_cluster *, float> cluster_map;
-	//typedef vecmap<unsigned, cluster_map> id2cluster_map;
-	typedef std::map<unsigned, cluster_map> id2cluster_map;
+
+	//! Entry of the inverted index: a cluster handle, and the frequency of an id in it.
+	struct posting {
+		unsigned cluster;
+		float tf;
+		posting(unsigned c, float tf) : cluster(c), tf(tf) {}
+		bool operator < (const posting &a) const { return cluster < a.cluster; }
+	};
+	typedef std::vector<posting> posting_list;
+	typedef std::vector<posting_list> inverted_index;
 
 	enum query_flags { QUERY_FREQ=0, QUERY_NORMALIZED_FREQ=1, QUERY_IDF=2, QUERY_MIN_FREQ=4, QUERY_BIN_FREQ = 8, QUERY_IDF_NORMALIZED=3 };
 	id_cluster_collection(query_flags flags);
 	virtual ~id_cluster_collection();
 
+	//! Merges clusters as long as two of them have a similarity above threshold.
 	void reduce(float threshold);
 
 	void add_cluster(id_cluster *c);
@@ -99,27 +109,48 @@ public:
 	bool load(const char *fn);
 	bool load(sqlite3 *db, const char *tablename=0);
 	void clear();
-	float idf(unsigned id);
-	float idf(id2cluster_map::iterator &id_it);
+	//! Inverse document frequency of id, 0 if no cluster contains it.
+	float idf(unsigned id) {
+		if (idf_full || !idf_dirty.empty() || idf_nb_clusters != clusters.size()) update_idf();
+		return (id < idf_table.size() ? idf_table[id] : 0);
+	}
+
+	//! The clusters containing id, or 0.
+	const posting_list *get_postings(unsigned id) const {
+		if (id >= inverted.size() || inverted[id].empty()) return 0;
+		return &inverted[id];
+	}
 
 	cluster_set clusters;
 
-	//! id2cluster[i][j].second contains the value of dimension i of the j'th vector with non-0 value at dim i.
-	id2cluster_map id2cluster;
-	std::map<unsigned, id_cluster *> best_cluster;
+	//! inverted[i] lists the clusters with a non-0 value at dim i, sorted by handle.
+	inverted_index inverted;
+	//! handle -> cluster. The slots of removed clusters are null, and reused.
+	std::vector<id_cluster *> handles;
+	//! best_cluster[i]: the cluster with the highest value at dim i.
+	std::vector<id_cluster *> best_cluster;
 
 protected:
 
-	struct cluster_dist_t {
-		id_cluster *a, *b;
-		float d;
-
-		cluster_dist_t(id_cluster *a, id_cluster *b, float d);
-		bool operator < (const cluster_dist_t &c) const;
-	};
-
-
-	std::set<cluster_dist_t> distance_matrix;
+	bool is_indexed(const id_cluster *c) const {
+		return c->handle < handles.size() && handles[c->handle] == c;
+	}
+	//! Set the frequency of id in cluster 'handle'. 0 removes the posting.
+	void set_posting(unsigned id, unsigned handle, float tf);
+
+	std::vector<unsigned> free_handles;
+	std::vector<float> idf_table;
+	/*! idf_table is valid for idf_nb_clusters clusters, except for the
+	 *  ids in idf_dirty, whose document frequency changed since. If
+	 *  idf_full is set, the whole table has to be computed again.
+	 */
+	unsigned idf_nb_clusters;
+	std::vector<unsigned> idf_dirty;
+	bool idf_full;
+	float cmp_idf(unsigned id) const;
+	void cmp_idf();
+	//! Recompute the entries of idf_dirty, or the whole table if needed.
+	void update_idf();
 
 public:
 	void get_scores(id_cluster *c, cluster_score_map &scores, id_cluster **best_c=0, float *_best_s=0);
@@ -127,9 +158,17 @@ public:
 	void set_query_rules(query_flags flags);
 
 protected:
-	void build_distance_matrix(float threshold);
-	void add_to_distance_matrix(id_cluster *c, float threshold);
-	void remove_from_distance_matrix(id_cluster *c);
+	//! Per-thread state for nearest_cluster().
+	struct score_accumulator {
+		std::vector<double> score;
+		std::vector<unsigned> touched;
+	};
+	/*! The cluster most similar to c, scored as get_scores() does, if the
+	 *  similarity is above threshold. Returns ~0u otherwise. Only reads the
+	 *  collection: the idf table has to be up to date.
+	 */
+	unsigned nearest_cluster(const id_cluster *c, float threshold,
+			score_accumulator &acc, float *sim) const;
 
 	int version;
 public:
@@ -146,8 +185,8 @@ class incremental_query {
 public:
 
 	struct ranked_cluster {
-		id_cluster * const c;
-		const float score;
+		id_cluster *c;
+		float score;
 		ranked_cluster(id_cluster *c, float s) : c(c), score(s) {}
 
 		bool operator< (const ranked_cluster &a) const { 
@@ -156,9 +195,10 @@ public:
 			return c<a.c;
 		}
 	};
-	typedef std::set<ranked_cluster> ranked_cluster_set;
-	typedef ranked_cluster_set::iterator iterator;
-	ranked_cluster_set results;
+	//! Sorted by decreasing score.
+	typedef std::vector<ranked_cluster> ranked_cluster_vector;
+	typedef ranked_cluster_vector::iterator iterator;
+	ranked_cluster_vector results;
 
 	//! Constructor. One option is to use the create_incremental_query() of visual_database.
 	incremental_query(id_cluster_collection *db);
@@ -174,14 +214,32 @@ public:
 	iterator sort_results(unsigned max_results=1);
 	iterator sort_results_min_ratio(float ratio);
 
-	iterator begin() { return results.begin(); }
+	/*! Marks the results out of date: the next begin() calls
+	 *  sort_results_min_ratio(ratio), so that ranking is done only when
+	 *  the results are read.
+	 */
+	void invalidate_results(float ratio) { results_ratio = ratio; results_dirty = true; }
+
+	iterator begin() { if (results_dirty) sort_results_min_ratio(results_ratio); return results.begin(); }
 	iterator end() { return results.end(); }
 
 	void clear();
+
+	/*! Best cluster and its score. The argmax is maintained by modify(), so
+	 *  the scores are ranked again only when the best one decreased.
+	 */
 	id_cluster *get_best(float *score);
 
+	struct score_entry {
+		//! handle of the cluster in database
+		unsigned cluster;
+		double score;
+		score_entry(unsigned c, double s) : cluster(c), score(s) {}
+	};
+	typedef std::vector<score_entry> score_vector;
+
 	// maintains non-zero, un-normalied dot product between 'query_cluster' and all clusters in 'database'.
-	cluster_score_map scores;
+	score_vector scores;
 	id_cluster query_cluster;
 	id_cluster_collection *database;
 
@@ -194,6 +252,29 @@ public:
 	int version;
 protected:
 	int flags;
+
+	/*! Open addressing table: hash of a cluster handle -> index in scores + 1.
+	 *  0 marks empty slots. A dense array indexed by handle would cost the
+	 *  size of the database for every track histogram.
+	 */
+	std::vector<unsigned> score_index;
+	unsigned score_index_bits;
+	//! Score of cluster 'handle', or 0 if it has none and create is false.
+	score_entry *find_score(unsigned handle, bool create);
+	void rehash_scores(unsigned bits);
+	//! score of e, normalized as the query flags require.
+	float normalized_score(const score_entry &e) const;
+
+	bool results_dirty;
+	float results_ratio;
+
+	//! index in scores of the best cluster, -1 if none. Valid if best_valid.
+	int best;
+	bool best_valid;
+	//! true if scores[a] ranks before scores[b].
+	bool ranks_before(unsigned a, unsigned b) const;
+	//! keeps 'best' up to date after scores[i] changed from old_score.
+	void update_best(unsigned i, double old_score);
 };
 
 
@@ -31,6 +31,8 @@
 #include <math.h>
 #include <stdlib.h>
 #include <map>
+#include <float.h>
+#include <algorithm>
 #ifdef _OPENMP
 #include <omp.h>
 #endif
@@ -60,11 +62,10 @@ node_t::node_t() {
 		clusters[i] = 0;
 }
 
-#ifdef _OPENMP
-omp_lock_t lock;
-int thread_count=1;
-#endif
-
+/*! Subtrees are split in OpenMP tasks: idle threads pick up pending
+ * subtrees, or chunks of a large node being clustered. Call it from a
+ * single thread of a parallel region to use all threads.
+ */
 void node_t::recursive_split(int max_level, int min_elem, int level) {
 	if (level >= max_level) {
 		std::cout << "stopping splitting at depth " << level << ", with " 
@@ -80,27 +81,14 @@ void node_t::recursive_split(int max_level, int min_elem, int level) {
 				<< data.size() << " elements\n";
 		}
 	}
+	for (unsigned i=0; i<nb_branches; i++) {
+		node_t *child = clusters[i];
+		if (!child) continue;
 #ifdef _OPENMP
-	omp_set_lock(&lock);
-	int thread_add=0;
-	if(thread_count<8) {
-		omp_set_nested(1);
-		thread_add=3;
-		thread_count+=thread_add;
-	} else { 
-		omp_set_nested(0);
-	}
-	omp_unset_lock(&lock);
-#pragma omp parallel for
-#endif
-	for (int i=0; (unsigned)i<nb_branches; i++)
-		if (clusters[i])
-			clusters[i]->recursive_split(max_level, min_elem, level+1);
-#ifdef _OPENMP
-	omp_set_lock(&lock);
-	thread_count-=thread_add;
-	omp_unset_lock(&lock);
+#pragma omp task firstprivate(child)
 #endif
+		child->recursive_split(max_level, min_elem, level+1);
+	}
 }
 
 unsigned node_t::get_id(descriptor_t *descr, node_t **node, int depth)
@@ -174,103 +162,176 @@ int node_t::best_cluster(descriptor_t *data)
 }
 
 
+namespace {
+//! A slice of the data of a node, with its own accumulators.
+struct kmean_chunk {
+	unsigned begin, end;
+	double sum[nb_branches][descriptor_size];
+	unsigned count[nb_branches];
+	unsigned changed;
+	//! k-means++ seeding: sum of squared distances to the closest center.
+	double weight;
+};
+
+//! xorshift generator: drand48() has a global state, shared by the tasks.
+inline double random_unit(unsigned long long *state)
+{
+	unsigned long long x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return ((x * 2685821657736338717ULL) >> 11) * (1.0/9007199254740992.0);
+}
+
+void seed_chunk(kmean_chunk *chunk, const descriptor_array &data, mean_t *center, float *dist)
+{
+	chunk->weight = 0;
+	for (unsigned j=chunk->begin; j<chunk->end; ++j) {
+		float d = center->distance(data[j]);
+		if (d < dist[j]) dist[j] = d;
+		chunk->weight += dist[j];
+	}
+}
+
+void assign_chunk(kmean_chunk *chunk, node_t *node, const descriptor_array &data, unsigned char *assignment)
+{
+	memset(chunk->sum, 0, sizeof(chunk->sum));
+	memset(chunk->count, 0, sizeof(chunk->count));
+	chunk->changed = 0;
+	for (unsigned j=chunk->begin; j<chunk->end; ++j) {
+		unsigned best = node->best_cluster(data[j]);
+		if (assignment[j] != best) {
+			assignment[j] = best;
+			chunk->changed++;
+		}
+		chunk->count[best]++;
+		double *sum = chunk->sum[best];
+		const float *d = data[j]->descriptor;
+		for (unsigned i=0; i<descriptor_size; ++i)
+			sum[i] += d[i];
+	}
+}
+}  // namespace
+
+/*! Lloyd's k-means with k-means++ seeding. Assignment runs on chunks of the
+ * data, as OpenMP tasks, each with its own accumulators. The chunks are
+ * reduced in order, so the result does not depend on the number of threads.
+ */
 void node_t::run_kmean(int nb_iter) 
 {
-	bool online_kmean = false;
-	int n = data.size();
-	int k = nb_branches;
+	const unsigned n = data.size();
+	const unsigned k = nb_branches;
 
 	assert(n>k);
 	assert(k>=2);
 
-	std::vector<float> counter(k, 0);
-	std::vector<mean_t> new_mean(k);
-
 	std::cout << "(starting k-mean:" ;
 	std::cout << " total: "<< n << ")" << std::endl;
 
-	// initialization: randomly pick some data to initialize the centers
-	for (int i=0; i<k; i++) {
-				
-		int nb_init=1;
-		unsigned d = drand48()*n;
-		clusters[i]->mean.accumulate(0, 1.0f/nb_init, data[d]);
-		for (int k=1; k<nb_init; k++) {
-			d = drand48()*n;
-			clusters[i]->mean.accumulate(1, 1.0f/nb_init, data[d]);
+	const unsigned chunk_size = 4096;
+	const unsigned nb_chunks = (n + chunk_size - 1) / chunk_size;
+	std::vector<kmean_chunk> chunks(nb_chunks);
+	for (unsigned c=0; c<nb_chunks; ++c) {
+		chunks[c].begin = c*chunk_size;
+		chunks[c].end = std::min(n, (c+1)*chunk_size);
+	}
+	kmean_chunk *chunk_ptr = &chunks[0];
+	descriptor_array *data_ptr = &data;
+
+	// deterministic seed, whatever the task scheduling.
+	unsigned long long rng = 0x9e3779b97f4a7c15ULL ^ ((unsigned long long) n << 32);
+	unsigned first_bits;
+	memcpy(&first_bits, &data[0]->descriptor[0], sizeof(first_bits));
+	rng ^= first_bits;
+	if (rng == 0) rng = 1;
+
+	// k-means++: pick each new center with a probability proportional to the
+	// squared distance to the closest center chosen so far.
+	std::vector<float> dist(n, FLT_MAX);
+	float *dist_ptr = &dist[0];
+	clusters[0]->mean.accumulate(0, 1, data[(unsigned)(random_unit(&rng)*n) % n]);
+	for (unsigned i=1; i<k; i++) {
+		mean_t *center = &clusters[i-1]->mean;
+		for (unsigned c=0; c<nb_chunks; ++c) {
+			kmean_chunk *chunk = chunk_ptr + c;
+#ifdef _OPENMP
+#pragma omp task firstprivate(chunk, center) if(nb_chunks>1)
+#endif
+			seed_chunk(chunk, *data_ptr, center, dist_ptr);
+		}
+#ifdef _OPENMP
+#pragma omp taskwait
+#endif
+		double total=0;
+		for (unsigned c=0; c<nb_chunks; ++c) total += chunks[c].weight;
+
+		unsigned pick = (unsigned)(random_unit(&rng)*n) % n;
+		if (total > 0) {
+			double r = random_unit(&rng)*total;
+			unsigned c=0;
+			while (c+1<nb_chunks && r >= chunks[c].weight) r -= chunks[c++].weight;
+			pick = chunks[c].end-1;
+			for (unsigned j=chunks[c].begin; j<chunks[c].end; ++j) {
+				r -= dist[j];
+				if (r < 0) { pick=j; break; }
+			}
 		}
+		clusters[i]->mean.accumulate(0, 1, data[pick]);
 	}
+	dist.clear();
+
+	std::vector<unsigned char> assignment(n, 0xff);
+	unsigned char *assignment_ptr = &assignment[0];
+	std::vector<unsigned> counter(k, 0);
+	std::vector<double> sum(descriptor_size);
 
 	for (int iter=0;iter<nb_iter;iter++) {
 
-		// reset counters
-		for (int i=0; i<k; i++) {
-			counter[i]=0;
+		for (unsigned c=0; c<nb_chunks; ++c) {
+			kmean_chunk *chunk = chunk_ptr + c;
+#ifdef _OPENMP
+#pragma omp task firstprivate(chunk) if(nb_chunks>1)
+#endif
+			assign_chunk(chunk, this, *data_ptr, assignment_ptr);
 		}
+#ifdef _OPENMP
+#pragma omp taskwait
+#endif
 
-		// process data
-		for (int j=0; j<n; j++) {
-
-			// find nearest cluster
-			std::multimap<double,int> scores;
-			cmp_scores(scores, data[j]);
-
-			std::multimap<double,int>::iterator b = scores.begin();
-			std::multimap<double,int>::iterator b2 = b;
-			++b2;
-
-			int best_m = b->second;
-
-			if (iter==nb_iter-1) {
-				// last iteration, save cluster attribution
-				clusters[best_m]->data.push_back(data[j]);
-				if (0 && b2->first/b->first > .98) {
-					// too close to the border!
-					clusters[b2->second]->data.push_back(data[j]);
-				}
-			}
-
-			// update center
-			counter[best_m] += 1;
-			if (online_kmean) {
-				clusters[best_m]->mean.accumulate(.95, .05, data[j]);
-			} else {
-				new_mean[best_m].accumulate(
-						(counter[best_m]-1.0f)/counter[best_m], 
-						1.0f/counter[best_m], 
-						data[j]);
+		// update centers
+		unsigned changed=0;
+		for (unsigned c=0; c<nb_chunks; ++c) changed += chunks[c].changed;
+		for (unsigned i=0; i<k; i++) {
+			counter[i]=0;
+			std::fill(sum.begin(), sum.end(), 0.0);
+			for (unsigned c=0; c<nb_chunks; ++c) {
+				counter[i] += chunks[c].count[i];
+				for (unsigned j=0; j<descriptor_size; j++)
+					sum[j] += chunks[c].sum[i][j];
 			}
+			if (counter[i]==0) continue;
+			for (unsigned j=0; j<descriptor_size; j++) 
+				clusters[i]->mean.mean[j] = (float)(sum[j] / counter[i]);
 		}
+		if (changed==0) break;
+	}
 
-		/*
-		   for (int i=0; i<k; i++) {
-		   	std::cout << "C" << i << ":" << counter[i] << ":";
-		   	for (int j=0; j<16; j++) 
-		   		std::cout << " " << clusters[i]->mean.mean[j];
-		   	std::cout << std::endl;
-		   }
-		 */
+	// save cluster attribution
+	for (unsigned j=0; j<n; j++)
+		clusters[assignment[j]]->data.push_back(data[j]);
 
-		if (!online_kmean) 
-			for (int i=0; i<k; i++) {
-				for (unsigned j=0; j<descriptor_size; j++) 
-					clusters[i]->mean.mean[j] = new_mean[i].mean[j];
-			}
-	}
-	for (int i=0; i<k; i++) {
+	// drop empty clusters, keeping the others first: best_cluster needs clusters[0].
+	unsigned kept=0;
+	for (unsigned i=0; i<k; i++) {
 		if (counter[i]==0) {
-			if (clusters[i]->data.size()>0) {
-				std::cout << "Warning, killing a cluster with " << clusters[i]->data.size()
-					<< " elements in it!\n";
-			}
 			delete clusters[i];
-			clusters[i]=0;
-		}
-		else {
+		} else {
 			std::cout << "  C" << i << ": " << clusters[i]->data.size();
-			//for (int j=0; j<16; j++) std::cout << " " << clusters[i].mean.mean[j];
+			clusters[kept++] = clusters[i];
 		}
 	}
+	for (unsigned i=kept; i<k; i++) clusters[i]=0;
 	std::cout << std::endl;
 }
 
@@ -331,6 +392,450 @@ float mean_t::distance(descriptor_t *d) {
 	}
 }
 
+static void *aligned_bytes(size_t n)
+{
+#ifdef WIN32
+	return _aligned_malloc(n, 64);
+#else
+	void *p=0;
+	if (posix_memalign(&p, 64, n)) return 0;
+	return p;
+#endif
+}
+
+static void aligned_free(void *p)
+{
+#ifdef WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+unsigned short kmean_tree::float_to_half(float f)
+{
+	union { float f; unsigned u; } v;
+	v.f = f;
+	unsigned short sign = (v.u >> 16) & 0x8000;
+	unsigned u = v.u & 0x7fffffff;
+
+	if (u < 0x38800000) {
+		// below the smallest normal half: denormal or zero.
+		return sign | (unsigned short) (fabsf(f) * 16777216.0f + .5f);
+	}
+	unsigned h = (u - 0x38000000) >> 13;
+	unsigned rem = u & 0x1fff;
+	if (rem > 0x1000 || (rem == 0x1000 && (h&1))) ++h;
+	if (h > 0x7bff) h = 0x7bff;
+	return sign | h;
+}
+
+float kmean_tree::half_to_float(unsigned short h)
+{
+	union { float f; unsigned u; } v;
+	v.u = (unsigned)(h & 0x7fff) << 13;
+	v.f *= 5.192296858534828e33f; // 2^112
+	v.u |= (unsigned)(h & 0x8000) << 16;
+	return v.f;
+}
+
+void kmean_tree::quantize_int8(const float *src, unsigned n, float *scale, float *offset, signed char *dst, unsigned stride)
+{
+	float lo = src[0], hi = src[0];
+	for (unsigned i=1; i<n; ++i) {
+		if (src[i] < lo) lo = src[i];
+		if (src[i] > hi) hi = src[i];
+	}
+	*offset = .5f*(lo+hi);
+	*scale = (hi>lo ? (hi-lo)/254.0f : 1.0f);
+	for (unsigned i=0; i<n; ++i) {
+		int q = (int) floorf((src[i] - *offset) / *scale + .5f);
+		dst[i*stride] = (signed char) std::max(-127, std::min(127, q));
+	}
+}
+
+//! Size of the means block of a node, a multiple of 64.
+static unsigned block_bytes(centroid_format_t format)
+{
+	switch (format) {
+		case CENTROID_HALF: return descriptor_size*nb_branches*sizeof(unsigned short);
+		case CENTROID_INT8: return 64 + descriptor_size*nb_branches;
+		default: return descriptor_size*nb_branches*sizeof(float);
+	}
+}
+
+flat_tree::flat_tree(node_t *root, centroid_format_t format) : mean_blocks(0), format(format)
+{
+	// breadth first: the children of a node are contiguous.
+	std::vector<node_t *> order;
+	order.push_back(root);
+	nodes.resize(1);
+	unsigned nb_internal=0;
+	for (unsigned i=0; i<order.size(); ++i) {
+		node_t *n = order[i];
+		flat_node &f = nodes[i];
+		f.node = n;
+		f.id = n->id;
+		f.means = 0;
+		f.first_child = 0;
+		f.nb_children = 0;
+		if (n->is_leaf()) {
+			if (f.id >= leaf_index.size()) leaf_index.resize(f.id+1, 0);
+			leaf_index[f.id] = i;
+			continue;
+		}
+		f.first_child = order.size();
+		for (unsigned c=0; c<nb_branches; ++c) {
+			if (n->clusters[c]) {
+				order.push_back(n->clusters[c]);
+				f.nb_children++;
+			}
+		}
+		nodes.resize(order.size());
+		for (unsigned c=f.first_child; c<nodes.size(); ++c)
+			nodes[c].parent = i;
+		nb_internal++;
+	}
+	nodes[0].parent = 0;
+
+	const unsigned block = block_bytes(format);
+	blocks_size = (size_t) block*nb_internal;
+	mean_blocks = (char *) aligned_bytes(blocks_size);
+	assert(mean_blocks);
+	char *m = mean_blocks;
+	for (unsigned i=0; i<nodes.size(); ++i) {
+		flat_node &f = nodes[i];
+		if (f.nb_children==0) continue;
+		memset(m, 0, block);
+		for (unsigned c=0; c<f.nb_children; ++c) {
+			const float *src = nodes[f.first_child+c].node->mean.mean;
+			switch (format) {
+				case CENTROID_FLOAT:
+					for (unsigned j=0; j<descriptor_size; ++j)
+						((float *)m)[j*nb_branches + c] = src[j];
+					break;
+				case CENTROID_HALF:
+					for (unsigned j=0; j<descriptor_size; ++j)
+						((unsigned short *)m)[j*nb_branches + c] = float_to_half(src[j]);
+					break;
+				case CENTROID_INT8: {
+					// [scale x4][offset x4] header, then the codes.
+					float *header = (float *)m;
+					quantize_int8(src, descriptor_size, header + c, header + nb_branches + c,
+							(signed char *)(m + 64) + c, nb_branches);
+					break;
+				}
+			}
+		}
+		f.means = m;
+		m += block;
+	}
+}
+
+flat_tree::~flat_tree()
+{
+	aligned_free(mean_blocks);
+}
+
+unsigned flat_tree::nb_leaves() const
+{
+	unsigned n=0;
+	for (unsigned i=0; i<nodes.size(); ++i)
+		if (nodes[i].nb_children==0) n++;
+	return n;
+}
+
+bool flat_tree::leaf_mean(unsigned id, float mean[descriptor_size]) const
+{
+	// the root has no stored mean.
+	if (id >= leaf_index.size() || leaf_index[id]==0) return false;
+	const flat_node &parent = nodes[nodes[leaf_index[id]].parent];
+	const unsigned c = leaf_index[id] - parent.first_child;
+	const char *m = (const char *) parent.means;
+	switch (format) {
+		case CENTROID_FLOAT:
+			for (unsigned j=0; j<descriptor_size; ++j)
+				mean[j] = ((const float *)m)[j*nb_branches + c];
+			break;
+		case CENTROID_HALF:
+			for (unsigned j=0; j<descriptor_size; ++j)
+				mean[j] = half_to_float(((const unsigned short *)m)[j*nb_branches + c]);
+			break;
+		case CENTROID_INT8: {
+			const float *header = (const float *)m;
+			const signed char *codes = (const signed char *)(m + 64);
+			for (unsigned j=0; j<descriptor_size; ++j)
+				mean[j] = codes[j*nb_branches + c]*header[c] + header[nb_branches + c];
+			break;
+		}
+	}
+	return true;
+}
+
+void flat_tree::forget_source()
+{
+	for (unsigned i=0; i<nodes.size(); ++i)
+		nodes[i].node = 0;
+}
+
+static inline unsigned closest(const __m128 dist, unsigned nb_children)
+{
+	fvec4 d(dist);
+	unsigned best=0;
+	for (unsigned c=1; c<nb_children; ++c)
+		if (d[c] < d[best]) best=c;
+	return best;
+}
+
+namespace {
+/*! Readers for the means blocks. load() returns the coordinates i..i+3 of
+ * the 4 children, r[k] holding coordinate i+k.
+ */
+struct float_means {
+	const float *m;
+	float_means(const void *block) : m((const float *) block) {}
+	void load(unsigned i, __m128 r[4]) const {
+		const float *p = m + i*nb_branches;
+		r[0] = _mm_load_ps(p);
+		r[1] = _mm_load_ps(p+4);
+		r[2] = _mm_load_ps(p+8);
+		r[3] = _mm_load_ps(p+12);
+	}
+};
+
+struct half_means {
+	const unsigned short *m;
+	half_means(const void *block) : m((const unsigned short *) block) {}
+
+	//! converts 4 halves, zero extended to 32 bits. No inf or nan.
+	static __m128 to_float(__m128i h) {
+		__m128i sign = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x8000)), 16);
+		__m128i mag = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x7fff)), 13);
+		__m128 f = _mm_mul_ps(_mm_castsi128_ps(mag), _mm_castsi128_ps(_mm_set1_epi32(0x77800000)));
+		return _mm_or_ps(f, _mm_castsi128_ps(sign));
+	}
+	void load(unsigned i, __m128 r[4]) const {
+		const __m128i zero = _mm_setzero_si128();
+		__m128i a = _mm_load_si128((const __m128i *)(m + i*nb_branches));
+		__m128i b = _mm_load_si128((const __m128i *)(m + i*nb_branches + 8));
+		r[0] = to_float(_mm_unpacklo_epi16(a, zero));
+		r[1] = to_float(_mm_unpackhi_epi16(a, zero));
+		r[2] = to_float(_mm_unpacklo_epi16(b, zero));
+		r[3] = to_float(_mm_unpackhi_epi16(b, zero));
+	}
+};
+
+struct int8_means {
+	const signed char *m;
+	__m128 scale, offset;
+	int8_means(const void *block) {
+		const float *header = (const float *) block;
+		scale = _mm_load_ps(header);
+		offset = _mm_load_ps(header + 4);
+		m = (const signed char *) block + 64;
+	}
+	__m128 to_float(__m128i q16) const {
+		__m128 f = _mm_cvtepi32_ps(_mm_srai_epi32(q16, 16));
+		return _mm_add_ps(_mm_mul_ps(f, scale), offset);
+	}
+	void load(unsigned i, __m128 r[4]) const {
+		__m128i x = _mm_load_si128((const __m128i *)(m + i*nb_branches));
+		// sign extend to 16 bits, then to 32 bits.
+		__m128i lo = _mm_srai_epi16(_mm_unpacklo_epi8(x, x), 8);
+		__m128i hi = _mm_srai_epi16(_mm_unpackhi_epi8(x, x), 8);
+		r[0] = to_float(_mm_unpacklo_epi16(lo, lo));
+		r[1] = to_float(_mm_unpackhi_epi16(lo, lo));
+		r[2] = to_float(_mm_unpacklo_epi16(hi, hi));
+		r[3] = to_float(_mm_unpackhi_epi16(hi, hi));
+	}
+};
+
+/*! Computes the distance to the 4 children at once. Partial sums are
+ * accumulated in the same order as sseDistance, so with float means the
+ * result is bit-identical to node_t::best_cluster.
+ */
+template <class means_t>
+unsigned best_child_kernel(const means_t &means, const float *d, unsigned nb_children)
+{
+	assert(nb_branches == 4);
+	__m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+	__m128 acc2 = _mm_setzero_ps(), acc3 = _mm_setzero_ps();
+	__m128 m[4];
+	for (unsigned i=0; i<descriptor_size; i+=4) {
+		means.load(i, m);
+		__m128 v = _mm_loadu_ps(d+i);
+		__m128 d0 = _mm_sub_ps(_mm_shuffle_ps(v, v, 0x00), m[0]);
+		__m128 d1 = _mm_sub_ps(_mm_shuffle_ps(v, v, 0x55), m[1]);
+		__m128 d2 = _mm_sub_ps(_mm_shuffle_ps(v, v, 0xaa), m[2]);
+		__m128 d3 = _mm_sub_ps(_mm_shuffle_ps(v, v, 0xff), m[3]);
+		acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+		acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+		acc2 = _mm_add_ps(acc2, _mm_mul_ps(d2, d2));
+		acc3 = _mm_add_ps(acc3, _mm_mul_ps(d3, d3));
+	}
+	return closest(_mm_add_ps(_mm_add_ps(acc0, acc2), _mm_add_ps(acc1, acc3)), nb_children);
+}
+
+/*! Interleaving two descriptors hides the latency of the additions, while
+ * each distance is still accumulated in the sseDistance order.
+ */
+template <class means_t>
+void best_children_kernel(const means_t &means, const float *da, const float *db,
+		unsigned nb_children, unsigned *best_a, unsigned *best_b)
+{
+	__m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps();
+	__m128 a2 = _mm_setzero_ps(), a3 = _mm_setzero_ps();
+	__m128 b0 = _mm_setzero_ps(), b1 = _mm_setzero_ps();
+	__m128 b2 = _mm_setzero_ps(), b3 = _mm_setzero_ps();
+	__m128 m[4];
+	for (unsigned i=0; i<descriptor_size; i+=4) {
+		means.load(i, m);
+		__m128 v = _mm_loadu_ps(da+i);
+		__m128 w = _mm_loadu_ps(db+i);
+		__m128 d;
+		d = _mm_sub_ps(_mm_shuffle_ps(v, v, 0x00), m[0]); a0 = _mm_add_ps(a0, _mm_mul_ps(d, d));
+		d = _mm_sub_ps(_mm_shuffle_ps(w, w, 0x00), m[0]); b0 = _mm_add_ps(b0, _mm_mul_ps(d, d));
+		d = _mm_sub_ps(_mm_shuffle_ps(v, v, 0x55), m[1]); a1 = _mm_add_ps(a1, _mm_mul_ps(d, d));
+		d = _mm_sub_ps(_mm_shuffle_ps(w, w, 0x55), m[1]); b1 = _mm_add_ps(b1, _mm_mul_ps(d, d));
+		d = _mm_sub_ps(_mm_shuffle_ps(v, v, 0xaa), m[2]); a2 = _mm_add_ps(a2, _mm_mul_ps(d, d));
+		d = _mm_sub_ps(_mm_shuffle_ps(w, w, 0xaa), m[2]); b2 = _mm_add_ps(b2, _mm_mul_ps(d, d));
+		d = _mm_sub_ps(_mm_shuffle_ps(v, v, 0xff), m[3]); a3 = _mm_add_ps(a3, _mm_mul_ps(d, d));
+		d = _mm_sub_ps(_mm_shuffle_ps(w, w, 0xff), m[3]); b3 = _mm_add_ps(b3, _mm_mul_ps(d, d));
+	}
+	*best_a = closest(_mm_add_ps(_mm_add_ps(a0, a2), _mm_add_ps(a1, a3)), nb_children);
+	*best_b = closest(_mm_add_ps(_mm_add_ps(b0, b2), _mm_add_ps(b1, b3)), nb_children);
+}
+}  // namespace
+
+unsigned flat_tree::best_child(const flat_node &n, const float *d) const
+{
+	switch (format) {
+		case CENTROID_HALF: return best_child_kernel(half_means(n.means), d, n.nb_children);
+		case CENTROID_INT8: return best_child_kernel(int8_means(n.means), d, n.nb_children);
+		default: return best_child_kernel(float_means(n.means), d, n.nb_children);
+	}
+}
+
+void flat_tree::best_children(const flat_node &n, const float *da, const float *db,
+		unsigned *best_a, unsigned *best_b) const
+{
+	switch (format) {
+		case CENTROID_HALF:
+			best_children_kernel(half_means(n.means), da, db, n.nb_children, best_a, best_b);
+			break;
+		case CENTROID_INT8:
+			best_children_kernel(int8_means(n.means), da, db, n.nb_children, best_a, best_b);
+			break;
+		default:
+			best_children_kernel(float_means(n.means), da, db, n.nb_children, best_a, best_b);
+	}
+}
+
+void flat_tree::descend(const unsigned *active, const unsigned *from, unsigned *cur,
+		const descriptor_t *const *d, int begin, int end) const
+{
+	for (int j=begin; j<end; j+=2) {
+		unsigned a = active[j];
+		const flat_node &node_a = nodes[from[j]];
+		if (j+1 < end) {
+			unsigned b = active[j+1];
+			const flat_node &node_b = nodes[from[j+1]];
+			unsigned best_a, best_b;
+			if (&node_a == &node_b) {
+				best_children(node_a, d[a]->descriptor, d[b]->descriptor, &best_a, &best_b);
+			} else {
+				best_a = best_child(node_a, d[a]->descriptor);
+				best_b = best_child(node_b, d[b]->descriptor);
+			}
+			cur[a] = node_a.first_child + best_a;
+			cur[b] = node_b.first_child + best_b;
+		} else {
+			cur[a] = node_a.first_child + best_child(node_a, d[a]->descriptor);
+		}
+	}
+}
+
+void flat_tree::get_ids(unsigned n, const descriptor_t *const *d, unsigned *ids, node_t **leaves) const
+{
+	descent_buffers buf;
+	get_ids(n, d, ids, leaves, buf);
+}
+
+void flat_tree::get_ids(unsigned n, const descriptor_t *const *d, unsigned *ids, node_t **leaves,
+		descent_buffers &buf) const
+{
+	if (n==0) return;
+
+	// current node of each descriptor, and descriptors not on a leaf yet.
+	std::vector<unsigned> &cur(buf.cur), &active(buf.active), &next(buf.next), &from(buf.from);
+	cur.assign(n, 0);
+	active.resize(n);
+	for (unsigned i=0; i<n; ++i) active[i]=i;
+	if (nodes[0].nb_children==0) active.clear();
+
+	// active is kept grouped by node: all descriptors start at the root,
+	// and each group is split by child after every level.
+	next.resize(n);
+	from.resize(n);
+	while (!active.empty()) {
+		const int na = active.size();
+		for (int j=0; j<na; ++j) from[j] = cur[active[j]];
+
+		const unsigned *pa = &active[0], *pf = &from[0];
+		unsigned *pc = &cur[0];
+		// chunks are even: pairs are not split.
+		const int chunk = 64;
+#ifdef _OPENMP
+		// within a pipeline slot, a nested parallel region would get a
+		// single thread: the work is given as tasks to the team instead.
+		if (omp_in_parallel()) {
+			for (int c=0; c<na; c+=chunk) {
+#pragma omp task firstprivate(c)
+				descend(pa, pf, pc, d, c, std::min(c+chunk, na));
+			}
+#pragma omp taskwait
+		} else {
+#pragma omp parallel for schedule(static)
+			for (int c=0; c<na; c+=chunk)
+				descend(pa, pf, pc, d, c, std::min(c+chunk, na));
+		}
+#else
+		descend(pa, pf, pc, d, 0, na);
+#endif
+
+		unsigned remaining=0;
+		for (int start=0; start<na; ) {
+			const flat_node &parent = nodes[from[start]];
+			int end=start+1;
+			while (end<na && from[end] == from[start]) ++end;
+			for (unsigned c=parent.first_child; c<parent.first_child+parent.nb_children; ++c) {
+				if (nodes[c].nb_children==0) continue;
+				for (int j=start; j<end; ++j)
+					if (cur[active[j]] == c)
+						next[remaining++] = active[j];
+			}
+			start=end;
+		}
+		active.swap(next);
+		active.resize(remaining);
+		next.resize(n);
+	}
+
+	for (unsigned i=0; i<n; ++i) {
+		ids[i] = nodes[cur[i]].id;
+		if (leaves) leaves[i] = nodes[cur[i]].node;
+	}
+}
+
+unsigned flat_tree::get_id(const descriptor_t *d, node_t **node) const
+{
+	const flat_node *n = &nodes[0];
+	while (n->nb_children)
+		n = &nodes[n->first_child + best_child(*n, d->descriptor)];
+	if (node) *node = n->node;
+	return n->id;
+}
+
 bool node_t::save(const char *filename) 
 {
 	/*
@@ -354,7 +859,52 @@ bool node_t::save(const char *filename)
 	return true;
 }
 
-bool node_t::save_to_database(const char *fn)
+/*! Database blob of a mean. Each format has a different size, which is how
+ * load() recognizes it:
+ * CENTROID_FLOAT: descriptor_size floats,
+ * CENTROID_HALF: descriptor_size halves,
+ * CENTROID_INT8: scale, offset, and descriptor_size signed chars.
+ */
+static int encode_mean(const mean_t &m, centroid_format_t format, unsigned char *blob)
+{
+	switch (format) {
+		case CENTROID_HALF: {
+			unsigned short *h = (unsigned short *) blob;
+			for (unsigned i=0; i<descriptor_size; ++i) h[i] = float_to_half(m.mean[i]);
+			return descriptor_size*sizeof(unsigned short);
+		}
+		case CENTROID_INT8: {
+			float *header = (float *) blob;
+			quantize_int8(m.mean, descriptor_size, header, header+1, (signed char *)(header+2));
+			return 2*sizeof(float) + descriptor_size;
+		}
+		default:
+			memcpy(blob, m.mean, sizeof(m.mean));
+			return sizeof(m.mean);
+	}
+}
+
+static bool decode_mean(const void *blob, int size, mean_t *m, centroid_format_t *format)
+{
+	if (size == (int) sizeof(m->mean)) {
+		memcpy(m->mean, blob, sizeof(m->mean));
+		*format = CENTROID_FLOAT;
+	} else if (size == (int) (descriptor_size*sizeof(unsigned short))) {
+		const unsigned short *h = (const unsigned short *) blob;
+		for (unsigned i=0; i<descriptor_size; ++i) m->mean[i] = half_to_float(h[i]);
+		*format = CENTROID_HALF;
+	} else if (size == (int) (2*sizeof(float) + descriptor_size)) {
+		const float *header = (const float *) blob;
+		const signed char *q = (const signed char *)(header+2);
+		for (unsigned i=0; i<descriptor_size; ++i) m->mean[i] = q[i]*header[0] + header[1];
+		*format = CENTROID_INT8;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+bool node_t::save_to_database(const char *fn, centroid_format_t format)
 {
 	char *errmsg=0;
 	sqlite3 *sql3;
@@ -392,7 +942,7 @@ bool node_t::save_to_database(const char *fn)
 	assert(rc==0);
 	
 	sqlite3_exec(sql3,"begin",0,0,0);
-	if (save(sql3, insert_node, insert_child)) {
+	if (save(sql3, insert_node, insert_child, format)) {
 		sqlite3_bind_int64(insert_child, 1, 0);
 		sqlite3_bind_int64(insert_child, 2, (sqlite3_int64) this);
 		sqlite3_step(insert_child);
@@ -409,7 +959,7 @@ bool node_t::save_to_database(const char *fn)
 }
 
 
-node_t *kmean_tree::load(sqlite3 *db)
+node_t *kmean_tree::load(sqlite3 *db, centroid_format_t *format)
 {
 	if (db==0) return 0;
 
@@ -436,8 +986,12 @@ node_t *kmean_tree::load(sqlite3 *db)
 		node->id = sqlite3_column_int(stmt, 1);
 		nodes[ptr] = node;
 		int sz = sqlite3_column_bytes(stmt,2);
-		assert(sz == sizeof(node->mean));
-		memcpy(&node->mean, sqlite3_column_blob(stmt, 2), sizeof(node->mean));
+		centroid_format_t f;
+		if (!decode_mean(sqlite3_column_blob(stmt, 2), sz, &node->mean, &f)) {
+			cerr << "tree node " << ptr << ": unexpected mean size " << sz << endl;
+			assert(0);
+		}
+		if (format) *format = f;
 	}
 	sqlite3_finalize(stmt);
 
@@ -518,6 +1072,7 @@ node_t *kmean_tree::load(const char *filename)
 #include <fcntl.h>
 
 #include <string>
+#include <sstream>
 using namespace std;
 void save_node_images(string prefix, kmean_tree::node_t *node);
 
@@ -582,7 +1137,8 @@ node_t *kmean_tree::build_from_data(const char *filename, int max_level, int min
 
 	std::cout << "Data loaded. Starting k-mean."<<std::endl;
 #ifdef _OPENMP
-	omp_init_lock(&lock);
+#pragma omp parallel
+#pragma omp single
 #endif
 	root->recursive_split(max_level, min_elem);
 
@@ -602,6 +1158,353 @@ node_t *kmean_tree::build_from_data(const char *filename, int max_level, int min
 
 }
 
+namespace {
+//! Sequential, chunked access to a descriptor file.
+class packet_stream {
+public:
+	packet_stream() : nb(0) {
+#ifdef WIN32
+		file=0;
+#else
+		fd=-1; data=0; bytes=0;
+#endif
+	}
+	~packet_stream() { close(); }
+
+	bool open(const char *fn) {
+#ifdef WIN32
+		file = fopen(fn, "rb");
+		if (!file) { perror(fn); return false; }
+		fseek(file, 0, SEEK_END);
+		nb = ftell(file) / sizeof(descr_file_packet);
+		fseek(file, 0, SEEK_SET);
+#else
+		fd = ::open(fn, O_RDONLY);
+		if (fd<0) { perror(fn); return false; }
+		struct stat statbuf;
+		if (fstat(fd, &statbuf) < 0) { perror(fn); close(); return false; }
+		nb = statbuf.st_size / sizeof(descr_file_packet);
+		bytes = statbuf.st_size;
+		if (nb == 0) return true;
+		data = (descr_file_packet *) mmap(0, bytes, PROT_READ, MAP_SHARED, fd, 0);
+		if (data == (descr_file_packet *)-1) { perror("mmap"); data=0; close(); return false; }
+		madvise(data, bytes, MADV_SEQUENTIAL);
+#endif
+		return true;
+	}
+
+	long size() const { return nb; }
+
+	/*! Packets [start, start+n), valid until the next call. The file is
+	 *  read from the beginning, in increasing order.
+	 */
+	const descr_file_packet *get(long start, unsigned n) {
+		if (n==0 || start + (long) n > nb) return 0;
+#ifdef WIN32
+		buffer.resize(n);
+		if (start==0) fseek(file, 0, SEEK_SET);
+		if (fread(&buffer[0], sizeof(descr_file_packet), n, file) != n) return 0;
+		return &buffer[0];
+#else
+		// pages already read will not be needed again.
+		size_t done = (start * sizeof(descr_file_packet)) & ~(size_t)(getpagesize()-1);
+		if (done > 0) madvise(data, done, MADV_DONTNEED);
+		return data + start;
+#endif
+	}
+
+	void close() {
+#ifdef WIN32
+		if (file) fclose(file);
+		file=0;
+#else
+		if (data) munmap(data, bytes);
+		if (fd>=0) ::close(fd);
+		data=0; fd=-1;
+#endif
+	}
+
+private:
+	long nb;
+#ifdef WIN32
+	FILE *file;
+	std::vector<descr_file_packet> buffer;
+#else
+	int fd;
+	size_t bytes;
+	descr_file_packet *data;
+#endif
+};
+
+bool is_finite(const descriptor_t &d)
+{
+	for (unsigned j=0; j<descriptor_size; j++)
+		if (!finite(d.descriptor[j])) return false;
+	return true;
+}
+
+void collect_leaves(node_t *node, int depth, std::vector<std::pair<node_t *, int> > &leaves)
+{
+	if (node->is_leaf()) {
+		leaves.push_back(std::make_pair(node, depth));
+		return;
+	}
+	for (unsigned i=0; i<nb_branches; i++)
+		if (node->clusters[i]) collect_leaves(node->clusters[i], depth+1, leaves);
+}
+
+//! once a subtree is built, its leaves point to released descriptors.
+void forget_data(node_t *node)
+{
+	node->data.clear();
+	for (unsigned i=0; i<nb_branches; i++)
+		if (node->clusters[i]) forget_data(node->clusters[i]);
+}
+
+void split_in_memory(node_t *node, std::vector<descriptor_t> &descr, int level, int max_level, int min_elem)
+{
+	node->data.resize(descr.size());
+	for (unsigned i=0; i<descr.size(); i++) node->data[i] = &descr[i];
+#ifdef _OPENMP
+#pragma omp parallel
+#pragma omp single
+#endif
+	node->recursive_split(max_level, min_elem, level);
+	forget_data(node);
+}
+
+//! spill files open at the same time while partitioning.
+const unsigned max_open_spill = 64;
+
+/*! Grows the subtree below node from the descriptors of file fn.
+ * If they do not fit in memory, the first levels are trained on a reservoir
+ * sample, the file is partitioned into one spill file per leaf, and each leaf
+ * is grown from its spill file the same way.
+ */
+bool stream_split(node_t *node, const char *fn, int level, int max_level, int min_elem,
+		unsigned max_in_memory, const string &spill_prefix)
+{
+	packet_stream in;
+	if (!in.open(fn)) return false;
+	const long n = in.size();
+	const unsigned chunk = 4096;
+
+	if (level >= max_level) {
+		// a leaf, whatever its size.
+		if (n > (long) max_in_memory)
+			std::cerr << fn << ": warning, depth " << level << " reached with " << n
+				<< " descriptors, more than max_in_memory. The leaf is not split further.\n";
+		return true;
+	}
+
+	if (n <= (long) max_in_memory) {
+		std::vector<descriptor_t> descr;
+		descr.reserve(n);
+		for (long start=0; start<n; start+=chunk) {
+			unsigned m = (unsigned) std::min((long) chunk, n-start);
+			const descr_file_packet *p = in.get(start, m);
+			if (!p) return false;
+			for (unsigned i=0; i<m; ++i)
+				if (is_finite(p[i].d)) descr.push_back(p[i].d);
+		}
+		in.close();
+		if (descr.size() > (unsigned) min_elem)
+			split_in_memory(node, descr, level, max_level, min_elem);
+		return true;
+	}
+
+	// reservoir sample.
+	std::vector<descriptor_t> sample;
+	sample.reserve(max_in_memory);
+	unsigned long long rng = 0x9e3779b97f4a7c15ULL ^ (unsigned long long) n;
+	long seen=0;
+	for (long start=0; start<n; start+=chunk) {
+		unsigned m = (unsigned) std::min((long) chunk, n-start);
+		const descr_file_packet *p = in.get(start, m);
+		if (!p) return false;
+		for (unsigned i=0; i<m; ++i) {
+			if (!is_finite(p[i].d)) continue;
+			if (sample.size() < max_in_memory) {
+				sample.push_back(p[i].d);
+			} else {
+				long j = (long) (random_unit(&rng) * (seen+1));
+				if (j < (long) max_in_memory) sample[j] = p[i].d;
+			}
+			++seen;
+		}
+	}
+
+	// enough levels for the partitions to fit in memory.
+	int levels=1;
+	for (double parts=nb_branches; parts*max_in_memory < n; parts*=nb_branches) ++levels;
+	if (levels > max_level-level) {
+		levels = max_level-level;
+		std::cerr << fn << ": warning, max_level " << max_level
+			<< " stops the split before the leaves fit in memory.\n";
+	}
+
+	std::cout << fn << ": " << n << " descriptors, training " << levels
+		<< " levels on a sample of " << sample.size() << std::endl;
+	split_in_memory(node, sample, level, level+levels, min_elem);
+	std::vector<descriptor_t>().swap(sample);
+
+	std::vector<std::pair<node_t *, int> > leaves;
+	collect_leaves(node, level, leaves);
+	if (leaves.size() < 2) {
+		std::cerr << fn << ": unable to split descriptors.\n";
+		return false;
+	}
+
+	// partition. Temporary leaf ids index the spill files. The input is
+	// read and quantized once per group of max_open_spill leaves, so that
+	// both the number of open files and the memory stay bounded.
+	for (unsigned l=0; l<leaves.size(); ++l)
+		leaves[l].first->id = l;
+	std::vector<string> spill_fn(leaves.size());
+	for (unsigned l=0; l<leaves.size(); ++l) {
+		std::ostringstream name;
+		name << spill_prefix << "_" << l;
+		spill_fn[l] = name.str();
+	}
+	bool ok=true;
+	{
+		flat_tree quantizer(node);
+		std::vector<const descriptor_t *> d(chunk);
+		std::vector<unsigned> index(chunk);
+		std::vector<unsigned> ids(chunk);
+		flat_tree::descent_buffers descent;
+		for (unsigned first=0; ok && first<leaves.size(); first+=max_open_spill) {
+			unsigned last = std::min((unsigned) leaves.size(), first+max_open_spill);
+			std::vector<FILE *> spill(last-first, (FILE *) 0);
+			for (unsigned l=first; l<last; ++l) {
+				spill[l-first] = fopen(spill_fn[l].c_str(), "wb");
+				if (!spill[l-first]) {
+					perror(spill_fn[l].c_str());
+					ok=false;
+					break;
+				}
+			}
+			for (long start=0; ok && start<n; start+=chunk) {
+				unsigned m = (unsigned) std::min((long) chunk, n-start);
+				const descr_file_packet *p = in.get(start, m);
+				if (!p) { ok=false; break; }
+				unsigned k=0;
+				for (unsigned i=0; i<m; ++i) {
+					if (!is_finite(p[i].d)) continue;
+					index[k] = i;
+					d[k++] = &p[i].d;
+				}
+				quantizer.get_ids(k, &d[0], &ids[0], 0, descent);
+				for (unsigned i=0; i<k; ++i) {
+					if (ids[i] < first || ids[i] >= last) continue;
+					if (fwrite(p+index[i], sizeof(descr_file_packet), 1, spill[ids[i]-first]) != 1) ok=false;
+				}
+			}
+			for (unsigned l=0; l<spill.size(); ++l)
+				if (spill[l]) fclose(spill[l]);
+		}
+	}
+	in.close();
+	if (!ok) {
+		std::cerr << spill_prefix << ": failed to write spill files.\n";
+		for (unsigned l=0; l<leaves.size(); ++l) {
+			leaves[l].first->id = 0;
+			remove(spill_fn[l].c_str());
+		}
+		return false;
+	}
+
+	for (unsigned l=0; l<leaves.size(); ++l) {
+		leaves[l].first->id = 0;
+		if (ok)
+			ok = stream_split(leaves[l].first, spill_fn[l].c_str(), leaves[l].second,
+					max_level, min_elem, max_in_memory, spill_fn[l]);
+		remove(spill_fn[l].c_str());
+	}
+	return ok;
+}
+}  // namespace
+
+node_t *kmean_tree::build_from_data_streaming(const char *filename, int max_level, int min_elem,
+		unsigned max_in_memory, const char *spill_dir)
+{
+	if (max_in_memory <= (unsigned) min_elem) {
+		std::cerr << "max_in_memory must be larger than min_elem.\n";
+		return 0;
+	}
+	string prefix;
+	if (spill_dir)
+		prefix = string(spill_dir) + "/descriptors.spill";
+	else
+		prefix = string(filename) + ".spill";
+
+	node_t *root = new node_t;
+	if (!stream_split(root, filename, 0, max_level, min_elem, max_in_memory, prefix)) {
+		delete root;
+		return 0;
+	}
+
+	unsigned n = 0;
+	root->assign_leaf_ids(&n);
+	cout << "Tree has " << n << " leafs.\n";
+	return root;
+}
+
+bool kmean_tree::compare_centroid_formats(node_t *root, const char *descr_fn, int max_descr)
+{
+	FILE *f = fopen(descr_fn, "rb");
+	if (!f) {
+		perror(descr_fn);
+		return false;
+	}
+	std::vector<descr_file_packet> packets;
+	descr_file_packet packet;
+	while ((max_descr<=0 || (int)packets.size() < max_descr) && fread(&packet, sizeof(packet), 1, f) == 1)
+		packets.push_back(packet);
+	fclose(f);
+	if (packets.empty()) {
+		cerr << descr_fn << ": no descriptor to test.\n";
+		return false;
+	}
+
+	const unsigned n = packets.size();
+	std::vector<const descriptor_t *> d(n);
+	for (unsigned i=0; i<n; ++i) d[i] = &packets[i].d;
+
+	static const char *names[] = { "float", "half", "int8" };
+	std::vector<unsigned> ref_ids(n), ids(n);
+	std::vector<node_t *> ref_leaves(n), leaves(n);
+	for (int fmt=CENTROID_FLOAT; fmt<=CENTROID_INT8; ++fmt) {
+		flat_tree tree(root, (centroid_format_t) fmt);
+		Timer timer;
+		tree.get_ids(n, &d[0], &ids[0], &leaves[0]);
+		double ms = timer.stop();
+
+		if (fmt == CENTROID_FLOAT) {
+			ref_ids = ids;
+			ref_leaves = leaves;
+		}
+
+		// how much farther is the leaf we reached than the float one?
+		unsigned same=0;
+		double ratio=0;
+		for (unsigned i=0; i<n; ++i) {
+			if (ids[i] == ref_ids[i]) {
+				++same;
+				ratio += 1;
+			} else {
+				descriptor_t *di = &packets[i].d;
+				float ref = ref_leaves[i]->mean.distance(di);
+				ratio += (ref > 0 ? leaves[i]->mean.distance(di) / ref : 1);
+			}
+		}
+		printf("%5s: %8.2f MB of means, %8.2f ms for %u descriptors, "
+				"%6.2f%% same leaf as float, distance to leaf x%.4f\n",
+				names[fmt], tree.means_size()/(1024.0*1024.0), ms, n,
+				100.0*same/n, ratio/n);
+	}
+	return true;
+}
 
 void node_t::print_summary(int depth) {
 
@@ -649,11 +1552,13 @@ bool node_t::load(FILE *f)
 	return true;
 }
 
-bool node_t::save(sqlite3 *db, sqlite3_stmt *insert_node, sqlite3_stmt *insert_child)
+bool node_t::save(sqlite3 *db, sqlite3_stmt *insert_node, sqlite3_stmt *insert_child, centroid_format_t format)
 {
+	float blob[descriptor_size];
+	int size = encode_mean(mean, format, (unsigned char *) blob);
 	sqlite3_bind_int64(insert_node, 1, (sqlite3_int64)this);
 	sqlite3_bind_int(insert_node, 2, id);
-	sqlite3_bind_blob(insert_node, 3, &mean, sizeof(mean),  SQLITE_STATIC);
+	sqlite3_bind_blob(insert_node, 3, blob, size, SQLITE_TRANSIENT);
 	if(sqlite3_step(insert_node)!=SQLITE_DONE) {
 		printf("%s:%d: error: %s\n", __FILE__, __LINE__, sqlite3_errmsg(db));
 		return false;
@@ -672,7 +1577,7 @@ bool node_t::save(sqlite3 *db, sqlite3_stmt *insert_node, sqlite3_stmt *insert_c
 	}
 	for (unsigned i=0; i<nb_branches; i++) {
 		if (clusters[i]) 
-			if (!clusters[i]->save(db,insert_node,insert_child)) return false;
+			if (!clusters[i]->save(db,insert_node,insert_child,format)) return false;
 	}
 	return true;
 }
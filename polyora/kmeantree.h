@@ -43,6 +43,19 @@ namespace kmean_tree {
 	};
 	typedef std::vector<descriptor_t *> descriptor_array;
 
+	//! Storage of the centroids, in a flat_tree or in a database.
+	enum centroid_format_t {
+		CENTROID_FLOAT=0, //!< 4 bytes per coordinate
+		CENTROID_HALF,    //!< IEEE half precision, 2 bytes per coordinate
+		CENTROID_INT8     //!< 1 byte per coordinate, plus a scale and an offset per centroid
+	};
+
+	unsigned short float_to_half(float f);
+	float half_to_float(unsigned short h);
+	/*! Quantize n values to [-127,127] with src[i] ~= dst[i*stride]*scale + offset.
+	 */
+	void quantize_int8(const float *src, unsigned n, float *scale, float *offset, signed char *dst, unsigned stride=1);
+
 	class mean_t {
 	public:
 		float mean[descriptor_size];
@@ -94,8 +107,8 @@ namespace kmean_tree {
 		bool save(FILE *f);
 
 		//! open a sqlite3 database to store the node and its children.
-		//! Clears previously stored tree.
-		bool save_to_database(const char *fn);
+		//! Clears previously stored tree. Means are stored in the given format.
+		bool save_to_database(const char *fn, centroid_format_t format=CENTROID_FLOAT);
 
 		void assign_leaf_ids(unsigned *id_ptr);
 
@@ -112,15 +125,106 @@ namespace kmean_tree {
 		}
 	protected:
 		void run_kmean(int nb_iter=32);
-		bool save(sqlite3 *db, sqlite3_stmt *insert_node, sqlite3_stmt *insert_child);
+		bool save(sqlite3 *db, sqlite3_stmt *insert_node, sqlite3_stmt *insert_child, centroid_format_t format);
 	};
 
 
+	/*! Read-only copy of a tree, for fast quantization.
+	 *  Nodes are stored breadth first. The means of the children of a node
+	 *  are interleaved in a 64-byte aligned block, so that a descriptor is
+	 *  compared with all children in a single SIMD pass. get_id() returns
+	 *  exactly what node_t::get_id() returns on the source tree, which
+	 *  must outlive the flat_tree unless forget_source() is called. With
+	 *  CENTROID_HALF or CENTROID_INT8
+	 *  the means take 2 or 4 times less memory, and results are
+	 *  approximate: see compare_centroid_formats().
+	 */
+	class flat_tree {
+	public:
+		flat_tree(node_t *root, centroid_format_t format=CENTROID_FLOAT);
+		~flat_tree();
+
+		unsigned get_id(const descriptor_t *d, node_t **node=0) const;
+
+		//! Work buffers of get_ids(), kept by callers to avoid reallocations.
+		struct descent_buffers {
+			std::vector<unsigned> cur, active, next, from;
+		};
+
+		/*! Quantize n descriptors at once. The whole batch descends the
+		 *  tree one level at a time: descriptors reaching the same node
+		 *  are processed together, while the node means are in cache.
+		 *  Levels are processed in parallel with OpenMP, as tasks when
+		 *  called from a parallel region. Results are the same as get_id.
+		 *  leaves can be 0.
+		 */
+		void get_ids(unsigned n, const descriptor_t *const *d, unsigned *ids, node_t **leaves=0) const;
+		void get_ids(unsigned n, const descriptor_t *const *d, unsigned *ids, node_t **leaves,
+				descent_buffers &buf) const;
+
+		unsigned nb_nodes() const { return nodes.size(); }
+		unsigned nb_leaves() const;
+		/*! Mean of the leaf with the given id, decoded from the stored
+		 *  format. Returns false if there is no such leaf.
+		 */
+		bool leaf_mean(unsigned id, float mean[descriptor_size]) const;
+		/*! Drop the pointers to the source tree, so that it can be
+		 *  deleted. Nodes returned by get_id() and get_ids() are then 0.
+		 */
+		void forget_source();
+		centroid_format_t get_format() const { return format; }
+		//! bytes used by the means.
+		size_t means_size() const { return blocks_size; }
+
+	protected:
+		struct flat_node {
+			//! index of the first child in nodes, 0 for leaves.
+			unsigned first_child;
+			unsigned nb_children;
+			//! leaf id
+			unsigned id;
+			//! interleaved means of the children: [descriptor_size][nb_branches],
+			//! preceded by a 64 bytes [scale][offset] header for CENTROID_INT8.
+			const void *means;
+			node_t *node;
+			unsigned parent;
+		};
+		std::vector<flat_node> nodes;
+		//! index in nodes of each leaf id.
+		std::vector<unsigned> leaf_index;
+		char *mean_blocks;
+		size_t blocks_size;
+		centroid_format_t format;
+
+		//! index of the closest child of n.
+		unsigned best_child(const flat_node &n, const float *d) const;
+		//! best_child for two descriptors at once.
+		void best_children(const flat_node &n, const float *d0, const float *d1,
+				unsigned *best0, unsigned *best1) const;
+		//! one level down for active[begin..end), begin even. See get_ids().
+		void descend(const unsigned *active, const unsigned *from, unsigned *cur,
+				const descriptor_t *const *d, int begin, int end) const;
+
+	private:
+		flat_tree(const flat_tree &);
+		flat_tree &operator=(const flat_tree &);
+	};
+
 	//! build a tree from descriptors saved in a file
 	node_t * build_from_data(const char *filename, int max_level, int min_elem, int stop);
 
-	//! load a tree from a sqlite3 database
-	node_t *load(sqlite3 *db);
+	/*! Build a tree from a descriptor file too large for memory. At most
+	 *  max_in_memory descriptors are loaded at once: the top levels are
+	 *  trained on a reservoir sample, and the file is partitioned in one
+	 *  spill file per leaf, written in spill_dir (default: next to
+	 *  filename). Each partition is then grown the same way.
+	 */
+	node_t * build_from_data_streaming(const char *filename, int max_level, int min_elem,
+			unsigned max_in_memory, const char *spill_dir=0);
+
+	//! load a tree from a sqlite3 database. The format the means were stored
+	//! in is returned in format, if not null.
+	node_t *load(sqlite3 *db, centroid_format_t *format=0);
 
 	//! load a tree from a file
 	node_t * load(const char *filename); 
@@ -129,6 +233,12 @@ namespace kmean_tree {
 		long ptr;
 		descriptor_t d;
 	};
+
+	/*! Quantize the descriptors of a held-out descriptor file with the half
+	 *  and int8 versions of tree and print how often they agree with the
+	 *  float version, along with memory and timing.
+	 */
+	bool compare_centroid_formats(node_t *root, const char *descr_fn, int max_descr=0);
 };
 
 #endif
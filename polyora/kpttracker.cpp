@@ -24,12 +24,14 @@ using namespace std;
 #include "fast.h"
 #endif
 #include <stack>
+#include <algorithm>
 #ifdef _OPENMP
 #include <omp.h>
 #endif
 #include "timer.h"
 
 #include <opencv2/video/tracking.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
 
 #ifdef WITH_ADAPT_THRESH
 #include <adapt_thresh.h>
@@ -50,24 +52,122 @@ static inline double drand48() {
 #endif
 #endif
 
-int ncc_calls=0;
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KPT_NCC_SSE2
+#include <emmintrin.h>
+#endif
 
 float cmp_ncc(pyr_keypoint *a, pyr_keypoint *b);
+static void cmp_ncc(const pyr_keypoint *templ, pyr_keypoint *const *cand, int n, float *ncc);
 
 void pyr_keypoint::dispose() {
 	pyr_frame *f = static_cast<pyr_frame *>(frame);
 	unlink();
-	if (f)
-		f->tracker->kpt_recycler.recycle(this);
-	else
+	if (!f)
 		delete this;
+	else if (f->retired)
+		f->retired->push_back(this);
+	else
+		f->tracker->kpt_recycler.recycle(this);
+}
+
+kpt_tracker::recycler_t::recycler_t(pyr_keypoint::pyr_keypoint_factory_t *f, int slab_size)
+	: factory(f), slab_size(slab_size)
+{
+}
+
+// the caller holds the lock.
+void kpt_tracker::recycler_t::refill(int n)
+{
+	if (n < slab_size) n = slab_size;
+	available.reserve(available.size() + n);
+	for (int i=0; i<n; ++i)
+		available.push_back((pyr_keypoint *)factory->create());
+	counters.created += n;
+}
+
+pyr_keypoint *kpt_tracker::recycler_t::get_new()
+{
+	pyr_keypoint *p;
+	get_new(&p, 1);
+	return p;
+}
+
+void kpt_tracker::recycler_t::get_new(pyr_keypoint **dst, int n)
+{
+	if (n<=0) return;
+#ifdef _OPENMP
+#pragma omp critical(kpt_recycler)
+#endif
+	{
+		int had = available.size();
+		if (had < n)
+			refill(n - had);
+		counters.reused += std::min(had, n);
+		std::vector<pyr_keypoint *>::iterator first = available.end() - n;
+		std::copy(first, available.end(), dst);
+		available.erase(first, available.end());
+	}
+}
+
+void kpt_tracker::recycler_t::recycle(pyr_keypoint *obj)
+{
+	// set() resets the other fields. The descriptor belongs to the frame.
+	obj->descriptor = 0;
+#ifdef _OPENMP
+#pragma omp critical(kpt_recycler)
+#endif
+	{
+		available.push_back(obj);
+		counters.recycled++;
+	}
+}
+
+void kpt_tracker::recycler_t::recycle(pyr_keypoint **objs, int n)
+{
+	for (int i=0; i<n; ++i)
+		objs[i]->descriptor = 0;
+#ifdef _OPENMP
+#pragma omp critical(kpt_recycler)
+#endif
+	{
+		available.insert(available.end(), objs, objs+n);
+		counters.recycled += n;
+	}
+}
+
+void kpt_tracker::recycler_t::clear()
+{
+	for (std::vector<pyr_keypoint *>::iterator it(available.begin()); it!=available.end(); ++it)
+		delete *it;
+	available.clear();
+}
+
+allocation_stats kpt_tracker::recycler_t::stats() const
+{
+	allocation_stats r;
+#ifdef _OPENMP
+#pragma omp critical(kpt_recycler)
+#endif
+	{
+		r = counters;
+		r.available = available.size();
+	}
+	return r;
+}
+
+allocation_stats kpt_tracker::track_stats() const
+{
+	return static_cast<pyr_track::pyr_track_factory_t *>(ttrack_factory)->stats();
 }
 
 kpt_tracker::~kpt_tracker() {
 	clear();
 	kpt_recycler.clear();
-	if (pipeline_stage1) delete pipeline_stage1;
+	for (int i=0; i<NB_PIPELINE_STAGES; ++i)
+		if (pipeline[i]) delete pipeline[i];
 
+	if (quantizer) delete quantizer;
 	if (tree) delete tree;
 	if (id_clusters) delete id_clusters;
 #ifdef WITH_YAPE
@@ -83,6 +183,21 @@ void kpt_tracker::clear() {
 	while (frames) remove_unmatched_tracks(frame_iterator(this));
 }
 
+void kpt_tracker::retire_frames(int n)
+{
+	TaskTimer::pushTask("retire frames");
+	for (int i=0; i<n && nb_frames()>0; ++i) {
+		pyr_frame *f = (pyr_frame *) get_nth_frame(nb_frames()-1);
+		// the frame is deleted by remove_frame().
+		f->retired = &retired_kpts;
+		remove_frame(f);
+	}
+	if (!retired_kpts.empty())
+		kpt_recycler.recycle(&retired_kpts[0], retired_kpts.size());
+	retired_kpts.clear();
+	TaskTimer::popTask();
+}
+
 static void license() {
 	static bool printed=false;
 	if (!printed) {
@@ -111,9 +226,22 @@ kpt_tracker::kpt_tracker(int width, int height, int levels, int max_motion, bool
         //patch_size= 8;
 	ncc_threshold=.88f;
 	ncc_threshold_high=.9f;
+	lk_derivatives=false;
+	descriptor_history=2;
+	ncc_evaluations=0;
 	tree=0;
+	keep_tree=false;
+	quantizer=0;
+	centroid_format=kmean_tree::CENTROID_FLOAT;
 	id_clusters=0;
-	pipeline_stage1=0;
+	for (int i=0; i<NB_PIPELINE_STAGES; ++i) pipeline[i]=0;
+	pipeline_depth=2;
+	pipeline_latency=0;
+	pipeline_max_latency=0;
+	for (int i=0; i<NB_PIPELINE_STAGES; ++i) pipeline_stage_time[i]=0;
+
+	// make sure the tagger is initialized before stages run concurrently.
+	patch_tagger::singleton();
 
 #ifdef WITH_YAPE
 	detector = new pyr_yape(width, height, levels); 
@@ -127,14 +255,42 @@ bool kpt_tracker::load_tree(sqlite3 *db)
 	if (db==0) return false;
 
 	// load tree first.
-	tree= kmean_tree::load(db);
-	if (!tree) {
+	kmean_tree::node_t *t = kmean_tree::load(db, &centroid_format);
+	if (!t) {
 		std::cout << "Failed to load tree from database.\n";
 		return false;
 	}
+	if (tree) delete tree;
+	tree = t;
+	compile_tree();
 	return true;
 }
 
+void kpt_tracker::compile_tree()
+{
+	if (!tree) return;
+	if (quantizer) delete quantizer;
+	quantizer = new kmean_tree::flat_tree(tree, centroid_format);
+	if (keep_tree) return;
+
+	// the node tree takes as much memory again as the quantizer.
+	quantizer->forget_source();
+	delete tree;
+	tree=0;
+}
+
+void kpt_tracker::set_centroid_format(kmean_tree::centroid_format_t format)
+{
+	if (format == centroid_format) return;
+	centroid_format = format;
+	compile_tree();
+}
+
+unsigned kpt_tracker::nb_leaves() const
+{
+	return quantizer ? quantizer->nb_leaves() : 0;
+}
+
 bool kpt_tracker::load_clusters(sqlite3 *db)
 {
 	if (db==0) return false;
@@ -162,11 +318,15 @@ bool kpt_tracker::load_from_db(sqlite3 *db)
 
 bool kpt_tracker::load_tree(const char *fn)
 {
-	tree= kmean_tree::load(fn);
-	if (!tree) 
+	kmean_tree::node_t *t = kmean_tree::load(fn);
+	if (!t) {
 		std::cout << fn << ": failed to load tree.\n";
-	
-	return tree!=0;
+		return false;
+	}
+	if (tree) delete tree;
+	tree = t;
+	compile_tree();
+	return true;
 }
 
 bool kpt_tracker::load_clusters(const char *fn)
@@ -183,12 +343,62 @@ bool kpt_tracker::load_clusters(const char *fn)
 	return true;
 }
 
-void kpt_tracker::buildPyramid(pyr_frame *frame) {
-	frame->pyr->build();
-        cv::Mat im((*frame->pyr)[0]);
-        int levels = cv::buildOpticalFlowPyramid(im, frame->cv_pyramid,
-                                                 cv::Size(patch_tagger::patch_size,
-                                                          patch_tagger::patch_size), 4);
+// LK uses levels 0 to lk_levels-1, even if the PyrImage has less.
+static const int lk_levels = 5;
+
+// Scharr derivatives of im, padded with zeros as LK expects.
+static cv::Mat lk_derivatives_of(const cv::Mat &im, int border)
+{
+	cv::Mat padded(im.rows + 2*border, im.cols + 2*border, CV_16SC2, cv::Scalar::all(0));
+	cv::Mat d = padded(cv::Rect(border, border, im.cols, im.rows));
+	cv::Mat dxy[2];
+	cv::Scharr(im, dxy[0], CV_16S, 1, 0);
+	cv::Scharr(im, dxy[1], CV_16S, 0, 1);
+	cv::merge(dxy, 2, d);
+	return d;
+}
+
+/*! Builds the PyrImage used by the detector, and the LK pyramid on top of
+ *  it. LK needs padded levels: PyrImage pads levels 1 and up, and LK views
+ *  them. Level 0 belongs to the caller, and is copied with its border.
+ */
+void kpt_tracker::buildPyramid(pyr_frame *frame, bool derivatives) {
+	PyrImage &pyr = *frame->pyr;
+	pyr.build();
+
+	const int b = pyr.border;
+	std::vector<cv::Mat> &lk = frame->cv_pyramid;
+	lk.clear();
+	lk.reserve(2*lk_levels);
+
+	cv::Mat im(pyr[0]);
+	cv::Mat level0(im.rows + 2*b, im.cols + 2*b, im.type());
+	cv::copyMakeBorder(im, level0, b, b, b, b, cv::BORDER_REFLECT_101);
+	cv::Mat level = level0(cv::Rect(b, b, im.cols, im.rows));
+
+	const int win = patch_tagger::patch_size;
+	assert(b >= win);
+	for (int l=0; l<lk_levels; ++l) {
+		if (l>0) {
+			cv::Size s((level.cols+1)/2, (level.rows+1)/2);
+			if (l<pyr.nbLev) s = cv::Size(pyr[l]->width, pyr[l]->height);
+			// as cv::buildOpticalFlowPyramid, skip levels smaller than the window.
+			if (s.width <= win || s.height <= win) break;
+		}
+		if (l>0 && l<pyr.nbLev) {
+			level = cv::Mat(pyr.get_padded(l))(cv::Rect(b, b, pyr[l]->width, pyr[l]->height));
+		} else if (l>0) {
+			// coarser than the PyrImage: built as cv::buildOpticalFlowPyramid does.
+			cv::Mat prev = level;
+			cv::Size s((prev.cols+1)/2, (prev.rows+1)/2);
+			cv::Mat padded(s.height + 2*b, s.width + 2*b, prev.type());
+			level = padded(cv::Rect(b, b, s.width, s.height));
+			cv::pyrDown(prev, level, s);
+			cv::copyMakeBorder(level, padded, b, b, b, b, cv::BORDER_REFLECT_101 | cv::BORDER_ISOLATED);
+		}
+		lk.push_back(level);
+		if (derivatives) lk.push_back(lk_derivatives_of(level, b));
+	}
 }
 
 void kpt_tracker::set_size(int width, int height, int levels, int )
@@ -200,41 +410,100 @@ void kpt_tracker::set_size(int width, int height, int levels, int )
 #endif
 }
 
-pyr_frame *kpt_tracker::process_frame_pipeline(IplImage *im, long long timestamp) {
-	pyr_frame *new_f=0;
-	if (im) new_f = create_frame(im, timestamp);
-#pragma omp parallel 
-	{
-#pragma omp master
-	{
-	if (im) {
-		//TaskTimer::pushTask("pyramid");
-                buildPyramid(new_f);
+// pipeline_slots[depth-1][s] is the first stage handled by slot s.
+static const int pipeline_slots[kpt_tracker::NB_PIPELINE_STAGES][kpt_tracker::NB_PIPELINE_STAGES+1] = {
+	{ kpt_tracker::STAGE_PYRAMID, kpt_tracker::NB_PIPELINE_STAGES },
+	{ kpt_tracker::STAGE_PYRAMID, kpt_tracker::STAGE_QUANTIZE, kpt_tracker::NB_PIPELINE_STAGES },
+	{ kpt_tracker::STAGE_PYRAMID, kpt_tracker::STAGE_QUANTIZE, kpt_tracker::STAGE_TRACK,
+		kpt_tracker::NB_PIPELINE_STAGES },
+	{ kpt_tracker::STAGE_PYRAMID, kpt_tracker::STAGE_DETECT, kpt_tracker::STAGE_QUANTIZE,
+		kpt_tracker::STAGE_TRACK, kpt_tracker::NB_PIPELINE_STAGES }
+};
 
-		//TaskTimer::popTask();
-		//TaskTimer::pushTask("Feature detection");
-		detect_keypoints(new_f);
-		//TaskTimer::popTask();
+void kpt_tracker::run_pipeline_stage(int stage, pyr_frame *f) {
+	switch (stage) {
+		case STAGE_PYRAMID:
+			TaskTimer::pushTask("pyramid");
+			buildPyramid(f, lk_derivatives);
+			TaskTimer::popTask();
+			break;
+		case STAGE_DETECT:
+			TaskTimer::pushTask("Feature detection");
+			detect_keypoints(f);
+			TaskTimer::popTask();
+			break;
+		case STAGE_QUANTIZE:
+			traverse_tree(f);
+			break;
+		case STAGE_TRACK:
+			f->append_to(*this);
+			track_ncclk(f, (pyr_frame *)get_nth_frame(1));
+			break;
 	}
+}
+
+void kpt_tracker::set_pipeline_depth(int depth) {
+	if (depth<1) depth=1;
+	if (depth>NB_PIPELINE_STAGES) depth=NB_PIPELINE_STAGES;
+	if (depth == pipeline_depth) return;
+
+	// drain frames still in flight with the current layout.
+	bool empty=true;
+	for (int i=0; i<pipeline_depth; ++i) if (pipeline[i]) empty=false;
+	while (!empty) {
+		process_frame_pipeline(0, 0);
+		empty=true;
+		for (int i=0; i<pipeline_depth; ++i) if (pipeline[i]) empty=false;
 	}
-#pragma omp single
-	{
-	if (pipeline_stage1) {
-		traverse_tree(pipeline_stage1);
-		pipeline_stage1->append_to(*this);
-		track_ncclk(pipeline_stage1, (pyr_frame *)get_nth_frame(1));
+	pipeline_depth = depth;
+}
+
+pyr_frame *kpt_tracker::process_frame_pipeline(IplImage *im, long long timestamp) {
+	const int depth = pipeline_depth;
+	const int *slots = pipeline_slots[depth-1];
+
+	// each frame moves one slot forward.
+	for (int s=depth-1; s>0; --s)
+		pipeline[s] = pipeline[s-1];
+	pipeline[0]=0;
+	if (im) {
+		pipeline[0] = create_frame(im, timestamp);
+		pipeline[0]->pipeline_timer.start();
 	}
+
+	// Slots work on different frames. The only shared state they modify
+	// is the tracks structure, which is touched by STAGE_TRACK only.
+	// The task stacks of TaskTimer are per thread, and threads run tasks of
+	// any slot: concurrent slots are timed as a whole, each stage by its slot.
+	TaskTimer::pushTask("pipeline");
+	if (depth>1) TaskTimer::setEnabledInParallel(false);
+#pragma omp parallel for schedule(static,1) if(depth>1)
+	for (int s=0; s<depth; ++s) {
+		if (pipeline[s])
+			for (int stage=slots[s]; stage<slots[s+1]; ++stage) {
+				Timer t;
+				run_pipeline_stage(stage, pipeline[s]);
+				pipeline_stage_time[stage] = t.stop();
+			}
 	}
+	TaskTimer::setEnabledInParallel(true);
+	TaskTimer::popTask();
+
+	pyr_frame *out = pipeline[depth-1];
+	pipeline[depth-1]=0;
+	if (out) {
+		out->pipeline_latency = out->pipeline_timer.stop();
+		pipeline_latency = out->pipeline_latency;
+		if (pipeline_latency > pipeline_max_latency)
+			pipeline_max_latency = pipeline_latency;
 	}
-	pyr_frame *out = pipeline_stage1;
-	pipeline_stage1 = new_f;
 	return out;
 }
 
 pyr_frame *kpt_tracker::process_frame(IplImage *im, long long timestamp) {
 	pyr_frame *f = create_frame(im, timestamp);
 	TaskTimer::pushTask("pyramid");
-        buildPyramid(f);
+        buildPyramid(f, lk_derivatives);
 	TaskTimer::popTask();
 	TaskTimer::pushTask("Feature detection");
 	detect_keypoints(f);
@@ -247,8 +516,65 @@ pyr_frame *kpt_tracker::process_frame(IplImage *im, long long timestamp) {
 
 pyr_frame::pyr_frame(PyrImage *p, int bits) : 
 		tframe(p->images[0]->width, p->images[0]->height, bits), 
-		pyr(p), tracker(0) 
+		pyr(p), tracker(0), pipeline_latency(0), retired(0)
+{
+}
+
+void pyr_frame::release_descriptors()
+{
+	for (tracks::keypoint_frame_iterator it(points.begin()); !it.end(); ++it)
+		((pyr_keypoint *) it.elem())->descriptor = 0;
+	descriptors.release();
+}
+
+descriptor_arena::block_pool::~block_pool()
+{
+	for (std::vector<patch_tagger::descriptor *>::iterator it(blocks.begin()); it!=blocks.end(); ++it)
+		delete[] *it;
+}
+
+patch_tagger::descriptor *descriptor_arena::block_pool::get()
+{
+	patch_tagger::descriptor *b=0;
+#ifdef _OPENMP
+#pragma omp critical(descriptor_blocks)
+#endif
+	{
+		if (!blocks.empty()) {
+			b = blocks.back();
+			blocks.pop_back();
+		}
+	}
+	if (!b) b = new patch_tagger::descriptor[block_size];
+	return b;
+}
+
+void descriptor_arena::block_pool::put(patch_tagger::descriptor *block)
+{
+#ifdef _OPENMP
+#pragma omp critical(descriptor_blocks)
+#endif
+	blocks.push_back(block);
+}
+
+patch_tagger::descriptor *descriptor_arena::alloc()
+{
+	if (used == block_size) {
+		blocks.push_back(pool ? pool->get() : new patch_tagger::descriptor[block_size]);
+		used = 0;
+	}
+	patch_tagger::descriptor *d = blocks.back() + used++;
+	d->total = 0;
+	return d;
+}
+
+void descriptor_arena::release()
 {
+	for (std::vector<patch_tagger::descriptor *>::iterator it(blocks.begin()); it!=blocks.end(); ++it)
+		if (pool) pool->put(*it);
+		else delete[] *it;
+	blocks.clear();
+	used = block_size;
 }
 
 void pyr_frame::append_to(tracks &t)
@@ -260,7 +586,7 @@ void pyr_frame::append_to(tracks &t)
 pyr_frame *kpt_tracker::add_frame(IplImage *im, long long timestamp) 
 {
 	pyr_frame *f = create_frame(im, timestamp);
-        buildPyramid(f);
+        buildPyramid(f, lk_derivatives);
 	f->append_to(*this);
 	return f;
 }
@@ -278,12 +604,21 @@ pyr_frame *kpt_tracker::create_frame(IplImage *im, long long timestamp)
 		p->images[0] = im;
 		lf->cv_pyramid.clear();
 	} else {
-		p = new PyrImage(im, nb_levels, false);
+		p = new PyrImage(im, nb_levels, false, patch_tagger::patch_size);
 	}
 
+	// descriptors of older frames are not needed anymore
+	if (descriptor_history>0)
+		for (frame_iterator it(get_nth_frame_it(descriptor_history)); !it.end(); ++it) {
+			pyr_frame *old = (pyr_frame *) it.elem();
+			if (old->descriptors.empty()) break;
+			old->release_descriptors();
+		}
+
 	//return new pyr_frame(*this, p, 4);
 	pyr_frame *f = (pyr_frame*)(((pyr_frame::pyr_frame_factory_t *) tframe_factory)->create(p,4));
 	f->timestamp = timestamp;
+	f->descriptors.pool = &descriptor_blocks;
 	return f;
 }
 
@@ -299,20 +634,22 @@ void kpt_tracker::detect_keypoints(pyr_frame *f) {
 
 	TaskTimer::pushTask("descriptor");
 	// transfer points to tracks structure
-	for (int i=0; i<nb_points; i++) {
-		//if (points[i].score>0) {
-			pyr_keypoint *p = kpt_recycler.get_new();
-                        p->set(f,points[i],patch_size);
-
-			if (p->stdev < 10*10) {
-				p->dispose();
-			}
-                        else {
-                            assert(p->descriptor.total>0);
-                        }
+	batch.kpts.resize(nb_points);
+	if (nb_points>0)
+		kpt_recycler.get_new(&batch.kpts[0], nb_points);
+	for (int i=0; i<nb_points; i++)
+		batch.kpts[i]->set(f,points[i],patch_size,false);
+	if (nb_points>0)
+		describe_keypoints(&batch.kpts[0], nb_points);
 
-			//pyr_keypoint *p = new pyr_keypoint(f, points[i], patch_size);
-		//}
+	for (int i=0; i<nb_points; i++) {
+		pyr_keypoint *p = batch.kpts[i];
+		if (p->stdev < 10*10) {
+			p->dispose();
+		}
+		else {
+			assert(p->descriptor->total>0);
+		}
 	}
 	TaskTimer::popTask();
 #endif
@@ -347,7 +684,7 @@ void kpt_tracker::detect_keypoints(pyr_frame *f) {
 		p->mser.e2.x *= mag*2; p->mser.e2.y *= mag*2;
 		
 		p->set(f, p->mser.c.x, p->mser.c.y, /*log2f(cv::norm(p->mser.e1))*/ 0, patch_size);
-		if (p->descriptor.total==0) p->dispose();
+		if (p->descriptor->total==0) p->dispose();
 	}
 #endif
 
@@ -415,7 +752,7 @@ bool should_track_point(pyr_keypoint *point) {
 void kpt_tracker::track_ncclk(pyr_frame *f, pyr_frame *lf)
 {
 	// match all points of frame t-1 with points on frame t
-	ncc_calls=0;
+	ncc_evaluations=0;
 	if (!f || !lf) return;
 	assert(f->tracker == this);
 	assert(lf->tracker == this);
@@ -499,7 +836,7 @@ void kpt_tracker::track_ncclk(pyr_frame *f, pyr_frame *lf)
             cv::calcOpticalFlowPyrLK(lf->cv_pyramid, f->cv_pyramid,
                                      prev_ft, curr_ft, lk_status, lk_error,
                                      cv::Size(patch_size, patch_size),
-                                     4,
+                                     lk_levels-1,
                                      cv::TermCriteria(cv::TermCriteria::COUNT
                                                       + cv::TermCriteria::EPS, 5, 0.1),
                                      cv::OPTFLOW_USE_INITIAL_FLOW
@@ -540,8 +877,8 @@ void kpt_tracker::track_ncclk(pyr_frame *f, pyr_frame *lf)
 	}
 
 	//if (f->points.size()>0)
-	//cout << ncc_calls << " calls to cmp_ncc, for " << f->points.size() << " points in frame. Avg: " 
-	//	<< ncc_calls / f->points.size() ;
+	//cout << ncc_evaluations << " calls to cmp_ncc, for " << f->points.size() << " points in frame. Avg: " 
+	//	<< ncc_evaluations / f->points.size() ;
 	
 	if (0) {
 		int num_lost = 0;
@@ -567,9 +904,81 @@ void kpt_tracker::track_ncclk(pyr_frame *f, pyr_frame *lf)
 
 }
 
+void kpt_tracker::describe_keypoints(pyr_keypoint **kpts, int n)
+{
+	// patches and their statistics. Within a pipeline slot, a nested
+	// parallel region would get a single thread: the work is given as tasks
+	// to the pipeline team instead.
+#ifdef _OPENMP
+	if (omp_in_parallel()) {
+		for (int c=0; c<n; c+=32) {
+#pragma omp task firstprivate(c)
+			for (int i=c; i<std::min(c+32, n); i++)
+				kpts[i]->extract_patch(patch_size);
+		}
+#pragma omp taskwait
+	} else {
+#pragma omp parallel for schedule(dynamic, 32)
+		for (int i=0; i<n; i++)
+			kpts[i]->extract_patch(patch_size);
+	}
+#else
+	for (int i=0; i<n; i++)
+		kpts[i]->extract_patch(patch_size);
+#endif
+
+#ifdef WITH_PATCH_TAGGER_DESCRIPTOR
+	// orientation of textured patches, in one batch
+	batch.textured.clear();
+	batch.patches.clear();
+	batch.descriptors.clear();
+	for (int i=0; i<n; i++) {
+		if (kpts[i]->stdev > 0) {
+			batch.textured.push_back(kpts[i]);
+			batch.patches.push_back(&kpts[i]->patch);
+			batch.descriptors.push_back(kpts[i]->descriptor);
+		}
+	}
+	int nt = (int)batch.textured.size();
+	if (nt == 0) return;
+	patch_tagger::singleton()->cmp_orientation(nt, &batch.patches[0], &batch.descriptors[0]);
+
+	// rotated, normalized patches
+	pyr_keypoint **textured = &batch.textured[0];
+#ifdef _OPENMP
+	if (omp_in_parallel()) {
+		for (int c=0; c<nt; c+=32) {
+#pragma omp task firstprivate(c)
+			for (int i=c; i<std::min(c+32, nt); i++)
+				textured[i]->extract_rotated();
+		}
+#pragma omp taskwait
+	} else {
+#pragma omp parallel for schedule(dynamic, 32)
+		for (int i=0; i<nt; i++)
+			textured[i]->extract_rotated();
+	}
+#else
+	for (int i=0; i<nt; i++)
+		textured[i]->extract_rotated();
+#endif
+#endif
+}
+
 void pyr_keypoint::prepare_patch(int win_size)
 {
 	TaskTimer::pushTask("descriptor");
+	if (extract_patch(win_size)) {
+#ifdef WITH_PATCH_TAGGER_DESCRIPTOR
+		patch_tagger::singleton()->cmp_orientation(&patch, descriptor);
+		extract_rotated();
+#endif
+	}
+	TaskTimer::popTask();
+}
+
+bool pyr_keypoint::extract_patch(int win_size)
+{
 	int half = win_size/2;
 	win_size |= 1;
 
@@ -626,50 +1035,80 @@ void pyr_keypoint::prepare_patch(int win_size)
 	mean = sum/n;
 	stdev = sqrtf(sqsum - n*mean*mean);
 
+	id = 0;
+	cid=0;
+
 	if (stdev < .1) {
-		id=0;
-		cid=0;
-		descriptor.total=0;
+		descriptor->total=0;
 		stdev=0;
-		TaskTimer::popTask();
-		return;
+		return false;
 	}
+	return true;
+}
 
-
-	id = 0;
-	cid=0;
-
+void pyr_keypoint::extract_rotated()
+{
 #ifdef WITH_PATCH_TAGGER_DESCRIPTOR
-	float subpix_x = level_u - floor(level_u);
-        float subpix_y = level_v - floor(level_v);
-
-	patch_tagger::singleton()->cmp_orientation(&patch, &descriptor);
-
+	orientation = descriptor->orientation;
 	cv::Size size(patch_tagger::patch_size, patch_tagger::patch_size);
-	cv::Mat rotated(size, CV_32FC1, descriptor._rotated);
+	cv::Mat rotated(size, CV_32FC1, descriptor->_rotated);
 	ExtractPatch(*this, size, &rotated);
 
-	if (descriptor.total ==0) {
+	if (descriptor->total ==0) {
 		stdev=0;
 	}
 #endif
-	TaskTimer::popTask();
 }
 
 void kpt_tracker::traverse_tree(pyr_frame *frame)
 {
-	if (!tree || !frame) return ;
+	if (!quantizer || !frame) return ;
 
 	TaskTimer::pushTask("tree");
 
-	for (tracks::keypoint_frame_iterator it(frame->points.begin()); !it.end(); ++it) {
-		pyr_keypoint *k = (pyr_keypoint *) it.elem();
 #ifdef WITH_PATCH_TAGGER_DESCRIPTOR
-		kmean_tree::descriptor_t array;
-		k->descriptor.array(array.descriptor);
-		k->id = tree->get_id(&array, &k->node);
+	quantize_batch_t &q = quantize_batch;
+	q.kpts.clear();
+	for (tracks::keypoint_frame_iterator it(frame->points.begin()); !it.end(); ++it)
+		q.kpts.push_back((pyr_keypoint *) it.elem());
+
+	const int n = q.kpts.size();
+	if (n>0) {
+		q.descriptors.resize(n);
+		q.ptrs.resize(n);
+		q.ids.resize(n);
+		q.nodes.resize(n);
+
+		pyr_keypoint **kpts = &q.kpts[0];
+		kmean_tree::descriptor_t *descriptors = &q.descriptors[0];
+#ifdef _OPENMP
+		if (omp_in_parallel()) {
+			for (int c=0; c<n; c+=64) {
+#pragma omp task firstprivate(c)
+				for (int i=c; i<std::min(c+64, n); ++i)
+					kpts[i]->descriptor->array(descriptors[i].descriptor);
+			}
+#pragma omp taskwait
+		} else {
+#pragma omp parallel for schedule(static)
+			for (int i=0; i<n; ++i)
+				kpts[i]->descriptor->array(descriptors[i].descriptor);
+		}
+#else
+		for (int i=0; i<n; ++i)
+			kpts[i]->descriptor->array(descriptors[i].descriptor);
 #endif
+		for (int i=0; i<n; ++i)
+			q.ptrs[i] = &descriptors[i];
+
+		quantizer->get_ids(n, &q.ptrs[0], &q.ids[0], &q.nodes[0], q.descent);
+
+		for (int i=0; i<n; ++i) {
+			q.kpts[i]->id = q.ids[i];
+			q.kpts[i]->node = q.nodes[i];
+		}
 	}
+#endif
 	TaskTimer::popTask();
 }
 
@@ -692,7 +1131,7 @@ pyr_keypoint::pyr_keypoint(tframe *f, float u, float v, int scale, int patch_siz
 pyr_keypoint::pyr_keypoint(const pyr_keypoint &a)
 	: tkeypoint(a), scale(a.scale), level(a.level), mean(a.mean),
 	stdev(a.stdev), id(a.id), cid(a.cid),
-	descriptor(a.descriptor),
+	orientation(a.orientation), descriptor(a.descriptor),
 	node(a.node)
 {
 	patch = a.patch;
@@ -715,6 +1154,7 @@ const pyr_keypoint &pyr_keypoint::operator = (const pyr_keypoint &a)
 	stdev=a.stdev;
 	id=a.id;
 	cid=a.cid;
+	orientation=a.orientation;
 	descriptor=a.descriptor;
 	node=a.node;
 	assert(data==0 || a.data==0 || a.patch.rows == patch.rows);
@@ -732,16 +1172,22 @@ const pyr_keypoint &pyr_keypoint::operator = (const pyr_keypoint &a)
 }
 
 
-void pyr_keypoint::set(tframe *f, keypoint &pt, int patch_size) 
+void pyr_keypoint::set(tframe *f, keypoint &pt, int patch_size, bool describe) 
 {
 	tkeypoint::set(f,pt.fr_u(), pt.fr_v());
 	if (data) delete[] data;
 	data=0; 
+	descriptor = static_cast<pyr_frame *>(f)->descriptors.alloc();
+	// a recycled keypoint must not keep its previous quantization.
+	id=0;
+	cid=0;
+	cscore=0;
 	scale=pt.scale;
 	score = pt.score;
 	level.u = pt.u;
 	level.v = pt.v;
-	prepare_patch(patch_size);
+	if (describe)
+		prepare_patch(patch_size);
 	node=0;
 }
 void pyr_keypoint::set(tframe *f, float u, float v, int scale, int patch_size) 
@@ -749,6 +1195,10 @@ void pyr_keypoint::set(tframe *f, float u, float v, int scale, int patch_size)
 	tkeypoint::set(f,u*(1<<scale),v*(1<<scale));
 	if (data) delete[] data;
 	data=0; 
+	descriptor = static_cast<pyr_frame *>(f)->descriptors.alloc();
+	id=0;
+	cid=0;
+	cscore=0;
 	score=0;
 	this->scale = std::min(scale, ((pyr_frame *)f)->pyr->nbLev-1);
 	level.u = u;
@@ -797,9 +1247,6 @@ bool pyr_keypoint::get_mser_patch(PyrImage &pyr, cv::Mat dst)
 
 float cmp_ncc(pyr_keypoint *a, pyr_keypoint *b)
 {
-	ncc_calls++;
-
-
 	int w=a->patch.cols;
 	int h=a->patch.rows;
 
@@ -826,6 +1273,70 @@ float cmp_ncc(pyr_keypoint *a, pyr_keypoint *b)
 	return sum/norm;
 }
 
+/*! Same result as cmp_ncc(templ, cand[i]) for each candidate. The sum of
+ *  centered products is expanded as sum(ab) - mb*sum(a) - ma*sum(b) + n*ma*mb,
+ *  so that sum(a) is computed once and the inner loop only needs sum(ab)
+ *  and sum(b), 16 pixels at a time with SSE2.
+ */
+static void cmp_ncc(const pyr_keypoint *templ, pyr_keypoint *const *cand, int n, float *ncc)
+{
+	const int w=templ->patch.cols;
+	const int h=templ->patch.rows;
+	const int ma = templ->mean;
+
+	int sa=0;
+	for (int j=0; j<h; j++) {
+		const unsigned char *pa = &CV_MAT_ELEM(templ->patch, unsigned char, j, 0);
+		for (int i=0; i<w; i++) sa += pa[i];
+	}
+
+	for (int c=0; c<n; c++) {
+		const pyr_keypoint *b = cand[c];
+		if (templ->stdev < 1 || b->stdev<1) { ncc[c]=0; continue; }
+		if (templ->id && templ->id == b->id) { ncc[c]=.95f; continue; }
+		assert(b->patch.cols == w && b->patch.rows == h);
+
+		int sab=0, sb=0;
+		int i0=0;
+#ifdef KPT_NCC_SSE2
+		i0 = w & ~15;
+		if (i0>0) {
+			const __m128i zero = _mm_setzero_si128();
+			__m128i vab = zero, vb = zero;
+			for (int j=0; j<h; j++) {
+				const unsigned char *pa = &CV_MAT_ELEM(templ->patch, unsigned char, j, 0);
+				const unsigned char *pb = &CV_MAT_ELEM(b->patch, unsigned char, j, 0);
+				for (int i=0; i<i0; i+=16) {
+					__m128i va = _mm_loadu_si128((const __m128i *)(pa+i));
+					__m128i vc = _mm_loadu_si128((const __m128i *)(pb+i));
+					vab = _mm_add_epi32(vab, _mm_madd_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vc, zero)));
+					vab = _mm_add_epi32(vab, _mm_madd_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vc, zero)));
+					vb = _mm_add_epi64(vb, _mm_sad_epu8(vc, zero));
+				}
+			}
+			vab = _mm_add_epi32(vab, _mm_shuffle_epi32(vab, _MM_SHUFFLE(1,0,3,2)));
+			vab = _mm_add_epi32(vab, _mm_shuffle_epi32(vab, _MM_SHUFFLE(2,3,0,1)));
+			sab = _mm_cvtsi128_si32(vab);
+			sb = _mm_cvtsi128_si32(vb) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(vb, vb));
+		}
+#endif
+		if (i0<w) {
+			for (int j=0; j<h; j++) {
+				const unsigned char *pa = &CV_MAT_ELEM(templ->patch, unsigned char, j, 0);
+				const unsigned char *pb = &CV_MAT_ELEM(b->patch, unsigned char, j, 0);
+				for (int i=i0; i<w; i++) {
+					sab += pa[i]*pb[i];
+					sb += pb[i];
+				}
+			}
+		}
+
+		const int mb = b->mean;
+		int sum = sab - mb*sa - ma*sb + w*h*ma*mb;
+		ncc[c] = sum/(templ->stdev*b->stdev);
+	}
+}
+
 
 struct score_kpt {
 	int score;
@@ -844,17 +1355,30 @@ pyr_keypoint *kpt_tracker::best_match(pyr_keypoint *templ, tracks::keypoint_fram
 {
 	if (it.end()) return 0;
 
+	/* candidates are scored in small batches: a batch shares the template
+	 * loads, and a score above ncc_threshold_high still stops the search
+	 * before the remaining candidates are evaluated.
+	 */
+	const int chunk = 8;
+	pyr_keypoint *cand[chunk];
+	float scores[chunk];
+
 	pyr_keypoint *best_kpt=0;
 	float best_corr=0;
 
-
-	for ( ; !it.end(); ++it) {
-		pyr_keypoint *k = (pyr_keypoint *) it.elem();
-		float ncc = cmp_ncc(templ, k);
-		if (ncc> best_corr) {
-			best_corr = ncc;
-			best_kpt = k;
-			if (best_corr>ncc_threshold_high) break;
+	while (!it.end() && best_corr <= ncc_threshold_high) {
+		int n=0;
+		for ( ; n<chunk && !it.end(); ++it)
+			cand[n++] = (pyr_keypoint *) it.elem();
+		cmp_ncc(templ, cand, n, scores);
+		ncc_evaluations += n;
+
+		for (int i=0; i<n; ++i) {
+			if (scores[i]> best_corr) {
+				best_corr = scores[i];
+				best_kpt = cand[i];
+				if (best_corr>ncc_threshold_high) break;
+			}
 		}
 	}
 
@@ -924,6 +1448,61 @@ void kpt_tracker::match_template(pyr_keypoint *templ, pyr_frame *frame, float de
 
 pyr_track::pyr_track(tracks *db) : ttrack(db), id_histo(0), nb_lk_tracked(0) {}
 
+ttrack *pyr_track::pyr_track_factory_t::create(tracks *db)
+{
+	pyr_track *t=0;
+#ifdef _OPENMP
+#pragma omp critical(pyr_track_pool)
+#endif
+	{
+		if (!pool.empty()) {
+			t = pool.back();
+			pool.pop_back();
+			counters.reused++;
+		} else
+			counters.created++;
+	}
+	if (!t) return new pyr_track(db);
+
+	// the histogram buffers keep their capacity.
+	t->db = db;
+	t->keypoints = 0;
+	t->length = 0;
+	t->nb_lk_tracked = 0;
+	t->id_histo.clear();
+	return t;
+}
+
+void pyr_track::pyr_track_factory_t::destroy(ttrack *a)
+{
+#ifdef _OPENMP
+#pragma omp critical(pyr_track_pool)
+#endif
+	{
+		pool.push_back((pyr_track *) a);
+		counters.recycled++;
+	}
+}
+
+allocation_stats pyr_track::pyr_track_factory_t::stats() const
+{
+	allocation_stats r;
+#ifdef _OPENMP
+#pragma omp critical(pyr_track_pool)
+#endif
+	{
+		r = counters;
+		r.available = pool.size();
+	}
+	return r;
+}
+
+pyr_track::pyr_track_factory_t::~pyr_track_factory_t()
+{
+	for (std::vector<pyr_track *>::iterator it(pool.begin()); it!=pool.end(); ++it)
+		delete *it;
+}
+
 void pyr_track::point_added(tkeypoint *p)
 {
 	ttrack::point_added(p);
@@ -937,11 +1516,16 @@ void pyr_track::point_added(tkeypoint *p)
 	//if (pk->id && pk->track_is_longer(4)) {
 
 		if (f->tracker->id_clusters && id_histo.query_cluster.total>0) {
-			incremental_query::iterator it = id_histo.sort_results_min_ratio(.98f);
-			//incremental_query::iterator it = id_histo.sort_results(2);
-			if (it != id_histo.end()) {
-				pk->cid = it->c->id;
-				pk->cscore = it->score;
+			// the ranked results are read by update_query_with_frame().
+			id_histo.invalidate_results(.98f);
+
+			// sort_results_min_ratio() returns nothing when the best
+			// score is not positive: the same test is made here.
+			float score;
+			id_cluster *c = id_histo.get_best(&score);
+			if (c && score > 0) {
+				pk->cid = c->id;
+				pk->cscore = score;
 			} else 
 				pk->cid=0;
 		}
@@ -30,6 +30,7 @@
 #include "patchtagger.h"
 #include "idcluster.h"
 #include "sqlite3.h"
+#include "timer.h"
 
 /*! \defgroup KptTrackingGroup Keypoint detection and tracking
 */
@@ -59,17 +60,84 @@
 
 class kpt_tracker;
 
+//! Counters reported by the keypoint and track recyclers.
+struct allocation_stats {
+	//! objects obtained from the factory.
+	unsigned long created;
+	//! requests served from the free list.
+	unsigned long reused;
+	//! objects returned to the free list.
+	unsigned long recycled;
+	//! objects currently in the free list.
+	unsigned long available;
+
+	allocation_stats() : created(0), reused(0), recycled(0), available(0) {}
+};
+
+/*! Per-frame storage for keypoint descriptors. Descriptors are allocated
+ *  in blocks that go back to a block_pool when the frame releases them,
+ *  so that keypoints of old frames do not carry histograms and patches.
+ */
+class descriptor_arena {
+public:
+	enum { block_size = 64 };
+
+	//! Recycled blocks, shared by the frames of a tracker. Thread safe.
+	class block_pool {
+	public:
+		~block_pool();
+		patch_tagger::descriptor *get();
+		void put(patch_tagger::descriptor *block);
+	private:
+		std::vector<patch_tagger::descriptor *> blocks;
+	};
+
+	descriptor_arena() : pool(0), used(block_size) {}
+	~descriptor_arena() { release(); }
+
+	//! Storage for a new descriptor, with total=0.
+	patch_tagger::descriptor *alloc();
+	//! Give all blocks back to the pool, or free them if there is none.
+	void release();
+	bool empty() const { return blocks.empty(); }
+
+	block_pool *pool;
+private:
+	std::vector<patch_tagger::descriptor *> blocks;
+	int used;
+
+	descriptor_arena(const descriptor_arena &);
+	descriptor_arena &operator=(const descriptor_arena &);
+};
+
 //! Stores a frame with its pyramid image
 struct pyr_frame : tframe {
 	PyrImage *pyr;
+	/*! LK pyramid, with derivative levels interleaved if
+	 *  kpt_tracker::lk_derivatives is set. Levels 1 and up view pyr.
+	 */
     std::vector<cv::Mat> cv_pyramid;
     long long timestamp;
 	kpt_tracker *tracker;
 
+	//! started when the frame enters the pipeline.
+	Timer pipeline_timer;
+	//! time spent between entering and leaving the pipeline, in ms.
+	double pipeline_latency;
+
+	//! descriptors of the keypoints of this frame.
+	descriptor_arena descriptors;
+
+	//! set while the frame is retired: disposed keypoints are collected there.
+	std::vector<pyr_keypoint *> *retired;
+
 	pyr_frame(PyrImage *p, int bits=4);  
 	virtual ~pyr_frame();
 	virtual void append_to(tracks &t);
 
+	//! Release the descriptors. Keypoints keep orientation, id and cid.
+	void release_descriptors();
+
 	struct pyr_frame_factory_t : factory_t {
 		virtual pyr_frame *create(PyrImage *p, int bits=4) { return new pyr_frame(p,bits); }
 	};
@@ -94,16 +162,28 @@ struct pyr_keypoint : tkeypoint {
 	bool get_mser_patch(PyrImage &pyr, cv::Mat mat);
 #endif
 
-	patch_tagger::descriptor descriptor;
+	//! patch orientation, kept when the descriptor is released.
+	float orientation;
+	/*! Histograms and rotated patch, stored in the frame descriptors.
+	 *  Null once the frame released them. Copies share the descriptor.
+	 */
+	patch_tagger::descriptor *descriptor;
 	kmean_tree::node_t *node;
 
-	pyr_keypoint() { data=0; node=0; }
+	pyr_keypoint() { data=0; node=0; orientation=0; descriptor=0; id=0; cid=0; cscore=0; }
         pyr_keypoint(const pyr_keypoint &a);
 
-	void set(tframe *f, keypoint &pt, int patch_size);
+	//! Place the keypoint in f. If describe is false, call prepare_patch later.
+	void set(tframe *f, keypoint &pt, int patch_size, bool describe=true);
 	void set(tframe *f, float u, float v, int scale, int patch_size);
 
+	//! extract_patch() followed by orientation and descriptor computation.
 	void prepare_patch(int size);
+
+	//! Set patch, mean and stdev. Returns false if the patch is flat.
+	bool extract_patch(int size);
+	//! Computes descriptor->_rotated, once descriptor->orientation is known.
+	void extract_rotated();
 	virtual ~pyr_keypoint();
 
 	virtual void dispose();
@@ -131,8 +211,18 @@ struct pyr_track : ttrack {
 
 	pyr_track(tracks *db);
 
+	/*! Recycles destroyed tracks, so that their histograms and score
+	 *  tables do not have to be allocated again for every new track.
+	 *  Derived factories overloading create() should overload destroy().
+	 */
 	struct pyr_track_factory_t : factory_t {
-		virtual ttrack *create(tracks *db) { return new pyr_track(db); }
+		virtual ttrack *create(tracks *db);
+		virtual void destroy(ttrack *a);
+		virtual ~pyr_track_factory_t();
+		allocation_stats stats() const;
+	private:
+		std::vector<pyr_track *> pool;
+		allocation_stats counters;
 	};
 };
 
@@ -152,6 +242,18 @@ public:
 	bool load_from_db(const char *dbfile);
 	bool load_tree(sqlite3 *db);
 	bool load_tree(const char *fn);
+	/*! Rebuild quantizer. Call it after modifying tree. Unless keep_tree
+	 *  is set, the node tree is then deleted and tree is reset to 0.
+	 */
+	void compile_tree();
+	//! Number of leaves of the quantizer, 0 if no tree is loaded.
+	unsigned nb_leaves() const;
+	/*! Precision of the centroids used by the quantizer. load_tree(sqlite3*)
+	 *  sets it to the format the tree was saved with. Default: CENTROID_FLOAT.
+	 *  Changing the format of a loaded tree requires keep_tree.
+	 */
+	void set_centroid_format(kmean_tree::centroid_format_t format);
+	kmean_tree::centroid_format_t get_centroid_format() const { return centroid_format; }
 	bool load_clusters(sqlite3 *db);
 	bool load_clusters(const char *fn);
 
@@ -163,23 +265,81 @@ public:
 	virtual pyr_frame *process_frame(IplImage *im, long long timestamp);
 
 	/*! Pipelined version of process_frame. 
-	 *  Returns 0 on the first call.
+	 *  Up to pipeline_depth() frames are in flight, each one in a
+	 *  different stage. All stages run concurrently. The returned frame
+	 *  was passed pipeline_depth()-1 calls before; the first calls
+	 *  return 0. Pass im=0 to drain the pipeline.
 	 *  This method takes care of releasing im.
 	 */
 	virtual pyr_frame *process_frame_pipeline(IplImage *im, long long timestamp);
 
+	//! Processing stages of a frame, in order.
+	enum pipeline_stage_t {
+		STAGE_PYRAMID,
+		STAGE_DETECT,
+		STAGE_QUANTIZE,
+		STAGE_TRACK,
+		NB_PIPELINE_STAGES
+	};
+
+	/*! Set the number of frames in flight, from 1 (no overlap) to
+	 *  NB_PIPELINE_STAGES. Consecutive stages are grouped when depth is
+	 *  smaller than NB_PIPELINE_STAGES. Default is 2.
+	 *  Frames still in the pipeline are processed before the change.
+	 */
+	void set_pipeline_depth(int depth);
+	int get_pipeline_depth() const { return pipeline_depth; }
+
+	//! Latency of the last frame returned by process_frame_pipeline, in ms.
+	double pipeline_latency;
+	//! Largest latency observed so far, in ms.
+	double pipeline_max_latency;
+	/*! Time of each stage for the last frame that went through it, in ms.
+	 *  Measured by each slot: when slots run concurrently, TaskTimer does
+	 *  not profile inside them.
+	 */
+	double pipeline_stage_time[NB_PIPELINE_STAGES];
+
+	/*! Number of recent frames whose keypoints keep their descriptors.
+	 *  Older frames release them when a new frame is created.
+	 *  0 keeps all descriptors. Default: 2.
+	 */
+	int descriptor_history;
+
+	//! Number of NCC evaluations done by the last call to track_ncclk().
+	int ncc_evaluations;
+
+	//! Keypoint recycler counters.
+	allocation_stats keypoint_stats() const { return kpt_recycler.stats(); }
+	//! Track pool counters of the pyr_track factory.
+	allocation_stats track_stats() const;
+
 protected:
         pyr_frame *create_frame(IplImage *im, long long timestamp);
-        static void buildPyramid(pyr_frame *frame);
+        static void buildPyramid(pyr_frame *frame, bool derivatives=false);
+
+	/*! Run a single pipeline stage on f. Stages are called in order on
+	 *  each frame. Only STAGE_TRACK touches the tracks structure, and it
+	 *  is never called concurrently. Derived classes can extend it.
+	 */
+	virtual void run_pipeline_stage(int stage, pyr_frame *f);
 public:
 	pyr_frame *add_frame(IplImage *im, long long timestamp);
 	void traverse_tree(pyr_frame *frame);
 	void detect_keypoints(pyr_frame *f);
+
+	/*! Computes patches and descriptors of n keypoints placed with
+	 *  set(..., false), in parallel.
+	 */
+	void describe_keypoints(pyr_keypoint **kpts, int n);
 	void track_ncclk(pyr_frame *f, pyr_frame *lf);
 
 	//! remove all frames, all keypoints, and all tracks.
 	void clear();
 
+	//! Removes the n oldest frames, recycling their keypoints in one batch.
+	virtual void retire_frames(int n);
+
 
 #ifdef WITH_YAPE
 	pyr_yape *detector;
@@ -194,7 +354,15 @@ public:
 	CvMat *adapt_thresh_mat;
 #endif
 
+	//! vocabulary tree, 0 once compiled unless keep_tree is set.
 	kmean_tree::node_t *tree;
+	/*! Keep tree after compile_tree(), so that keypoints get their leaf
+	 *  in pyr_keypoint::node. Default: false.
+	 */
+	bool keep_tree;
+	//! compiled copy of tree, used by traverse_tree.
+	kmean_tree::flat_tree *quantizer;
+	kmean_tree::centroid_format_t centroid_format;
 	id_cluster_collection *id_clusters;
 
 	int nb_points;
@@ -203,32 +371,78 @@ public:
 	int patch_size;
 	float ncc_threshold, ncc_threshold_high;
 
+	/*! Compute the Scharr derivatives of the LK pyramid with the pyramid.
+	 *  Otherwise LK computes them for the previous frame, when needed.
+	 *  Default: false.
+	 */
+	bool lk_derivatives;
+
 	pyr_keypoint *best_match(pyr_keypoint *templ, tracks::keypoint_frame_iterator it);
 
 private:
 
+	/*! Per-tracker free list of keypoints. Disposed keypoints are kept
+	 *  with their buffers and handed out again by get_new(). When the list
+	 *  is empty, a slab of slab_size keypoints is created at once through
+	 *  the keypoint factory, so that derived keypoint types are preserved.
+	 *  Detection and tracking may run in different pipeline slots: the list
+	 *  is protected by an omp critical section.
+	 */
 	class recycler_t {
 	public:
-		recycler_t(pyr_keypoint::pyr_keypoint_factory_t *f) : factory(f) {}
-
-		pyr_keypoint *get_new() { 
-			return (pyr_keypoint *)factory->create();
-		}
-		void recycle(pyr_keypoint *obj) { delete (obj); }
-		void clear() {
-			while (!available.empty()) { delete available.top(); available.pop(); }
-		}
+		recycler_t(pyr_keypoint::pyr_keypoint_factory_t *f, int slab_size=512);
+
+		pyr_keypoint *get_new();
+		//! Fetch n keypoints at once, with a single lock.
+		void get_new(pyr_keypoint **dst, int n);
+		void recycle(pyr_keypoint *obj);
+		//! Recycle n keypoints at once, with a single lock.
+		void recycle(pyr_keypoint **objs, int n);
+		//! Delete every keypoint in the free list.
+		void clear();
 		~recycler_t() { clear(); }
+
+		allocation_stats stats() const;
 	protected:
-		std::stack<pyr_keypoint *> available;
+		void refill(int n);
+
+		std::vector<pyr_keypoint *> available;
 		pyr_keypoint::pyr_keypoint_factory_t *factory;
+		int slab_size;
+		allocation_stats counters;
 	};
 
 	recycler_t kpt_recycler;
+	descriptor_arena::block_pool descriptor_blocks;
+	//! keypoints collected by retire_frames().
+	std::vector<pyr_keypoint *> retired_kpts;
 	friend struct pyr_keypoint;
 
+	//! Structure of arrays reused by describe_keypoints from frame to frame.
+	struct describe_batch_t {
+		std::vector<pyr_keypoint *> kpts;
+		std::vector<pyr_keypoint *> textured;
+		std::vector<CvMat *> patches;
+		std::vector<patch_tagger::descriptor *> descriptors;
+	};
+	describe_batch_t batch;
+
+	//! Arrays reused by traverse_tree. Separate from batch: detection and
+	//! quantization may run concurrently in the pipeline.
+	struct quantize_batch_t {
+		std::vector<pyr_keypoint *> kpts;
+		std::vector<kmean_tree::descriptor_t> descriptors;
+		std::vector<const kmean_tree::descriptor_t *> ptrs;
+		std::vector<unsigned> ids;
+		std::vector<kmean_tree::node_t *> nodes;
+		kmean_tree::flat_tree::descent_buffers descent;
+	};
+	quantize_batch_t quantize_batch;
+
 protected:
-	pyr_frame *pipeline_stage1;
+	//! pipeline[s] is the frame currently processed by pipeline slot s.
+	pyr_frame *pipeline[NB_PIPELINE_STAGES];
+	int pipeline_depth;
 };
 
 /*@}*/
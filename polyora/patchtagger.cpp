@@ -19,11 +19,16 @@
 */
 /* Julien Pilet, 2009. */
 #include <limits>
+#include <algorithm>
 #include "patchtagger.h"
 #include <iostream>
 #include <math.h>
 #include "kmeantree.h"
 #include "pca_descriptor.h"
+#include "fvec4.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #ifndef M_2PI
 #define M_2PI 6.283185307179586476925286766559f
@@ -95,40 +100,6 @@ patch_tagger *patch_tagger::singleton() {
 }
 
 void patch_tagger::precalc() {
-	for (int a=-255; a<=256; a++)
-		for (int b=-255;b<=256;b++) {
-			double angle = atan2((double)b,(double)a)/(2*M_PI);
-			if (angle<0) angle+=1;
-			if (angle>=1) angle-=1;
-			unsigned l = (unsigned)floor(256*sqrt((double)(a*a+b*b)));
-			float obinf = nb_orient * angle +.5f;
-			unsigned o1 = (unsigned)floor(obinf);
-			float r = obinf - o1;
-			unsigned o2;
-			unsigned l1,l2;
-			if (r>0.5f) {
-				o2 = (o1+1) % nb_orient;
-				r -= .5f;
-				l1 = (unsigned)(l * (1.0f-r));
-				l2 = (unsigned)(l * r);
-			} else {
-				o2 = (o1-1+nb_orient) % nb_orient;
-				l1 = (unsigned)(l * (r+.5));
-				l2 = (unsigned)(l * (.5f-r));
-			}
-			//if (l1>255) std::cerr << l1 << " should be <255!\n";
-			//if (l2>255) std::cerr << l2 << " should be <255!\n";
-
-			int idx_a = 255 + a;
-			int idx_b = 255 + b;
-			assert(idx_a >= 0 && idx_a < 512);
-			assert(idx_b >= 0 && idx_b < 512);
-			cart2polar_table[255+b][255+a].dir1 = o1;
-			cart2polar_table[255+b][255+a].length1 = l1;
-			cart2polar_table[255+b][255+a].dir2 = o2;
-			cart2polar_table[255+b][255+a].length2 = l2;
-		}
-
 	float c= patch_size/2.0f -1 ;
 
 	//unsigned char patch_im[patch_size][patch_size][3];
@@ -201,37 +172,125 @@ void patch_tagger::precalc() {
 #endif
 }
 
+static inline fvec4 select(const fvec4 &mask, const fvec4 &a, const fvec4 &b) {
+	return (a & mask) | fvec4(_mm_andnot_ps(mask.data, b.data));
+}
+
+/*! Computes 4 orientation bins and their lengths with 4-way SIMD. The angle
+ * is given by a polynomial approximation of atan2, accurate to 1e-5 rad.
+ * For each gradient, the length is split between the closest bin (dir1)
+ * and its neighbor on the side of the angle (dir2).
+ */
+void patch_tagger::grad2polar(const int *gx, const int *gy, unsigned *dir1, unsigned *dir2,
+		unsigned *length1, unsigned *length2)
+{
+	const fvec4 zero(0.0f), one(1.0f), half(.5f);
+	const fvec4 sign_mask(_mm_castsi128_ps(_mm_set1_epi32(0x7fffffff)));
+
+	fvec4 a(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)gx)));
+	fvec4 b(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)gy)));
+
+	fvec4 len(_mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_mul_ps(_mm_set1_ps(256.0f),
+			_mm_sqrt_ps((a*a + b*b).data)))));
+
+	// atan2(b,a), first computed in [0, pi/4] and then unfolded.
+	fvec4 abs_a = a & sign_mask;
+	fvec4 abs_b = b & sign_mask;
+	fvec4 mx = max(abs_a, abs_b);
+	fvec4 mn = min(abs_a, abs_b);
+	fvec4 t = mn / max(mx, one);
+	fvec4 t2 = t*t;
+	fvec4 angle = ((fvec4(-0.0464964749f)*t2 + fvec4(0.15931422f))*t2 - fvec4(0.327622764f))*t2*t + t;
+	angle = select(abs_b > abs_a, fvec4(float(M_PI/2)) - angle, angle);
+	angle = select(a < zero, fvec4(float(M_PI)) - angle, angle);
+
+	// fraction of a turn, in [0,1[.
+	angle = angle * fvec4(float(1.0/(2*M_PI)));
+	angle = select(b < zero, one - angle, angle);
+	angle = angle & (angle < one);
+
+	fvec4 obinf = fvec4(float(nb_orient)) * angle + half;
+	__m128i o1 = _mm_cvttps_epi32(obinf.data);
+	fvec4 r = obinf - fvec4(_mm_cvtepi32_ps(o1));
+
+	// r > .5: the second bin is o1+1, with weight r-.5.
+	// otherwise: the second bin is o1-1, with weight .5-r.
+	fvec4 up = r > half;
+	fvec4 w2 = select(up, r - half, half - r);
+	__m128i step = _mm_or_si128(_mm_and_si128(_mm_castps_si128(up.data), _mm_set1_epi32(1)),
+			_mm_andnot_si128(_mm_castps_si128(up.data), _mm_set1_epi32(nb_orient-1)));
+	__m128i mask = _mm_set1_epi32(nb_orient-1);
+	__m128i o2 = _mm_and_si128(_mm_add_epi32(o1, step), mask);
+	o1 = _mm_and_si128(o1, mask);
+
+	_mm_storeu_si128((__m128i *)dir1, o1);
+	_mm_storeu_si128((__m128i *)dir2, o2);
+	_mm_storeu_si128((__m128i *)length1, _mm_cvttps_epi32((len * (one - w2)).data));
+	_mm_storeu_si128((__m128i *)length2, _mm_cvttps_epi32((len * w2).data));
+}
+
 void patch_tagger::cmp_orientation_histogram(CvMat *patch,
 					     patch_tagger::descriptor *d) {
 	d->clear();
 
 	const int h = patch_size - 1;
 	const int w = patch_size - 1;
+
+	// gradients of a row, padded to a multiple of 4.
+	int gx[patch_size], gy[patch_size];
+	unsigned dir1[patch_size], dir2[patch_size];
+	unsigned length1[patch_size], length2[patch_size];
+	gx[w] = gy[w] = 0;
+	gx[w-1] = gy[w-1] = 0;
+
 	for (int y=1; y<h; y++) {
 		unsigned char *line = &CV_MAT_ELEM(*patch, unsigned char, y, 0);
 		unsigned char *line_up = &CV_MAT_ELEM(*patch, unsigned char, y-1, 0);
 		unsigned char *line_down = &CV_MAT_ELEM(*patch, unsigned char, y+1, 0);
-		histo_entry *weight = &weight_table[y][0];
+		histo_entry *weight = &weight_table[y][1];
 
-		// striped inner loop
 		for (int x=1; x<w; x++) {
-			int dx = 255+(line[x+1]-line[x-1])/2;
-			int dy = 255+(line_down[x]-line_up[x])/2;
-
-			grad2polar_entry &polar(cart2polar_table[dy][dx]);
-
-                        unsigned z1 = weight[x].zone1;
-                        unsigned z2 = weight[x].zone2;
-                        unsigned w1 = weight[x].weight1;
-                        unsigned w2 = weight[x].weight2;
-                        d->histo[z1][polar.dir1] += w1 * polar.length1;
-                        d->histo[z1][polar.dir2] += w1 * polar.length2;
-                        d->histo[z2][polar.dir1] += w2 * polar.length1;
-                        d->histo[z2][polar.dir2] += w2 * polar.length2;
+			gx[x-1] = (line[x+1]-line[x-1])/2;
+			gy[x-1] = (line_down[x]-line_up[x])/2;
+		}
+		for (unsigned x=0; x<patch_size; x+=4)
+			grad2polar(gx+x, gy+x, dir1+x, dir2+x, length1+x, length2+x);
+
+		for (int x=0; x<w-1; x++) {
+			unsigned z1 = weight[x].zone1;
+			unsigned z2 = weight[x].zone2;
+			unsigned w1 = weight[x].weight1;
+			unsigned w2 = weight[x].weight2;
+			d->histo[z1][dir1[x]] += w1 * length1[x];
+			d->histo[z1][dir2[x]] += w1 * length2[x];
+			d->histo[z2][dir1[x]] += w2 * length1[x];
+			d->histo[z2][dir2[x]] += w2 * length2[x];
 		}
 	}
 }
 
+void patch_tagger::cmp_orientation(unsigned n, CvMat *const *patches, patch_tagger::descriptor *const *d)
+{
+#ifdef _OPENMP
+	// called from a pipeline slot: hand the patches to the enclosing team
+	if (omp_in_parallel()) {
+		for (int c=0; c<(int)n; c+=16) {
+#pragma omp task firstprivate(c)
+			for (int i=c; i<std::min(c+16, (int)n); i++)
+				cmp_orientation(patches[i], d[i]);
+		}
+#pragma omp taskwait
+	} else {
+#pragma omp parallel for schedule(dynamic, 16)
+		for (int i=0; i<(int)n; i++)
+			cmp_orientation(patches[i], d[i]);
+	}
+#else
+	for (int i=0; i<(int)n; i++)
+		cmp_orientation(patches[i], d[i]);
+#endif
+}
+
 void patch_tagger::cmp_orientation(CvMat *patch, patch_tagger::descriptor *d) {
 	cmp_orientation_histogram(patch, d);
 
@@ -52,6 +52,9 @@ class patch_tagger {
 	};
 
 	void cmp_orientation(CvMat *patch, patch_tagger::descriptor *d);
+
+	//! Describe n patches at once, in parallel.
+	void cmp_orientation(unsigned n, CvMat *const *patches, patch_tagger::descriptor *const *d);
 	unsigned project(patch_tagger::descriptor *d);
     static void unproject(float *descriptor, cv::Mat *dst);
 
@@ -69,14 +72,11 @@ protected:
 
 	histo_entry weight_table[patch_size][patch_size];
 
-	struct grad2polar_entry {
-		unsigned length1;
-		unsigned length2;
-		unsigned char dir1;
-		unsigned char dir2;
-	};
-	grad2polar_entry cart2polar_table[512][512];
-
+	/*! Converts gradients to two weighted orientation bins. Replaces a
+	 *  512x512 lookup table that did not fit in cache.
+	 */
+	static void grad2polar(const int *gx, const int *gy, unsigned *dir1, unsigned *dir2,
+			unsigned *length1, unsigned *length2);
 
 	struct random_node {
 		unsigned char zone1, orient1;
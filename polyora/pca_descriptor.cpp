@@ -27,8 +27,12 @@ void IlluminationNormalizeMeanStdDev(const Mat& warped, Mat* dest) {
     warped.convertTo(*dest, dest->type(), normalize, - mean[0] * normalize);
 }
 
+// Largest patch ExtractPatch can handle without allocating memory.
+const int kMaxPatchArea = 64 * 64;
+
 void IlluminationNormalizeEqualizeHistogram(const Mat& warped, Mat* dest) {
-    Mat equalized(warped.size(), CV_8UC1);
+    unsigned char buffer[kMaxPatchArea];
+    Mat equalized(warped.size(), CV_8UC1, buffer);
     cv::equalizeHist(warped, equalized);
     equalized.convertTo(*dest, dest->type(), 1.0/255.0, 0);
 }
@@ -45,8 +49,8 @@ void IlluminationNormalize(const Mat& warped, Mat* dest) {
 
 void ExtractPatch(const pyr_keypoint& point, cv::Size patch_size, Mat* dest) {
     assert(dest != 0);
-    assert(point.descriptor.orientation >= 0);
-    assert(point.descriptor.orientation <= M_2PI);
+    assert(point.orientation >= 0);
+    assert(point.orientation <= M_2PI);
 
     pyr_frame *frame = static_cast<pyr_frame *>(point.frame);
     int scale = max(0, min(frame->pyr->nbLev - 1, static_cast<int>(point.scale)));
@@ -65,15 +69,19 @@ void ExtractPatch(const pyr_keypoint& point, cv::Size patch_size, Mat* dest) {
     const double ty = - patch_size.height / 2.0f;
     const double t2x = point.level.u;
     const double t2y = point.level.v;
-    const double ca = cos(point.descriptor.orientation);
-    const double sa = sin(point.descriptor.orientation);
+    const double ca = cos(point.orientation);
+    const double sa = sin(point.orientation);
 
     double transform_data[6] = {
 	ca, -sa, ca*tx - sa*ty + t2x,
 	sa, ca, sa*tx + ca*ty + t2y,
     };
     Mat transform(2, 3, CV_64FC1, transform_data);
-    Mat warped(patch_size, CV_8UC1);
+    // Stack buffers: ExtractPatch is called for every keypoint, from
+    // several threads.
+    assert(patch_size.width * patch_size.height <= kMaxPatchArea);
+    unsigned char warped_data[kMaxPatchArea];
+    Mat warped(patch_size, CV_8UC1, warped_data);
     cv::warpAffine(Mat(im), warped, transform, patch_size,
 	    cv::INTER_LINEAR + cv::WARP_INVERSE_MAP, cv::BORDER_REPLICATE);
 
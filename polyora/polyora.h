@@ -127,8 +127,7 @@ The resulting visual.db should contain the quantization tree for descriptors, an
 Visual objects can also be stored in the same file.
 
 If you have large files (>2 GB), compiling and running these tools in a 64 bits
-environment might be necessary. Please note also that cluster_ids can require a
-large amount of memory.
+environment might be necessary.
 
 \section tracking Tracking planar objects
 
@@ -39,19 +39,30 @@ Street, Fifth Floor, Boston, MA 02110-1301, USA
 */
 #include <iostream>
 #include <highgui.h>
+#include <opencv2/imgproc/imgproc.hpp>
 #include "pyrimage.h"
 
 using namespace std;
 
-PyrImage::PyrImage(IplImage *im, int nblev, bool build_it) : nbLev(nblev)
+PyrImage::PyrImage(IplImage *im, int nblev, bool build_it, int border) : nbLev(nblev), border(border)
 {
   images = new IplImage *[nblev];
+  padded = new IplImage *[nblev];
 
   images[0] = im;
+  padded[0] = 0;
 
   for (int i=1; i<nbLev; ++i) {
-    images[i] = cvCreateImage(cvSize(images[i-1]->width/2, images[i-1]->height/2),
-                              im->depth, im->nChannels);
+    CvSize s = cvSize(images[i-1]->width/2, images[i-1]->height/2);
+    if (border) {
+      padded[i] = cvCreateImage(cvSize(s.width + 2*border, s.height + 2*border), im->depth, im->nChannels);
+      images[i] = cvCreateImageHeader(s, im->depth, im->nChannels);
+      cvSetData(images[i], padded[i]->imageData + border*padded[i]->widthStep
+          + border*(im->depth & 255)/8*im->nChannels, padded[i]->widthStep);
+    } else {
+      padded[i] = 0;
+      images[i] = cvCreateImage(s, im->depth, im->nChannels);
+    }
   }
 
   if (build_it)  
@@ -59,15 +70,28 @@ PyrImage::PyrImage(IplImage *im, int nblev, bool build_it) : nbLev(nblev)
 }
 
 PyrImage::~PyrImage() {
-  for (int i=0; i<nbLev; ++i) 
-    cvReleaseImage(&images[i]);
+  for (int i=0; i<nbLev; ++i) {
+    if (padded[i]) {
+      cvReleaseImageHeader(&images[i]);
+      cvReleaseImage(&padded[i]);
+    } else
+      cvReleaseImage(&images[i]);
+  }
   delete [] images;
+  delete [] padded;
 }
 
 void PyrImage::build()
 {
-  for (int i=1; i<nbLev; ++i) 
+  for (int i=1; i<nbLev; ++i) {
     cvPyrDown(images[i-1], images[i]);
+    if (padded[i]) {
+      cv::Mat level(images[i]);
+      cv::Mat all(padded[i]);
+      cv::copyMakeBorder(level, all, border, border, border, border,
+          cv::BORDER_REFLECT_101 | cv::BORDER_ISOLATED);
+    }
+  }
 }
 
 PyrImage *PyrImage::load(int level, const char *filename, int color, bool fatal) {
@@ -137,7 +161,7 @@ void PyrImage::set(CvScalar val)
 
 PyrImage *PyrImage::clone() const
 {
-  PyrImage *p = new PyrImage(cvCloneImage(images[0]), nbLev);
+  PyrImage *p = new PyrImage(cvCloneImage(images[0]), nbLev, false, border);
   for (int i=1; i<nbLev; ++i)
     cvCopy(images[i], p->images[i]);
   return p;
@@ -157,10 +181,14 @@ void PyrImage::setImageROI(CvRect rect)
 
 void PyrImage::swap(PyrImage &a) {
    assert(nbLev == a.nbLev);
+   assert(border == a.border);
    for (int i=0; i<nbLev; i++) {
       IplImage *tmp = a[i];
       a.images[i] = images[i];
       images[i] = tmp;
+      tmp = a.padded[i];
+      a.padded[i] = padded[i];
+      padded[i] = tmp;
    }
 }
 
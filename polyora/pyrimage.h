@@ -59,12 +59,18 @@ Street, Fifth Floor, Boston, MA 02110-1301, USA
 class PyrImage {
 public:
    // By default, do not build the pyramid, just allocates RAM.
-   PyrImage(IplImage *im, int nblev, bool build_it=false);
+   /*! If border is not 0, levels 1 and up are surrounded by border pixels,
+    * filled by build() as cv::BORDER_REFLECT_101 does. Level 0 remains im.
+    */
+   PyrImage(IplImage *im, int nblev, bool build_it=false, int border=0);
   ~PyrImage();
 
   //! build the pyramid from level 0 by calling cvPyrDown()
   void build();
 
+  //! The padded image around level l > 0, or 0 if border is 0.
+  IplImage *get_padded(int l) const { return padded[l]; }
+
   //! try to load an image with cvLoadImage() and build a PyrImage.
   //! \return 0 on failure or a valid PyrImage that has to be deleted by the caller.
   static PyrImage *load(int level, const char *filename, int color, bool fatal = true);
@@ -122,6 +128,11 @@ public:
 
   const int nbLev;
   IplImage **images;
+  const int border;
+
+private:
+  //! padded[l] holds the pixels of images[l], a header on its interior.
+  IplImage **padded;
 
 };
 
@@ -30,6 +30,7 @@ typedef std::list<TaskTimer *> TaskStack;
 
 #define MAX_THREADS 256
 static TaskStack thread_stacks[MAX_THREADS];
+static bool enabled_in_parallel = true;
 
 #else
 static TaskStack stack;
@@ -230,8 +231,15 @@ void TaskTimer::printStats(int indent, double total, CharDoubleMap &flatProfile)
 	}
 }
 
+void TaskTimer::setEnabledInParallel(bool enabled) {
+#ifdef _OPENMP
+	enabled_in_parallel = enabled;
+#endif
+}
+
 void TaskTimer::pushTask(const char *task) {
 #ifdef _OPENMP
+	if (!enabled_in_parallel && omp_in_parallel()) return;
 	TaskStack &stack = thread_stacks[omp_get_thread_num()];
 #endif
 	if (stack.size() == 0) 
@@ -243,6 +251,7 @@ void TaskTimer::pushTask(const char *task) {
 void TaskTimer::popTask()
 {
 #ifdef _OPENMP
+	if (!enabled_in_parallel && omp_in_parallel()) return;
 	TaskStack &stack = thread_stacks[omp_get_thread_num()];
 #endif
 	// it is forbidden to pop Root
@@ -285,5 +294,6 @@ TaskTimer *TaskTimer::setTask(const char *task) {return 0;}
 void TaskTimer::printStats(int indent, double total, CharDoubleMap &flatProfile) {}
 void TaskTimer::pushTask(const char *task) {}
 void TaskTimer::popTask() {}
+void TaskTimer::setEnabledInParallel(bool enabled) {}
 void TaskTimer::printStats() {}
 #endif
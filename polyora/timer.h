@@ -77,6 +77,11 @@ public:
 
 	static void pushTask(const char *task);
 	static void popTask();
+	/*! When disabled, pushTask() and popTask() do nothing inside parallel
+	 *  regions. Stages running concurrently would interleave on the
+	 *  per-thread stacks. Call it outside parallel regions.
+	 */
+	static void setEnabledInParallel(bool enabled);
 	static void printStats();
 	
 protected:
@@ -76,6 +76,51 @@ void tframe::append_to(tracks &t)
 {
 	assert(frames.next ==0 && frames.prev==0);
 	MLIST_INSERT(t.frames, this, frames);
+	t.ring_push_front(this);
+
+	if (t.max_frames>0 && t.ring_size >= t.max_frames + t.retire_batch)
+		t.retire_frames(t.ring_size - t.max_frames);
+}
+
+void tracks::ring_push_front(tframe *f)
+{
+	if (ring_size == (int)ring.size()) {
+		// grow, keeping the most recent frame first.
+		std::vector<tframe *> r(ring.empty() ? 16 : 2*ring.size());
+		for (int i=0; i<ring_size; ++i)
+			r[i] = ring[(ring_start+i) & (ring.size()-1)];
+		ring.swap(r);
+		ring_start=0;
+	}
+	ring_start = (ring_start-1) & (ring.size()-1);
+	ring[ring_start] = f;
+	ring_size++;
+}
+
+void tracks::ring_remove(tframe *f)
+{
+	const unsigned mask = ring.size()-1;
+
+	// frames are usually removed from the old end.
+	int n = ring_size-1;
+	while (n>=0 && ring[(ring_start+n) & mask] != f) --n;
+	if (n<0) return;
+
+	for (; n<ring_size-1; ++n)
+		ring[(ring_start+n) & mask] = ring[(ring_start+n+1) & mask];
+	ring_size--;
+}
+
+void tracks::set_max_frames(int max_frames, int batch)
+{
+	this->max_frames = (max_frames>0 ? max_frames : 0);
+	retire_batch = (batch>0 ? batch : 1);
+}
+
+void tracks::retire_frames(int n)
+{
+	while (n-- > 0 && ring_size > 0)
+		remove_frame(get_nth_frame(ring_size-1));
 }
 
 void tkeypoint::set(tframe *f, float u, float v) 
@@ -112,7 +157,7 @@ int tkeypoint::track_length() {
 }
 
 tracks::tracks(tkeypoint::factory_t *kf, tframe::factory_t *ff, ttrack::factory_t *tf) 
-	: frames(0),all_tracks(0) 
+	: frames(0),all_tracks(0), ring_start(0), ring_size(0), max_frames(0), retire_batch(1)
 {
 	static tkeypoint::factory_t default_kf;
 	static tframe::factory_t default_ff;
@@ -131,12 +176,9 @@ tracks::~tracks() {
 }
 
 tracks::frame_iterator tracks::get_nth_frame_it(int n) {
-	frame_iterator it(this);
-	for (int i=0; i<n; i++) {
-		if (!it.end()) ++it;
-		else return it;
-	}
-	return it;
+	if (n<0) n=0;
+	if (n >= ring_size) return frame_iterator((tframe *)0);
+	return frame_iterator(ring[(ring_start+n) & (ring.size()-1)]);
 }
 
 tframe *tracks::get_nth_frame(int n) {
@@ -221,6 +263,7 @@ void tracks::remove_frame(tframe *frame) {
 	assert(frame->points.size() == 0);
 
 	MLIST_RM(&frames, frame, frames);
+	ring_remove(frame);
 
 	tframe_factory->destroy(frame);
 }
@@ -20,6 +20,7 @@
 #ifndef TRACKS_H
 #define TRACKS_H
 
+#include <vector>
 #include "mlist.h"
 #include "bucket2d.h"
 
@@ -216,12 +217,22 @@ public:
 		tframe *elem() { return frame; }
 	};
 
-	//! Get a frame iterator for the Nth last frame. n=0 returns the most recent frame.
+	//! Get a frame iterator for the Nth last frame. n=0 returns the most recent frame. O(1).
 	frame_iterator get_nth_frame_it(int n);
 
-	//! returns a pointer to the Nth last frame. 0 returns the most recent frame.
+	//! returns a pointer to the Nth last frame. 0 returns the most recent frame. O(1).
 	tframe *get_nth_frame(int n);
 
+	//! Number of frames in the structure.
+	int nb_frames() const { return ring_size; }
+
+	/*! Bound the frame history to max_frames. Frames are retired by
+	 *  retire_frames() in groups, once batch extra frames are appended.
+	 *  0 keeps all frames (default).
+	 */
+	void set_max_frames(int max_frames, int batch=16);
+	int get_max_frames() const { return max_frames; }
+
 	//! Spacial iterator for keypoints within a frame.
 	typedef bucket2d<tkeypoint>::iterator keypoint_frame_iterator;
 
@@ -257,12 +268,29 @@ public:
 	//! Removes the frame pointed by frame.
 	void remove_frame(tframe *frame);
 
+	//! Removes the n oldest frames. Derived classes can release them in bulk.
+	virtual void retire_frames(int n);
+
 	tframe *frames;
 	ttrack *all_tracks;
 
 	tkeypoint::factory_t *keypoint_factory;
 	tframe::factory_t *tframe_factory;
 	ttrack::factory_t *ttrack_factory;
+
+private:
+	friend struct tframe;
+
+	/*! Frames, most recent first, in a ring whose size is a power of 2:
+	 *  the Nth last frame is ring[(ring_start+n) & (ring.size()-1)].
+	 */
+	std::vector<tframe *> ring;
+	unsigned ring_start;
+	int ring_size;
+	int max_frames, retire_batch;
+
+	void ring_push_front(tframe *f);
+	void ring_remove(tframe *f);
 };
 
 inline float point2d::dist(const point2d &a)
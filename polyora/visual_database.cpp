@@ -20,13 +20,23 @@
 
 #include "visual_database.h"
 #include <opencv2/calib3d/calib3d.hpp>
+#include <highgui.h>
 #include <algorithm>
 #include <iostream>
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
 visual_object::visual_object(visual_database *vdb, sqlite3_int64 id, const char *comment, int flags)
-       	: sorted(false), obj_id(id), vdb(vdb), comment(comment), flags(flags)
+       	: sorted(false), obj_id(id), vdb(vdb), representative_image(-1), comment(comment), flags(flags)
 {
 	M=0;
 }
@@ -35,38 +45,101 @@ visual_object::~visual_object() {
 	if (M) cvReleaseMat(&M);
 }
 
-void visual_object::add(db_keypoint &p)
+db_keypoint *visual_object::add(const db_keypoint &p, const float *patch)
 {
-	points.insert(p);
-	//points.push_back(p);
-	//sorted=false;
-
 	// add the point to the histogram
 	id_cluster::add(p.cid);
+	return store(p, patch);
+}
+
+db_keypoint *visual_object::store(const db_keypoint &p, const float *patch)
+{
+	storage.push_back(p);
+	db_keypoint *k = &storage.back();
+	k->patch = storage.size()-1;
+	for (unsigned i=0; i<PATCH_FLOATS; ++i)
+		patches.push_back(kmean_tree::float_to_half(patch[i]));
+	sorted=false;
+	return k;
+}
+
+db_keypoint *visual_object::store(const db_keypoint &p, const unsigned short *half_patch)
+{
+	storage.push_back(p);
+	db_keypoint *k = &storage.back();
+	k->patch = storage.size()-1;
+	patches.insert(patches.end(), half_patch, half_patch + PATCH_FLOATS);
+	sorted=false;
+	return k;
+}
+
+void visual_object::get_patch(const db_keypoint *k, float *patch) const
+{
+	const unsigned short *h = &patches[k->patch * PATCH_FLOATS];
+	for (unsigned i=0; i<PATCH_FLOATS; ++i)
+		patch[i] = kmean_tree::half_to_float(h[i]);
+}
+
+static bool db_keypoint_ptr_cmp(const db_keypoint *a, const db_keypoint *b)
+{
+	return a->cid < b->cid;
+}
+
+static inline unsigned cid_slot(unsigned cid, unsigned mask)
+{
+	return (cid * 2654435761u) & mask;
 }
 
 void visual_object::prepare()
 {
-	/*
-	if (!sorted) {
-		sort(points.begin(), points.end());
-		sorted = true;
+	if (sorted) return;
+
+	// new keypoints are at the end of storage. Sort and merge them.
+	unsigned n = points.size();
+	for (unsigned i=n; i<storage.size(); ++i)
+		points.push_back(&storage[i]);
+	std::stable_sort(points.begin() + n, points.end(), db_keypoint_ptr_cmp);
+	std::inplace_merge(points.begin(), points.begin() + n, points.end(), db_keypoint_ptr_cmp);
+
+	// the table is at most half full.
+	unsigned size = 8;
+	while (size < 2*histo.size()) size *= 2;
+	cid_range empty = {0, 0, 0};
+	ranges.assign(size, empty);
+	const unsigned mask = size-1;
+	for (unsigned i=0; i<points.size(); ) {
+		unsigned cid = points[i]->cid;
+		unsigned end = i+1;
+		while (end < points.size() && points[end]->cid == cid) ++end;
+		unsigned slot = cid_slot(cid, mask);
+		while (ranges[slot].end) slot = (slot+1) & mask;
+		ranges[slot].cid = cid;
+		ranges[slot].begin = i;
+		ranges[slot].end = end;
+		i = end;
 	}
-	*/
+	sorted = true;
+}
+
+const visual_object::cid_range *visual_object::find_range(unsigned cid) const
+{
+	if (ranges.empty()) return 0;
+	const unsigned mask = ranges.size()-1;
+	for (unsigned slot = cid_slot(cid, mask); ranges[slot].end; slot = (slot+1) & mask)
+		if (ranges[slot].cid == cid) return &ranges[slot];
+	return 0;
 }
 
 void visual_object::find(unsigned id, db_keypoint_vector::iterator &start, db_keypoint_vector::iterator &end)
 {
 	prepare();
-	db_keypoint k(id,0);
-	//start = lower_bound(points.begin(), points.end(), k);
-	start = points.lower_bound(k);
-	if (start == points.end()) {
-		end = points.end();
+	const cid_range *r = find_range(id);
+	if (!r) {
+		start = end = points.end();
 		return;
 	}
-	end = points.upper_bound(k);
-	//end = upper_bound(start, points.end(), k);
+	start = points.begin() + r->begin;
+	end = points.begin() + r->end;
 }
 
 
@@ -175,22 +248,127 @@ void init_query_with_frame(incremental_query &query, pyr_frame *frame)
 		query.modify(it->first, it->second);
 }
 
-visual_database::visual_database(id_cluster_collection::query_flags flags) : id_cluster_collection(flags), db(0)
+#ifndef WIN32
+#define LOCK_WRITES() pthread_mutex_lock(&write_mutex)
+#define UNLOCK_WRITES() pthread_mutex_unlock(&write_mutex)
+#else
+#define LOCK_WRITES()
+#define UNLOCK_WRITES()
+#endif
+
+#ifdef _OPENMP
+#define LOCK_IMAGES() omp_set_lock(&image_lock)
+#define UNLOCK_IMAGES() omp_unset_lock(&image_lock)
+#else
+#define LOCK_IMAGES()
+#define UNLOCK_IMAGES()
+#endif
+
+//! An image shared by the cache and the image_ref returned by get_image().
+struct visual_database::shared_image {
+	IplImage *im;
+	int refs;
+};
+
+visual_database::image_ref::image_ref(const image_ref &a) : vdb(a.vdb), s(a.s)
+{
+	if (s) vdb->ref_image(s, 1);
+}
+
+visual_database::image_ref &visual_database::image_ref::operator=(const image_ref &a)
 {
+	if (a.s) a.vdb->ref_image(a.s, 1);
+	if (s) vdb->ref_image(s, -1);
+	vdb = a.vdb;
+	s = a.s;
+	return *this;
+}
+
+visual_database::image_ref::~image_ref()
+{
+	if (s) vdb->ref_image(s, -1);
+}
+
+IplImage *visual_database::image_ref::get() const
+{
+	// the image of a shared_image never changes: no lock needed.
+	return s ? s->im : 0;
+}
+
+/*! A row to insert or delete. Rows are given their id when queued, so that
+ * the objects in memory never wait for the writer.
+ */
+struct visual_database::pending_write {
+	enum type_t { IMAGE, OBJECT, KEYPOINT, ANNOTATION, REMOVE_OBJECT, USER_VERSION } type;
+	sqlite3_int64 id, obj;
+	img_id img;
+	//! cid of a keypoint.
+	unsigned cid;
+	//! flags of an object, type of an annotation, format of an image or user_version.
+	int flags;
+	float u, v, scale, orientation;
+	//! comment of an object, or annotation text.
+	std::string text;
+	IplImage *im;
+	float patch[visual_object::PATCH_FLOATS];
+
+	pending_write(type_t t)
+		: type(t), id(0), obj(0), img(0), cid(0), flags(0),
+		u(0), v(0), scale(0), orientation(0), im(0) {}
+	~pending_write() { if (im) cvReleaseImage(&im); }
+};
+
+visual_database::visual_database(id_cluster_collection::query_flags flags)
+	: id_cluster_collection(flags), db(0), write_db(0),
+	writer_running(false), writer_quit(false), write_ready(0), write_group_depth(0),
+	writes_pushed(0), writes_done(0), img_written(0),
+	next_img_id(1), next_obj_id(1), next_annotation_id(1), image_format(IMAGE_RAW),
+	load_db(0), loader_running(false), loader_quit(false), modified(false)
+{
+	memset(&cache_stats, 0, sizeof(cache_stats));
+	cache_stats.budget = 64*1024*1024;
+#ifdef _OPENMP
+	omp_init_lock(&image_lock);
+#endif
+#ifndef WIN32
+	pthread_mutex_init(&write_mutex, 0);
+	pthread_cond_init(&write_cond, 0);
+	pthread_mutex_init(&load_mutex, 0);
+	pthread_cond_init(&load_cond, 0);
+#endif
 }
 
 visual_database::~visual_database()
 {
+	stop_loader();
+	stop_writer();
+#ifndef WIN32
+	pthread_cond_destroy(&write_cond);
+	pthread_mutex_destroy(&write_mutex);
+	pthread_cond_destroy(&load_cond);
+	pthread_mutex_destroy(&load_mutex);
+#endif
+
 	for (stmt_cache_map::iterator it(stmt_cache.begin()); it!=stmt_cache.end(); ++it)
 		sqlite3_finalize(it->second);
+	for (stmt_cache_map::iterator it(write_stmts.begin()); it!=write_stmts.end(); ++it)
+		sqlite3_finalize(it->second);
+	if (write_db && write_db != db) sqlite3_close(write_db);
+	for (stmt_cache_map::iterator it(load_stmts.begin()); it!=load_stmts.end(); ++it)
+		sqlite3_finalize(it->second);
+	if (load_db && load_db != db) sqlite3_close(load_db);
 
+	// images still referenced by an image_ref are freed by it.
 	for (image_cache_map::iterator it(image_cache.begin()); it!=image_cache.end(); ++it)
-		cvReleaseImage(&it->second);
+		ref_image_locked(it->second.s, -1);
 
 	if (db) sqlite3_close(db);
+#ifdef _OPENMP
+	omp_destroy_lock(&image_lock);
+#endif
 }
 
-bool visual_database::open(const char *fn)
+bool visual_database::open(const char *fn, bool use_snapshot)
 {
 	sqlite3 *sql3;
 	int rc = sqlite3_open(fn, &sql3);
@@ -199,14 +377,19 @@ bool visual_database::open(const char *fn)
 		sqlite3_close(sql3);
 		return false;
 	}
-	return connect_to_db(sql3);
+	if (!use_snapshot) return connect_to_db(sql3);
+	string snapshot_fn = string(fn) + ".snapshot";
+	return connect_to_db(sql3, snapshot_fn.c_str());
 }
 
-bool visual_database::connect_to_db(sqlite3 *sql3db)
+bool visual_database::connect_to_db(sqlite3 *sql3db, const char *snapshot_fn)
 {
 	if (!sql3db) return false;
 
 	db = sql3db;
+	write_db = db;
+	// the writer thread commits through its own connection.
+	sqlite3_busy_timeout(db, 10000);
 
 	// create tables
 	char *errmsg;
@@ -248,11 +431,49 @@ bool visual_database::connect_to_db(sqlite3 *sql3db)
 	}
 
 	// Load the content of the database
-	
+	sqlite3_int64 stamp[STAMP_SIZE];
+	bool stamped = snapshot_fn && get_stamp(stamp);
+	modified = false;
+	if (!(stamped && load_snapshot(snapshot_fn, stamp))) {
+		if (!load_objects()) return false;
+		if (stamped) save_snapshot(snapshot_fn, stamp);
+	}
+
+	// rows are written in the background: their ids are given here.
+	next_img_id = last_rowid("images") + 1;
+	next_obj_id = last_rowid("Objects") + 1;
+	next_annotation_id = last_rowid("annotations") + 1;
+	img_written = next_img_id - 1;
+	start_writer();
+	start_loader();
+
+	version++;
+	return true;
+}
+
+sqlite3_int64 visual_database::last_rowid(const char *table)
+{
+	// autoincrement tables never reuse the id of a deleted row.
+	const char *queries[2] = { "select max(rowid) from ", "select seq from sqlite_sequence where name=" };
+	sqlite3_int64 r=0;
+	for (int i=0; i<2; ++i) {
+		string query = string(queries[i]) + (i ? "'" + string(table) + "'" : string(table));
+		sqlite3_stmt *stmt=0;
+		// the annotations table might not exist.
+		if (sqlite3_prepare_v2(db, query.c_str(), -1, &stmt, 0) != SQLITE_OK) continue;
+		if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int64(stmt, 0) > r)
+			r = sqlite3_column_int64(stmt, 0);
+		sqlite3_finalize(stmt);
+	}
+	return r;
+}
+
+bool visual_database::load_objects()
+{
 	const char *query="select obj_id,comment,flags from Objects";
 	sqlite3_stmt *stmt=0;
 	const char *tail=0;
-	rc = sqlite3_prepare_v2(db, query, -1, &stmt, &tail);
+	int rc = sqlite3_prepare_v2(db, query, -1, &stmt, &tail);
 
 	if (rc != SQLITE_OK) {
 		cerr << "Error: " << sqlite3_errmsg(db) << endl;
@@ -274,13 +495,11 @@ bool visual_database::connect_to_db(sqlite3 *sql3db)
 			kpt.u = float(sqlite3_column_double(kpt_stmt, 2));
 			kpt.v = float(sqlite3_column_double(kpt_stmt, 3));
 			kpt.scale = int(sqlite3_column_double(kpt_stmt, 4));
-			kpt.descriptor.orientation = float(sqlite3_column_double(kpt_stmt, 5));
+			kpt.orientation = float(sqlite3_column_double(kpt_stmt, 5));
 
-			const unsigned length = sizeof(kpt.descriptor._rotated);
-			assert((unsigned)sqlite3_column_bytes(kpt_stmt, 6) == length);
-			memcpy(kpt.descriptor._rotated, sqlite3_column_blob(kpt_stmt, 6), length);
+			assert((unsigned)sqlite3_column_bytes(kpt_stmt, 6) == visual_object::PATCH_FLOATS*sizeof(float));
 			vo->representative_image = kpt.image;
-			vo->add(kpt);
+			vo->add(kpt, (const float *) sqlite3_column_blob(kpt_stmt, 6));
 		}
 		vo->prepare();
 		add_to_index(vo);
@@ -300,47 +519,371 @@ bool visual_database::connect_to_db(sqlite3 *sql3db)
 	}
 
 	sqlite3_finalize(stmt);
+	return true;
+}
 
-	version++;
+namespace {
+const char snapshot_magic[8] = { 'P','O','L','Y','S','N','A','P' };
+
+/* File layout: header, objects, keypoints, patches, annotations, and the
+ * string table. Every section but the last is a multiple of 8 bytes.
+ */
+struct snapshot_header {
+	char magic[8];
+	unsigned patch_bytes;
+	unsigned header_bytes;
+	sqlite3_int64 stamp[4];
+	sqlite3_int64 nb_objects, nb_keypoints, nb_annotations, strings_size;
+};
+
+struct snapshot_object {
+	sqlite3_int64 obj_id, representative_image;
+	sqlite3_int64 first_keypoint, nb_keypoints;
+	sqlite3_int64 first_annotation, nb_annotations;
+	//! offset in the string table
+	sqlite3_int64 comment;
+	int flags, pad;
+};
+
+struct snapshot_keypoint {
+	img_id image;
+	unsigned cid;
+	float u, v;
+	int scale;
+	float orientation;
+	int pad;
+};
+
+struct snapshot_annotation {
+	sqlite3_int64 id, descr;
+	float x, y;
+	int type, pad;
+};
+
+//! patches are stored in half precision, as in visual_object.
+const unsigned patch_bytes = visual_object::PATCH_FLOATS * sizeof(unsigned short);
+
+size_t snapshot_size(const snapshot_header &h)
+{
+	return sizeof(snapshot_header)
+		+ h.nb_objects * sizeof(snapshot_object)
+		+ h.nb_keypoints * (sizeof(snapshot_keypoint) + patch_bytes)
+		+ h.nb_annotations * sizeof(snapshot_annotation)
+		+ h.strings_size;
+}
+
+bool visual_object_cmp(const visual_object *a, const visual_object *b) { return a->id() < b->id(); }
+}
+
+bool visual_database::get_stamp(sqlite3_int64 *stamp)
+{
+	const char *queries[STAMP_SIZE] = {
+		"PRAGMA user_version",
+		"select max(rowid) from Objects",
+		"select max(rowid) from Keypoints",
+		"select max(rowid) from annotations"
+	};
+	for (int i=0; i<STAMP_SIZE; ++i) {
+		// the annotations table might not exist.
+		sqlite3_stmt *stmt = get_cached_stmt(queries[i], i<3);
+		stamp[i] = 0;
+		if (stmt == 0) {
+			if (i<3) return false;
+			continue;
+		}
+		if (sqlite3_step(stmt) == SQLITE_ROW)
+			stamp[i] = sqlite3_column_int64(stmt, 0);
+		sqlite3_reset(stmt);
+	}
 	return true;
 }
 
+void visual_database::invalidate_snapshot()
+{
+	if (modified) return;
+	modified = true;
+
+	sqlite3_int64 stamp[STAMP_SIZE];
+	if (!get_stamp(stamp)) return;
+	pending_write *w = new pending_write(pending_write::USER_VERSION);
+	w->flags = (int)(stamp[0]+1);
+	push_write(w);
+}
+
+bool visual_database::save_snapshot(const char *fn, const sqlite3_int64 *stamp)
+{
+	std::vector<visual_object *> objects;
+	objects.reserve(clusters.size());
+	for (cluster_set::iterator it(clusters.begin()); it!=clusters.end(); ++it)
+		objects.push_back((visual_object *) *it);
+	std::sort(objects.begin(), objects.end(), visual_object_cmp);
+
+	snapshot_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, snapshot_magic, sizeof(h.magic));
+	h.patch_bytes = patch_bytes;
+	h.header_bytes = sizeof(h);
+	for (int i=0; i<STAMP_SIZE; ++i) h.stamp[i] = stamp[i];
+
+	std::vector<snapshot_object> obj(objects.size());
+	std::vector<snapshot_keypoint> kpts;
+	std::vector<char> patches;
+	std::vector<snapshot_annotation> annotations;
+	std::vector<char> strings;
+	for (unsigned i=0; i<objects.size(); ++i) {
+		visual_object *vo = objects[i];
+		snapshot_object &o = obj[i];
+		memset(&o, 0, sizeof(o));
+		o.obj_id = vo->obj_id;
+		o.representative_image = vo->representative_image;
+		o.flags = vo->flags;
+		o.comment = strings.size();
+		strings.insert(strings.end(), vo->comment.c_str(), vo->comment.c_str() + vo->comment.size() + 1);
+
+		vo->prepare();
+		o.first_keypoint = kpts.size();
+		o.nb_keypoints = vo->points.size();
+		for (visual_object::db_keypoint_vector::iterator it(vo->points.begin()); it!=vo->points.end(); ++it) {
+			const db_keypoint *p = *it;
+			snapshot_keypoint k;
+			memset(&k, 0, sizeof(k));
+			k.image = p->image;
+			k.cid = p->cid;
+			k.u = p->u;
+			k.v = p->v;
+			k.scale = p->scale;
+			k.orientation = p->orientation;
+			kpts.push_back(k);
+			const char *patch = (const char *) &vo->patches[p->patch * visual_object::PATCH_FLOATS];
+			patches.insert(patches.end(), patch, patch + patch_bytes);
+		}
+
+		o.first_annotation = annotations.size();
+		o.nb_annotations = vo->annotations.size();
+		for (visual_object::annotation_iterator it(vo->annotation_begin()); it!=vo->annotation_end(); ++it) {
+			snapshot_annotation a;
+			memset(&a, 0, sizeof(a));
+			a.id = it->id;
+			a.x = it->x;
+			a.y = it->y;
+			a.type = it->type;
+			a.descr = strings.size();
+			strings.insert(strings.end(), it->descr.c_str(), it->descr.c_str() + it->descr.size() + 1);
+			annotations.push_back(a);
+		}
+	}
+	h.nb_objects = obj.size();
+	h.nb_keypoints = kpts.size();
+	h.nb_annotations = annotations.size();
+	h.strings_size = strings.size();
+
+	// write to a temporary file, so that a snapshot is either complete or missing.
+	string tmp_fn = string(fn) + ".tmp";
+	FILE *f = fopen(tmp_fn.c_str(), "wb");
+	if (!f) {
+		perror(tmp_fn.c_str());
+		return false;
+	}
+	bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+	if (ok && obj.size()) ok = fwrite(&obj[0], sizeof(snapshot_object), obj.size(), f) == obj.size();
+	if (ok && kpts.size()) ok = fwrite(&kpts[0], sizeof(snapshot_keypoint), kpts.size(), f) == kpts.size();
+	if (ok && patches.size()) ok = fwrite(&patches[0], 1, patches.size(), f) == patches.size();
+	if (ok && annotations.size())
+		ok = fwrite(&annotations[0], sizeof(snapshot_annotation), annotations.size(), f) == annotations.size();
+	if (ok && strings.size()) ok = fwrite(&strings[0], 1, strings.size(), f) == strings.size();
+	if (fclose(f) != 0) ok = false;
+#ifdef WIN32
+	if (ok) remove(fn);
+#endif
+	if (ok && rename(tmp_fn.c_str(), fn) != 0) {
+		perror(fn);
+		ok = false;
+	}
+	if (!ok) {
+		cerr << fn << ": unable to write snapshot.\n";
+		remove(tmp_fn.c_str());
+	}
+	return ok;
+}
+
+bool visual_database::load_snapshot(const char *fn, const sqlite3_int64 *stamp)
+{
+	size_t size;
+#ifdef WIN32
+	FILE *f = fopen(fn, "rb");
+	if (!f) return false;
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	std::vector<char> buffer(size+1);
+	bool read_ok = fread(&buffer[0], 1, size, f) == size;
+	fclose(f);
+	if (!read_ok) return false;
+	const char *data = &buffer[0];
+#else
+	int fd = ::open(fn, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) < 0 || statbuf.st_size < (off_t) sizeof(snapshot_header)) {
+		::close(fd);
+		return false;
+	}
+	size = statbuf.st_size;
+	const char *data = (const char *) mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (data == (const char *)-1) {
+		perror(fn);
+		return false;
+	}
+#endif
+
+	// check that the snapshot matches the database, and is consistent.
+	const snapshot_header *h = (const snapshot_header *) data;
+	bool ok = size >= sizeof(snapshot_header)
+		&& memcmp(h->magic, snapshot_magic, sizeof(h->magic)) == 0
+		&& h->patch_bytes == patch_bytes
+		&& h->header_bytes == sizeof(snapshot_header)
+		&& h->nb_objects >= 0 && h->nb_keypoints >= 0
+		&& h->nb_annotations >= 0 && h->strings_size >= 0
+		&& snapshot_size(*h) == size;
+	for (int i=0; ok && i<STAMP_SIZE; ++i)
+		if (h->stamp[i] != stamp[i]) ok = false;
+
+	const snapshot_object *obj = (const snapshot_object *) (data + sizeof(snapshot_header));
+	const snapshot_keypoint *kpts = (const snapshot_keypoint *) (obj + (ok ? h->nb_objects : 0));
+	const char *patches = (const char *) (kpts + (ok ? h->nb_keypoints : 0));
+	const snapshot_annotation *annotations = (const snapshot_annotation *) 
+		(patches + (ok ? h->nb_keypoints * patch_bytes : 0));
+	const char *strings = (const char *) (annotations + (ok ? h->nb_annotations : 0));
+
+	if (ok && h->strings_size > 0 && strings[h->strings_size-1] != 0) ok = false;
+	for (sqlite3_int64 i=0; ok && i<h->nb_objects; ++i) {
+		const snapshot_object &o = obj[i];
+		ok = o.first_keypoint >= 0 && o.nb_keypoints >= 0 
+			&& o.first_keypoint + o.nb_keypoints <= h->nb_keypoints
+			&& o.first_annotation >= 0 && o.nb_annotations >= 0
+			&& o.first_annotation + o.nb_annotations <= h->nb_annotations
+			&& o.comment >= 0 && o.comment < h->strings_size;
+		for (sqlite3_int64 a=0; ok && a<o.nb_annotations; ++a) {
+			sqlite3_int64 d = annotations[o.first_annotation + a].descr;
+			ok = d >= 0 && d < h->strings_size;
+		}
+	}
+
+	if (ok) {
+		for (sqlite3_int64 i=0; i<h->nb_objects; ++i) {
+			const snapshot_object &o = obj[i];
+			visual_object *vo = new visual_object(this, o.obj_id, strings + o.comment, o.flags);
+			vo->representative_image = o.representative_image;
+
+			for (sqlite3_int64 k=o.first_keypoint; k<o.first_keypoint+o.nb_keypoints; ++k) {
+				db_keypoint kpt(kpts[k].cid, kpts[k].image);
+				kpt.u = kpts[k].u;
+				kpt.v = kpts[k].v;
+				kpt.scale = kpts[k].scale;
+				kpt.orientation = kpts[k].orientation;
+				vo->id_cluster::add(kpt.cid);
+				vo->store(kpt, (const unsigned short *) (patches + k*patch_bytes));
+			}
+			vo->prepare();
+			add_to_index(vo);
+
+			for (sqlite3_int64 a=o.first_annotation; a<o.first_annotation+o.nb_annotations; ++a) {
+				const snapshot_annotation &an = annotations[a];
+				vo->annotations.push_back(visual_object::annotation(
+							an.id, an.x, an.y, strings + an.descr, an.type));
+			}
+		}
+	}
+
+#ifndef WIN32
+	munmap((void *)data, size);
+#endif
+	return ok;
+}
+
 img_id visual_database::add_image(IplImage *_im)
 {
 	assert(_im!=0);
-	IplImage *im = cvCloneImage(_im);
 
-	const char *query = "insert into images (width, height, step, channels, data) values (?,?,?,?,?)";
-	sqlite3_stmt *stmt=get_cached_stmt(query);
-	assert(stmt!=0);
+	// the writer encodes and stores its own copy. Until it is written,
+	// get_image() copies it from the write queue.
+	pending_write *w = new pending_write(pending_write::IMAGE);
+	img_id id = w->id = next_img_id++;
+	w->flags = image_format;
+	w->im = cvCloneImage(_im);
+	push_write(w);
+	return id;
+}
 
-	int rc = sqlite3_bind_int(stmt, 1, im->width);
-	assert(rc == SQLITE_OK);
-	rc = sqlite3_bind_int(stmt, 2, im->height);
-	assert(rc == SQLITE_OK);
-	rc = sqlite3_bind_int(stmt, 3, im->widthStep);
-	assert(rc == SQLITE_OK);
-	rc = sqlite3_bind_int(stmt, 4, im->nChannels);
-	assert(rc == SQLITE_OK);
-	rc = sqlite3_bind_blob(stmt, 5, im->imageData, im->height*im->widthStep, SQLITE_STATIC);
-	assert(rc == SQLITE_OK);
+visual_database::shared_image *visual_database::cache_image(img_id id, IplImage *im)
+{
+	shared_image *sh = new shared_image;
+	sh->im = im;
+	sh->refs = 1;
+
+	image_lru.push_front(id);
+	cached_image &c = image_cache[id];
+	c.s = sh;
+	c.lru = image_lru.begin();
+	cache_stats.bytes += im->imageSize;
+
+	// the image just inserted is kept, even if it exceeds the budget alone.
+	trim_image_cache(1);
+	return sh;
+}
 
-	if(sqlite3_step(stmt)!=SQLITE_DONE) {
-		printf("Error message: %s\n", sqlite3_errmsg(db));
+visual_database::shared_image *visual_database::cache_loaded_image(img_id id, IplImage *im)
+{
+	image_cache_map::iterator it = image_cache.find(id);
+	if (it == image_cache.end()) return cache_image(id, im);
+	cvReleaseImage(&im);
+	image_lru.splice(image_lru.begin(), image_lru, it->second.lru);
+	return it->second.s;
+}
+
+void visual_database::trim_image_cache(unsigned min_images)
+{
+	while (cache_stats.bytes > cache_stats.budget && image_lru.size() > min_images) {
+		image_cache_map::iterator it = image_cache.find(image_lru.back());
+		cache_stats.bytes -= it->second.s->im->imageSize;
+		ref_image_locked(it->second.s, -1);
+		image_cache.erase(it);
+		image_lru.pop_back();
+		cache_stats.evictions++;
 	}
-	img_id id = sqlite3_last_insert_rowid(db);
-	image_cache[id] = im;
-	return id;
 }
 
-IplImage *visual_database::get_image(img_id img)
+void visual_database::ref_image(shared_image *sh, int delta)
 {
-	image_cache_map::iterator it = image_cache.find(img);
-	if (it != image_cache.end())
-		return it->second;
+	LOCK_IMAGES();
+	ref_image_locked(sh, delta);
+	UNLOCK_IMAGES();
+}
+
+void visual_database::ref_image_locked(shared_image *sh, int delta)
+{
+	sh->refs += delta;
+	if (sh->refs == 0) {
+		cvReleaseImage(&sh->im);
+		delete sh;
+	}
+}
+
+IplImage *visual_database::load_image(img_id img, sqlite3 *conn, stmt_cache_map &stmts)
+{
+	// the image might still wait in the write queue, or be written now.
+	LOCK_WRITES();
+	bool pending = img > img_written && img < next_img_id;
+	UNLOCK_WRITES();
+	if (pending) {
+		IplImage *queued = clone_queued_image(img);
+		if (queued) return queued;
+		flush_writes();
+	}
 
 	const char *query = "select width,height,step,channels,data from images where img_id = ?";
-	sqlite3_stmt *stmt= get_cached_stmt(query);
+	sqlite3_stmt *stmt= get_cached_stmt(conn, stmts, query, true);
 	assert(stmt!=0);
 
 	IplImage *result=0;
@@ -356,76 +899,137 @@ IplImage *visual_database::get_image(img_id img)
 		int step = sqlite3_column_int(stmt, 2);
 		int channels = sqlite3_column_int(stmt, 3);
 		void *data = const_cast<void *>(sqlite3_column_blob(stmt, 4));
+		int bytes = sqlite3_column_bytes(stmt, 4);
 
-		assert(sqlite3_column_bytes(stmt, 4) == step*height);
+		if (step == 0) {
+			// PNG or JPEG
+			cvInitMatHeader(&m, 1, bytes, CV_8UC1, data);
+			result = cvDecodeImage(&m, CV_LOAD_IMAGE_UNCHANGED);
+			if (!result) cerr << "Image " << img << ": unable to decode.\n";
+		} else {
+			assert(bytes == step*height);
 
-		cvInitMatHeader(&m, height, width, 
-				CV_MAKETYPE(CV_8U, channels), 
-				data, step);
+			cvInitMatHeader(&m, height, width, 
+					CV_MAKETYPE(CV_8U, channels), 
+					data, step);
 
-		IplImage header;
-		result = cvCloneImage(cvGetImage(&m,&header));
-		image_cache[img] = result;
+			IplImage header;
+			result = cvCloneImage(cvGetImage(&m,&header));
+		}
 	} else if (rc == SQLITE_DONE) {
 		// not found.. return 0.
 		cerr << "Image " << img << " not found !\n";
 	} else {
-		cerr << "Error while searching for image " << img << ": " << sqlite3_errmsg(db) << endl;
+		cerr << "Error while searching for image " << img << ": " << sqlite3_errmsg(conn) << endl;
 	}
+	sqlite3_reset(stmt);
 	return result;
 }
 
-visual_object *visual_database::create_object(const char *comment, int flags)
+IplImage *visual_database::load_image(img_id img)
 {
-	const char *query = "insert into Objects (comment, flags) values (?,?)";
-	sqlite3_stmt *stmt= get_cached_stmt(query);
-	assert(stmt != 0);
+	stmt_cache_map stmts;
+	IplImage *result = load_image(img, db, stmts);
+	for (stmt_cache_map::iterator it(stmts.begin()); it!=stmts.end(); ++it)
+		sqlite3_finalize(it->second);
+	return result;
+}
 
-	sqlite3_bind_text(stmt, 1, (comment? comment:""), -1, SQLITE_TRANSIENT);
-	sqlite3_bind_int(stmt, 2, flags);
-	if (sqlite3_step(stmt) != SQLITE_DONE) {
-		printf("Error message: %s\n", sqlite3_errmsg(db));
-		return 0;
+visual_database::image_ref visual_database::get_image(img_id img)
+{
+	shared_image *result=0;
+	LOCK_IMAGES();
+	image_cache_map::iterator it = image_cache.find(img);
+	if (it != image_cache.end()) {
+		cache_stats.hits++;
+		image_lru.splice(image_lru.begin(), image_lru, it->second.lru);
+		result = it->second.s;
+		// counted before unlocking: a trim from another thread can not free it.
+		result->refs++;
+	} else {
+		cache_stats.misses++;
 	}
-	visual_object *obj = new visual_object(this, sqlite3_last_insert_rowid(db), comment, flags);
-	version++;
-	return obj;
+	UNLOCK_IMAGES();
+	if (result) return image_ref(this, result);
+
+	// loading might wait for the writer: image_lock is not held.
+	IplImage *im = load_image(img);
+	if (!im) return image_ref();
+	LOCK_IMAGES();
+	result = cache_loaded_image(img, im);
+	result->refs++;
+	UNLOCK_IMAGES();
+	return image_ref(this, result);
 }
 
-bool visual_database::remove_object(visual_object *obj)
+void visual_database::prefetch_images(const std::vector<img_id> &images)
 {
-	// destroy data on disk first
-
-	exec_sql("begin");
-
-	sqlite3_stmt *stmt= get_cached_stmt("delete from objects where obj_id=?");
-	assert(stmt != 0);
-	sqlite3_bind_int64(stmt, 1, obj->obj_id);
-
-	if (sqlite3_step(stmt) != SQLITE_DONE) {
-		printf("Error message: %s\n", sqlite3_errmsg(db));
-		return false;
+#ifndef WIN32
+	if (loader_running) {
+		pthread_mutex_lock(&load_mutex);
+		for (std::vector<img_id>::const_iterator i(images.begin()); i!=images.end(); ++i)
+			if (std::find(load_queue.begin(), load_queue.end(), *i) == load_queue.end())
+				load_queue.push_back(*i);
+		pthread_cond_signal(&load_cond);
+		pthread_mutex_unlock(&load_mutex);
+		return;
 	}
-
-	stmt= get_cached_stmt("delete from keypoints where obj_id=?");
-	assert(stmt != 0);
-	sqlite3_bind_int64(stmt, 1, obj->obj_id);
-
-	if (sqlite3_step(stmt) != SQLITE_DONE) {
-		printf("Error message: %s\n", sqlite3_errmsg(db));
-		return false;
+#endif
+	// no loader thread: load from the calling thread.
+	for (std::vector<img_id>::const_iterator i(images.begin()); i!=images.end(); ++i) {
+		LOCK_IMAGES();
+		bool cached = image_cache.find(*i) != image_cache.end();
+		UNLOCK_IMAGES();
+		if (cached) continue;
+
+		IplImage *im = load_image(*i);
+		if (im) {
+			LOCK_IMAGES();
+			cache_loaded_image(*i, im);
+			UNLOCK_IMAGES();
+		}
 	}
+}
+
+void visual_database::set_image_cache_size(size_t bytes)
+{
+	LOCK_IMAGES();
+	cache_stats.budget = bytes;
+	trim_image_cache(0);
+	UNLOCK_IMAGES();
+}
 
-	stmt= get_cached_stmt("delete from images where img_id=?");
-	assert(stmt != 0);
-	sqlite3_bind_int64(stmt, 1, obj->representative_image);
+visual_database::image_cache_stats visual_database::get_image_cache_stats()
+{
+	LOCK_IMAGES();
+	image_cache_stats r = cache_stats;
+	r.images = image_cache.size();
+	UNLOCK_IMAGES();
+	return r;
+}
 
-	if (sqlite3_step(stmt) != SQLITE_DONE) {
-		printf("Error message: %s\n", sqlite3_errmsg(db));
-		return false;
-	}
+visual_object *visual_database::create_object(const char *comment, int flags)
+{
+	invalidate_snapshot();
+	pending_write *w = new pending_write(pending_write::OBJECT);
+	sqlite3_int64 id = w->id = next_obj_id++;
+	w->flags = flags;
+	w->text = (comment ? comment : "");
+	push_write(w);
+
+	visual_object *obj = new visual_object(this, id, comment, flags);
+	version++;
+	return obj;
+}
 
-	exec_sql("commit");
+bool visual_database::remove_object(visual_object *obj)
+{
+	// destroy data on disk first
+	invalidate_snapshot();
+	pending_write *w = new pending_write(pending_write::REMOVE_OBJECT);
+	w->obj = obj->obj_id;
+	w->img = obj->representative_image;
+	push_write(w);
 
 	// now update the RAM index
 	remove_cluster(obj);
@@ -440,6 +1044,11 @@ bool visual_database::remove_object(visual_object *obj)
 
 
 sqlite3_stmt *visual_database::get_cached_stmt(const char *query, bool verbose)
+{
+	return get_cached_stmt(db, stmt_cache, query, verbose);
+}
+
+sqlite3_stmt *visual_database::get_cached_stmt(sqlite3 *db, stmt_cache_map &stmt_cache, const char *query, bool verbose)
 {
 	assert(db!=0);
 	stmt_cache_map::iterator it(stmt_cache.find(query));
@@ -478,9 +1087,402 @@ bool visual_database::exec_sql(const char *query)
 	return true;
 }
 
+static bool step_write(sqlite3 *db, sqlite3_stmt *stmt)
+{
+	if (stmt == 0) return false;
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		printf("Error message: %s\n", sqlite3_errmsg(db));
+		sqlite3_reset(stmt);
+		return false;
+	}
+	sqlite3_reset(stmt);
+	return true;
+}
+
+bool visual_database::exec_write(pending_write *w)
+{
+	sqlite3_stmt *stmt=0;
+	switch (w->type) {
+	case pending_write::IMAGE:
+	{
+		IplImage *im = w->im;
+
+		// encoded images are marked by step=0.
+		const void *data = im->imageData;
+		int size = im->height*im->widthStep;
+		int step = im->widthStep;
+		CvMat *encoded = 0;
+		if (w->flags != IMAGE_RAW) {
+			encoded = cvEncodeImage(w->flags == IMAGE_PNG ? ".png" : ".jpg", im);
+			if (encoded) {
+				data = encoded->data.ptr;
+				size = encoded->rows * encoded->cols;
+				step = 0;
+			}
+		}
+		stmt = get_cached_stmt(write_db, write_stmts,
+			"insert into images (img_id, width, height, step, channels, data) values (?,?,?,?,?,?)", true);
+		assert(stmt!=0);
+		sqlite3_bind_int64(stmt, 1, w->id);
+		sqlite3_bind_int(stmt, 2, im->width);
+		sqlite3_bind_int(stmt, 3, im->height);
+		sqlite3_bind_int(stmt, 4, step);
+		sqlite3_bind_int(stmt, 5, im->nChannels);
+		sqlite3_bind_blob(stmt, 6, data, size, SQLITE_STATIC);
+		bool ok = step_write(write_db, stmt);
+		if (encoded) cvReleaseMat(&encoded);
+		return ok;
+	}
+	case pending_write::OBJECT:
+		stmt = get_cached_stmt(write_db, write_stmts, "insert into Objects (obj_id, comment, flags) values (?,?,?)", true);
+		assert(stmt!=0);
+		sqlite3_bind_int64(stmt, 1, w->id);
+		sqlite3_bind_text(stmt, 2, w->text.c_str(), -1, SQLITE_STATIC);
+		sqlite3_bind_int(stmt, 3, w->flags);
+		return step_write(write_db, stmt);
+
+	case pending_write::KEYPOINT:
+		stmt = get_cached_stmt(write_db, write_stmts,
+			"insert into Keypoints (obj_id, cid, img_id, u, v, scale, orient, patch) values (?,?,?,?,?,?,?,?)", true);
+		assert(stmt!=0);
+		sqlite3_bind_int64(stmt, 1, w->obj);
+		sqlite3_bind_int(stmt, 2, w->cid);
+		sqlite3_bind_int64(stmt, 3, w->img);
+		sqlite3_bind_double(stmt, 4, w->u);
+		sqlite3_bind_double(stmt, 5, w->v);
+		sqlite3_bind_double(stmt, 6, w->scale);
+		sqlite3_bind_double(stmt, 7, w->orientation);
+		sqlite3_bind_blob(stmt, 8, w->patch, sizeof(w->patch), SQLITE_STATIC);
+		return step_write(write_db, stmt);
+
+	case pending_write::ANNOTATION:
+		stmt = get_cached_stmt(write_db, write_stmts,
+			"create table if not exists annotations (obj integer, x real, y real, type integer, descr text)", true);
+		if (!step_write(write_db, stmt)) return false;
+		stmt = get_cached_stmt(write_db, write_stmts,
+			"insert into annotations (rowid, obj, x, y, type, descr) values (?,?,?,?,?,?)", true);
+		assert(stmt!=0);
+		sqlite3_bind_int64(stmt, 1, w->id);
+		sqlite3_bind_int64(stmt, 2, w->obj);
+		sqlite3_bind_double(stmt, 3, w->u);
+		sqlite3_bind_double(stmt, 4, w->v);
+		sqlite3_bind_int(stmt, 5, w->flags);
+		sqlite3_bind_text(stmt, 6, w->text.c_str(), -1, SQLITE_STATIC);
+		return step_write(write_db, stmt);
+
+	case pending_write::REMOVE_OBJECT:
+	{
+		const char *queries[3] = {
+			"delete from objects where obj_id=?",
+			"delete from keypoints where obj_id=?",
+			"delete from images where img_id=?"
+		};
+		for (int i=0; i<3; ++i) {
+			stmt = get_cached_stmt(write_db, write_stmts, queries[i], true);
+			assert(stmt!=0);
+			sqlite3_bind_int64(stmt, 1, (i<2 ? w->obj : w->img));
+			if (!step_write(write_db, stmt)) return false;
+		}
+		return true;
+	}
+	case pending_write::USER_VERSION:
+	{
+		// pragmas can not be bound: the statement is not cached.
+		char query[64];
+		sprintf(query, "PRAGMA user_version=%d", w->flags);
+		char *errmsg=0;
+		if (sqlite3_exec(write_db, query, 0, 0, &errmsg) != SQLITE_OK) {
+			cerr << "Can't update database version: " << errmsg << endl;
+			sqlite3_free(errmsg);
+			return false;
+		}
+		return true;
+	}
+	}
+	return false;
+}
+
+img_id visual_database::write_batch(std::vector<pending_write *> &batch)
+{
+	img_id last_img=0;
+	step_write(write_db, get_cached_stmt(write_db, write_stmts, "begin", true));
+	for (unsigned i=0; i<batch.size(); ++i) {
+		exec_write(batch[i]);
+		if (batch[i]->type == pending_write::IMAGE) last_img = batch[i]->id;
+		delete batch[i];
+	}
+	step_write(write_db, get_cached_stmt(write_db, write_stmts, "commit", true));
+	batch.clear();
+	return last_img;
+}
+
+void visual_database::push_write(pending_write *w)
+{
+	LOCK_WRITES();
+	write_queue.push_back(w);
+	writes_pushed++;
+	if (write_group_depth == 0) {
+		write_ready = write_queue.size();
+#ifndef WIN32
+		pthread_cond_broadcast(&write_cond);
+#endif
+	}
+	bool now = !writer_running && write_ready > 0;
+	UNLOCK_WRITES();
+	if (now) write_ready_now();
+}
+
+void visual_database::start_update()
+{
+	LOCK_WRITES();
+	write_group_depth++;
+	UNLOCK_WRITES();
+}
+
+void visual_database::finish_update()
+{
+	LOCK_WRITES();
+	assert(write_group_depth > 0);
+	if (--write_group_depth == 0) {
+		write_ready = write_queue.size();
+#ifndef WIN32
+		pthread_cond_broadcast(&write_cond);
+#endif
+	}
+	bool now = !writer_running && write_ready > 0;
+	UNLOCK_WRITES();
+	if (now) write_ready_now();
+}
+
+void visual_database::write_ready_now()
+{
+	LOCK_WRITES();
+	std::vector<pending_write *> batch(write_queue.begin(), write_queue.begin() + write_ready);
+	write_queue.erase(write_queue.begin(), write_queue.begin() + write_ready);
+	write_ready = 0;
+	UNLOCK_WRITES();
+
+	if (batch.empty()) return;
+	unsigned n = batch.size();
+	img_id last_img = write_batch(batch);
+
+	LOCK_WRITES();
+	writes_done += n;
+	if (last_img > img_written) img_written = last_img;
+	UNLOCK_WRITES();
+}
+
+void visual_database::flush_writes()
+{
+	LOCK_WRITES();
+	if (!writer_running) {
+		UNLOCK_WRITES();
+		write_ready_now();
+		return;
+	}
+#ifndef WIN32
+	// the writes of an open group stay in the queue.
+	unsigned long target = writes_pushed - (write_queue.size() - write_ready);
+	while (writes_done < target)
+		pthread_cond_wait(&write_cond, &write_mutex);
+#endif
+	UNLOCK_WRITES();
+}
+
+IplImage *visual_database::clone_queued_image(img_id img)
+{
+	IplImage *r=0;
+	LOCK_WRITES();
+	for (std::deque<pending_write *>::iterator it(write_queue.begin()); it!=write_queue.end(); ++it) {
+		if ((*it)->type == pending_write::IMAGE && (*it)->id == img) {
+			r = cvCloneImage((*it)->im);
+			break;
+		}
+	}
+	UNLOCK_WRITES();
+	return r;
+}
+
+unsigned visual_database::pending_writes()
+{
+	LOCK_WRITES();
+	unsigned r = writes_pushed - writes_done;
+	UNLOCK_WRITES();
+	return r;
+}
+
+//! File of the main database of db. Empty for in-memory and temporary databases.
+static string main_db_file(sqlite3 *db)
+{
+	string fn;
+	sqlite3_stmt *stmt=0;
+	if (sqlite3_prepare_v2(db, "PRAGMA database_list", -1, &stmt, 0) == SQLITE_OK) {
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			const char *name = (const char *) sqlite3_column_text(stmt, 1);
+			const char *file = (const char *) sqlite3_column_text(stmt, 2);
+			if (name && file && strcmp(name, "main") == 0) fn = file;
+		}
+		sqlite3_finalize(stmt);
+	}
+	return fn;
+}
+
+void visual_database::start_writer()
+{
+	if (writer_running) return;
+	writer_quit = false;
+#ifndef WIN32
+	// without a thread, modifications are written by the caller, on db.
+	// In-memory and temporary databases have no file name, and can not be
+	// opened twice.
+	string fn = main_db_file(db);
+	if (write_db == db && !fn.empty()) {
+		sqlite3 *w=0;
+		if (sqlite3_open_v2(fn.c_str(), &w, SQLITE_OPEN_READWRITE, 0) == SQLITE_OK
+				&& sqlite3_exec(w, "PRAGMA synchronous=OFF", 0, 0, 0) == SQLITE_OK) {
+			sqlite3_busy_timeout(w, 10000);
+			write_db = w;
+		} else {
+			cerr << fn << ": can't open a connection for the writer: " << sqlite3_errmsg(w) << endl;
+			sqlite3_close(w);
+		}
+	}
+	if (write_db == db) return;
+	writer_running = (pthread_create(&writer, 0, writer_main, this) == 0);
+	if (!writer_running) perror("visual_database: can't start the writer thread");
+#endif
+}
+
+void visual_database::stop_writer()
+{
+	LOCK_WRITES();
+	write_group_depth = 0;
+	write_ready = write_queue.size();
+	writer_quit = true;
+#ifndef WIN32
+	pthread_cond_broadcast(&write_cond);
+#endif
+	UNLOCK_WRITES();
+
+#ifndef WIN32
+	if (writer_running) pthread_join(writer, 0);
+#endif
+	writer_running = false;
+	write_ready_now();
+}
+
+#ifndef WIN32
+void *visual_database::writer_main(void *vdb)
+{
+	static_cast<visual_database *>(vdb)->writer_loop();
+	return 0;
+}
+
+void visual_database::writer_loop()
+{
+	std::vector<pending_write *> batch;
+	pthread_mutex_lock(&write_mutex);
+	for (;;) {
+		while (write_ready == 0 && !writer_quit)
+			pthread_cond_wait(&write_cond, &write_mutex);
+		if (write_ready == 0) break;
+
+		batch.assign(write_queue.begin(), write_queue.begin() + write_ready);
+		write_queue.erase(write_queue.begin(), write_queue.begin() + write_ready);
+		write_ready = 0;
+		pthread_mutex_unlock(&write_mutex);
+
+		unsigned n = batch.size();
+		img_id last_img = write_batch(batch);
+
+		pthread_mutex_lock(&write_mutex);
+		writes_done += n;
+		if (last_img > img_written) img_written = last_img;
+		pthread_cond_broadcast(&write_cond);
+	}
+	pthread_mutex_unlock(&write_mutex);
+}
+#endif
+
+void visual_database::start_loader()
+{
+	if (loader_running) return;
+	loader_quit = false;
+	if (load_db == 0) load_db = db;
+#ifndef WIN32
+	// without a thread, prefetch_images() loads from the caller, on db.
+	string fn = main_db_file(db);
+	if (load_db == db && !fn.empty()) {
+		sqlite3 *l=0;
+		if (sqlite3_open_v2(fn.c_str(), &l, SQLITE_OPEN_READONLY, 0) == SQLITE_OK) {
+			sqlite3_busy_timeout(l, 10000);
+			load_db = l;
+		} else {
+			cerr << fn << ": can't open a connection for the loader: " << sqlite3_errmsg(l) << endl;
+			sqlite3_close(l);
+		}
+	}
+	if (load_db == db) return;
+	loader_running = (pthread_create(&loader, 0, loader_main, this) == 0);
+	if (!loader_running) perror("visual_database: can't start the loader thread");
+#endif
+}
+
+void visual_database::stop_loader()
+{
+#ifndef WIN32
+	pthread_mutex_lock(&load_mutex);
+	load_queue.clear();
+	loader_quit = true;
+	pthread_cond_signal(&load_cond);
+	pthread_mutex_unlock(&load_mutex);
+
+	if (loader_running) pthread_join(loader, 0);
+#endif
+	loader_running = false;
+}
+
+#ifndef WIN32
+void *visual_database::loader_main(void *vdb)
+{
+	static_cast<visual_database *>(vdb)->loader_loop();
+	return 0;
+}
+
+void visual_database::loader_loop()
+{
+	pthread_mutex_lock(&load_mutex);
+	for (;;) {
+		while (load_queue.empty() && !loader_quit)
+			pthread_cond_wait(&load_cond, &load_mutex);
+		if (loader_quit) break;
+		img_id img = load_queue.front();
+		load_queue.pop_front();
+		pthread_mutex_unlock(&load_mutex);
+
+		LOCK_IMAGES();
+		bool cached = image_cache.find(img) != image_cache.end();
+		UNLOCK_IMAGES();
+
+		if (!cached) {
+			// read and decoded without holding image_lock.
+			IplImage *im = load_image(img, load_db, load_stmts);
+			if (im) {
+				LOCK_IMAGES();
+				cache_loaded_image(img, im);
+				UNLOCK_IMAGES();
+			}
+		}
+		pthread_mutex_lock(&load_mutex);
+	}
+	pthread_mutex_unlock(&load_mutex);
+}
+#endif
+
 db_keypoint *visual_object::add_keypoint(pyr_keypoint *p, img_id img)
 {
-	if (!p) return 0;
+	// the descriptor of keypoints on old frames may be released.
+	if (!p || !p->descriptor) return 0;
 	assert(this!=0);
 
 	db_keypoint db_p(*p, img);
@@ -490,39 +1492,30 @@ db_keypoint *visual_object::add_keypoint(pyr_keypoint *p, img_id img)
 
 	if (db_p.cid ==0) return 0;
 
+	vdb->invalidate_snapshot();
+
 	// add the cid to the visual object cid histogram.
 	vdb->update_cluster(this, db_p.cid, 1); 
-	db_keypoint *ret = const_cast<db_keypoint *>(&(*points.insert(db_p)));
-
-	sqlite3_stmt *stmt= vdb->get_cached_stmt(
-			"insert into Keypoints (obj_id, cid, img_id, u, v, scale, orient, patch) values (?,?,?,?,?,?,?,?)");
-	assert(stmt != 0);
-	int rc = sqlite3_bind_int64(stmt, 1, obj_id);
-	assert(rc==SQLITE_OK);
-	rc = sqlite3_bind_int(stmt, 2, db_p.cid);
-	assert(rc==SQLITE_OK);
-	rc = sqlite3_bind_int64(stmt, 3, img);
-	assert(rc==SQLITE_OK);
-	rc = sqlite3_bind_double(stmt, 4, db_p.u);
-	assert(rc==SQLITE_OK);
-	rc = sqlite3_bind_double(stmt, 5, db_p.v);
-	assert(rc==SQLITE_OK);
-	rc = sqlite3_bind_double(stmt, 6, db_p.scale);
-	assert(rc==SQLITE_OK);
-	rc = sqlite3_bind_double(stmt, 7, db_p.descriptor.orientation);
-	assert(rc==SQLITE_OK);
-	sqlite3_bind_blob(stmt, 8, p->descriptor._rotated, sizeof(p->descriptor._rotated), SQLITE_TRANSIENT);
-
-	if (sqlite3_step(stmt) != SQLITE_DONE) {
-		printf("Error message: %s\n", sqlite3_errmsg(vdb->db));
-	}
+	db_keypoint *ret = store(db_p, &p->descriptor->_rotated[0][0]);
+
+	visual_database::pending_write *w = new visual_database::pending_write(visual_database::pending_write::KEYPOINT);
+	w->obj = obj_id;
+	w->img = img;
+	w->cid = db_p.cid;
+	w->u = db_p.u;
+	w->v = db_p.v;
+	w->scale = db_p.scale;
+	w->orientation = db_p.orientation;
+	assert(sizeof(w->patch) == sizeof(p->descriptor->_rotated));
+	memcpy(w->patch, p->descriptor->_rotated, sizeof(w->patch));
+	vdb->push_write(w);
 	return ret;
 }
 
 unsigned visual_object::add_frame(pyr_frame *frame)
 {
 	unsigned r=0;
-	vdb->exec_sql("begin");
+	vdb->start_update();
 	img_id img = vdb->add_image(frame->pyr->images[0]);
 	representative_image = img;
 
@@ -531,7 +1524,7 @@ unsigned visual_object::add_frame(pyr_frame *frame)
 		pyr_keypoint * p = (pyr_keypoint *)  it.elem();
 		add_keypoint(p,img);
 	}
-	vdb->exec_sql("commit");
+	vdb->finish_update();
 	vdb->version++;
 	return r;
 }
@@ -571,12 +1564,9 @@ float visual_object::get_correspondences_std(pyr_frame *frame, correspondence_ve
 			db_keypoint_vector::iterator begin, end;
 			find(k->id,begin,end);
 			for (db_keypoint_vector::iterator i(begin); i!=end; i++) {
-				corresp.push_back(correspondence(const_cast<db_keypoint *>(&(*i)), k, 1));
-				if (matched_cids.insert(k->id).second) {
-					id_cluster_collection::id2cluster_map::iterator id_it = vdb->id2cluster.find(k->id);
-					if (id_it != vdb->id2cluster.end())
-						score += vdb->idf(id_it); 
-				}
+				corresp.push_back(correspondence(*i, k, 1));
+				if (matched_cids.insert(k->id).second)
+					score += vdb->idf(k->id); 
 			}
 		} else {
 
@@ -597,13 +1587,12 @@ float visual_object::get_correspondences_std(pyr_frame *frame, correspondence_ve
 			if (begin == end) continue;
 
 			float idf=1;
-			id_cluster_collection::id2cluster_map::iterator id_it = vdb->id2cluster.find(cid);
-			if (id_it != vdb->id2cluster.end())
-				idf = vdb->idf(id_it);
+			if (vdb->get_postings(cid))
+				idf = vdb->idf(cid);
 
 			for (db_keypoint_vector::iterator i(begin); i!=end; i++) 
 			{
-				corresp.push_back(correspondence(const_cast<db_keypoint *>(&(*i)), k, 1));
+				corresp.push_back(correspondence(*i, k, 1));
 				if (!added) {
 					added=true;
 					if (matched_cids.insert(cid).second) 
@@ -679,27 +1668,16 @@ float visual_object::verify(pyr_frame *, correspondence_vector &corresp)
 // annotation stuff
 void visual_object::add_annotation(float x, float y, int type, const std::string &descr)
 {
-	sqlite3_stmt *stmt=vdb->get_cached_stmt("create table if not exists annotations (obj integer, x real, y real, type integer, descr text)");
-	if(sqlite3_step(stmt)!=SQLITE_DONE) {
-		printf("Error message: %s\n", sqlite3_errmsg(vdb->db));
-		return;
-	}
-
-	assert(stmt!=0);
-	const char *query = "insert into annotations (obj, x, y, type, descr) values (?,?,?,?,?)";
-	stmt=vdb->get_cached_stmt(query);
-	assert(stmt!=0);
-
-	sqlite3_bind_int64(stmt, 1, obj_id);
-	sqlite3_bind_double(stmt, 2, x);
-	sqlite3_bind_double(stmt, 3, y);
-	sqlite3_bind_int(stmt, 4, type);
-	sqlite3_bind_text(stmt, 5, descr.c_str(), -1, SQLITE_TRANSIENT);
-
-	if(sqlite3_step(stmt)!=SQLITE_DONE) {
-		printf("Error message: %s\n", sqlite3_errmsg(vdb->db));
-	}
-
-	annotations.push_back(annotation(sqlite3_last_insert_rowid(vdb->db), x, y, descr, type));
+	vdb->invalidate_snapshot();
+	visual_database::pending_write *w = new visual_database::pending_write(visual_database::pending_write::ANNOTATION);
+	sqlite3_int64 id = w->id = vdb->next_annotation_id++;
+	w->obj = obj_id;
+	w->u = x;
+	w->v = y;
+	w->flags = type;
+	w->text = descr;
+	vdb->push_write(w);
+
+	annotations.push_back(annotation(id, x, y, descr, type));
 }
 
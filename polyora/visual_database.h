@@ -21,8 +21,16 @@
 #define DB_ENTRY_H
 
 #include <vector>
+#include <deque>
+#include <list>
 #include <map>
 #include <string>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifndef WIN32
+#include <pthread.h>
+#endif
 
 #include "kpttracker.h"
 #include "idcluster.h"
@@ -33,13 +41,25 @@
 /*@{*/
 
 typedef sqlite3_int64 img_id;
-class db_keypoint : public pyr_keypoint {
+
+/*! A keypoint of a visual object. Its patch is kept by the object, see
+ * visual_object::get_patch().
+ */
+class db_keypoint : public point2d {
 public:
 
-	db_keypoint(unsigned cid, img_id img) : image(img) { this->cid = cid; }
-	db_keypoint(const pyr_keypoint &a, img_id img) : pyr_keypoint(a), image(img) { }
+	db_keypoint(unsigned cid, img_id img)
+		: point2d(0,0), cid(cid), scale(0), orientation(0), image(img), patch(0) {}
+	db_keypoint(const pyr_keypoint &a, img_id img)
+		: point2d(a.u, a.v), cid(a.cid), scale(a.scale),
+		orientation(a.orientation), image(img), patch(0) {}
 
+	unsigned cid;
+	int scale;
+	float orientation;
 	img_id image;
+	//! index of the patch in the object.
+	unsigned patch;
 
 	bool operator < (const db_keypoint &a) const { return cid < a.cid; }
 };
@@ -55,13 +75,15 @@ class visual_database;
 class visual_object : public id_cluster {
 public:
 
-	//typedef std::vector<db_keypoint> db_keypoint_vector;
-	typedef std::multiset<db_keypoint> db_keypoint_vector;
+	//! Keypoints sorted by cid.
+	typedef std::vector<db_keypoint *> db_keypoint_vector;
 
 	visual_object(visual_database *, sqlite3_int64 id, const char *comment="", int flags=0);
 	virtual ~visual_object();
 
+	//! Indexes the keypoints added since the last call. Called by find().
 	void prepare();
+	//! The keypoints with the given cid, in the order they were added.
 	void find(unsigned id, db_keypoint_vector::iterator &start, db_keypoint_vector::iterator &end);
 
 
@@ -70,7 +92,14 @@ public:
 	// returns a pointer to the newly added keypoint
 	db_keypoint* add_keypoint(pyr_keypoint *p, img_id img);
 	unsigned add_frame(pyr_frame *frame);
-	void add(db_keypoint &p);
+	//! Adds p to the object, without writing it to the database.
+	db_keypoint *add(const db_keypoint &p, const float *patch);
+
+	enum { PATCH_FLOATS = patch_tagger::patch_size * patch_tagger::patch_size };
+	/*! Copies the patch_size x patch_size patch of k, a keypoint of this
+	 * object. Patches are kept in half precision.
+	 */
+	void get_patch(const db_keypoint *k, float *patch) const;
 
 	unsigned get_total() const { return total; }
 
@@ -116,14 +145,31 @@ public:
 	CvMat *M;
 
 protected:
+	//! true if every keypoint is in 'points' and 'ranges'.
 	bool sorted;
 
+	//! Keypoints never move once added: pointers to them remain valid.
+	std::deque<db_keypoint> storage;
+	std::vector<unsigned short> patches;
+
+	//! pointers to storage, sorted by cid.
 	db_keypoint_vector points;
 
+	//! [begin,end) of a cid in points. Slots with end==0 are empty.
+	struct cid_range {
+		unsigned cid, begin, end;
+	};
+	//! open addressing hash table: cid -> range of points.
+	std::vector<cid_range> ranges;
+	const cid_range *find_range(unsigned cid) const;
+	//! Appends p to storage, and its patch to patches.
+	db_keypoint *store(const db_keypoint &p, const float *patch);
+	db_keypoint *store(const db_keypoint &p, const unsigned short *half_patch);
+
 	sqlite3_int64 obj_id;
 
 public:
-	int nb_points() const { return points.size(); }
+	int nb_points() const { return storage.size(); }
 
 	visual_database *vdb;
 	img_id representative_image;
@@ -149,13 +195,16 @@ public:
 	 * If the file exists, the method indexes every entry in it. After a
 	 * successfull call to open(), query_frame or create_incremental_query()
 	 * are ready to be called.
+	 * If use_snapshot is true, the objects are read from "fn.snapshot"
+	 * when it is up to date, and the snapshot is written otherwise.
 	 */
-	bool open(const char *fn);
+	bool open(const char *fn, bool use_snapshot=true);
 
 	/*! Connects to an already opened sqlite3 database.
 	 * this method can be called instead of open().
+	 * \param snapshot_fn binary snapshot of the objects, or 0. See open().
 	 */
-	bool connect_to_db(sqlite3 *sql3db);
+	bool connect_to_db(sqlite3 *sql3db, const char *snapshot_fn=0);
 
 	/*! Creates a new %visual_object. 
 	 * The object is in the database, but not in the index. No query will
@@ -169,32 +218,200 @@ public:
 	/*! Stores an image in the database. */
 	img_id add_image(IplImage *im);
 
+	struct shared_image;
+	/*! Shared ownership of an image of the cache. The image remains valid
+	 * while a reference exists, even if the cache evicts it meanwhile.
+	 * References must not outlive the database.
+	 */
+	class image_ref {
+	public:
+		image_ref() : vdb(0), s(0) {}
+		image_ref(const image_ref &a);
+		image_ref &operator=(const image_ref &a);
+		~image_ref();
+		IplImage *get() const;
+		operator IplImage *() const { return get(); }
+		IplImage *operator->() const { return get(); }
+	private:
+		friend class visual_database;
+		//! takes over a reference already counted.
+		image_ref(visual_database *vdb, shared_image *s) : vdb(vdb), s(s) {}
+		visual_database *vdb;
+		shared_image *s;
+	};
+
 	/*! Fetches an image from the database.
 	 * It also caches the image, so that subsequent fetching of the same
-	 * image is very fast.
+	 * image is very fast. The cache keeps the most recently used images
+	 * within a memory budget; the returned reference keeps its image alive.
+	 */
+	image_ref get_image(img_id im_id);
+
+	/*! Queues images for loading into the cache by a background thread,
+	 * so that get_image() does not have to wait for them. Returns without
+	 * waiting. Can be called from another thread.
 	 */
-	IplImage *get_image(img_id im_id);
+	void prefetch_images(const std::vector<img_id> &images);
+
+	//! Memory budget of the image cache, in bytes. Default is 64 MB.
+	void set_image_cache_size(size_t bytes);
+
+	enum image_format_t { IMAGE_RAW=0, IMAGE_PNG, IMAGE_JPEG };
+	//! Encoding of the images stored by add_image(). Default is IMAGE_RAW.
+	void set_image_format(image_format_t format) { image_format = format; }
+
+	struct image_cache_stats {
+		unsigned long hits, misses, evictions;
+		unsigned images;
+		size_t bytes, budget;
+	};
+	image_cache_stats get_image_cache_stats();
 
 	visual_object *query_frame(pyr_frame *frame, float *score=0);
 
 	incremental_query *create_incremental_query() { return new incremental_query(this); }
 
-	void start_update() { exec_sql("begin"); }
-	void finish_update() { exec_sql("commit"); }
+	/*! Modifications are written to the database file in order, by a
+	 * background thread, in batched transactions. Modifications made
+	 * between start_update() and finish_update() are committed together.
+	 */
+	void start_update();
+	void finish_update();
+
+	/*! Waits until every modification made so far is written, except the
+	 * ones of a group still open with start_update().
+	 */
+	void flush_writes();
+	//! Number of modifications not written yet.
+	unsigned pending_writes();
 
+	//! Call flush_writes() first to read the modifications made so far.
 	sqlite3 *get_sqlite3_db() { return db; }
 protected:
 	sqlite3 *db;
+	/*! Connection of the writer thread, to the same file. A connection
+	 * can not be used by two threads at once. Equal to db when there is
+	 * no writer thread.
+	 */
+	sqlite3 *write_db;
 
+	typedef std::map<const char *, sqlite3_stmt *> stmt_cache_map;
+	static sqlite3_stmt *get_cached_stmt(sqlite3 *db, stmt_cache_map &cache, const char *query, bool verbose);
 	sqlite3_stmt *get_cached_stmt(const char *query, bool verbose=true);
 	bool exec_sql(const char *query);
 
-	typedef std::map<img_id, IplImage *> image_cache_map;
+	//! A modification waiting to be written. See visual_database.cpp.
+	struct pending_write;
+	//! Queues w, and wakes the writer unless a group is open.
+	void push_write(pending_write *w);
+	//! Executes w on the writer's statements.
+	bool exec_write(pending_write *w);
+	/*! Writes batch in a single transaction, and deletes its elements.
+	 * Returns the last image written, or 0.
+	 */
+	img_id write_batch(std::vector<pending_write *> &batch);
+	//! Writes the ready modifications from the calling thread.
+	void write_ready_now();
+	//! A copy of image img if it still waits in the write queue, or 0.
+	IplImage *clone_queued_image(img_id img);
+	void start_writer();
+	void stop_writer();
+#ifndef WIN32
+	static void *writer_main(void *vdb);
+	void writer_loop();
+	pthread_t writer;
+	//! protects the fields below, up to write_stmts.
+	pthread_mutex_t write_mutex;
+	pthread_cond_t write_cond;
+#endif
+	bool writer_running, writer_quit;
+	std::deque<pending_write *> write_queue;
+	//! the first write_ready elements of write_queue can be committed.
+	unsigned write_ready;
+	int write_group_depth;
+	unsigned long writes_pushed, writes_done;
+	//! the last image written.
+	img_id img_written;
+	//! statements used by the writer only.
+	stmt_cache_map write_stmts;
+
+	//! Ids given to the next rows, known before they are written.
+	img_id next_img_id;
+	sqlite3_int64 next_obj_id, next_annotation_id;
+	//! max(rowid) of table, or its autoincrement sequence if larger.
+	sqlite3_int64 last_rowid(const char *table);
+
+	struct cached_image {
+		shared_image *s;
+		std::list<img_id>::iterator lru;
+	};
+	typedef std::map<img_id, cached_image> image_cache_map;
 	image_cache_map image_cache;
+	//! cached images, most recently used first.
+	std::list<img_id> image_lru;
+	image_cache_stats cache_stats;
+	image_format_t image_format;
+#ifdef _OPENMP
+	//! protects the image cache and the reference counts.
+	omp_lock_t image_lock;
+#endif
+	//! Inserts im, evicting the least recently used images if needed.
+	shared_image *cache_image(img_id id, IplImage *im);
+	/*! Inserts an image loaded without image_lock. If another thread
+	 * cached it meanwhile, im is released and the cached one returned.
+	 */
+	shared_image *cache_loaded_image(img_id id, IplImage *im);
+	//! Evicts images until the budget is met, keeping at least min_images.
+	void trim_image_cache(unsigned min_images);
+	//! Adds delta to the references of s, and frees it when none is left.
+	void ref_image(shared_image *s, int delta);
+	//! Same as above, with image_lock held.
+	void ref_image_locked(shared_image *s, int delta);
+	friend class image_ref;
+	//! Reads and decodes an image with the statements of conn. Returns 0 if not found.
+	IplImage *load_image(img_id id, sqlite3 *conn, stmt_cache_map &stmts);
+	/*! Same as above on db, with a statement of its own: stmt_cache is
+	 * used by the tracking thread, get_image() by the viewers.
+	 */
+	IplImage *load_image(img_id id);
+
+	/*! Connection of the loader thread, which reads the images queued by
+	 * prefetch_images(). Equal to db when there is no loader thread.
+	 */
+	sqlite3 *load_db;
+	//! statements used by the loader only.
+	stmt_cache_map load_stmts;
+	void start_loader();
+	void stop_loader();
+#ifndef WIN32
+	static void *loader_main(void *vdb);
+	void loader_loop();
+	pthread_t loader;
+	//! protects load_queue and loader_quit.
+	pthread_mutex_t load_mutex;
+	pthread_cond_t load_cond;
+#endif
+	bool loader_running, loader_quit;
+	std::deque<img_id> load_queue;
 
-	typedef std::map<const char *, sqlite3_stmt *> stmt_cache_map;
 	stmt_cache_map stmt_cache;
 
+	bool load_objects();
+
+	/*! A snapshot is a binary copy of the objects, their keypoints sorted
+	 * by cid, patches and annotations, mapped in memory at loading.
+	 * SQLite remains the reference: the snapshot stores the stamp of the
+	 * database it was made from, and is ignored once the stamp changed.
+	 */
+	bool load_snapshot(const char *fn, const sqlite3_int64 *stamp);
+	bool save_snapshot(const char *fn, const sqlite3_int64 *stamp);
+	enum { STAMP_SIZE=4 };
+	//! user_version and the last rowid of Objects, Keypoints and annotations.
+	bool get_stamp(sqlite3_int64 *stamp);
+	//! Called before modifying the database: bumps user_version, once.
+	void invalidate_snapshot();
+	bool modified;
+
 	friend class visual_object;
 };
 
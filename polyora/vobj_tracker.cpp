@@ -25,6 +25,9 @@
 #include "vobj_tracker.h"
 #include "homography4.h"
 #include "timer.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 #ifdef min
@@ -201,43 +204,21 @@ pyr_frame *vobj_tracker::process_frame(IplImage *im, long long timestamp)
 	return frame;
 }
 
-pyr_frame *vobj_tracker::process_frame_pipeline(IplImage *im, long long timestamp)
+void vobj_tracker::run_pipeline_stage(int stage, pyr_frame *f)
 {
-	pyr_frame *new_f=0;
-	if (im) new_f = create_frame(im, timestamp);
-#pragma omp parallel 
-	{
-#pragma omp master
-	{
-            if (im) {
-                //TaskTimer::pushTask("pyramid");
-                kpt_tracker::buildPyramid(new_f);
-                //TaskTimer::popTask();
-                //TaskTimer::pushTask("Feature detection");
-                detect_keypoints(new_f);
-                //TaskTimer::popTask();
-            }
-	}
-#pragma omp single
-	{
-	if (pipeline_stage1) {
-		traverse_tree(pipeline_stage1);
-		pipeline_stage1->append_to(*this);
+	kpt_tracker::run_pipeline_stage(stage, f);
+
+	if (stage == STAGE_TRACK) {
+		vobj_frame *frame = static_cast<vobj_frame *>(f);
 		vobj_frame *last_frame = static_cast<vobj_frame *>(get_nth_frame(1));
-		track_ncclk(pipeline_stage1, last_frame);
-		track_objects(static_cast<vobj_frame *>(pipeline_stage1), last_frame);
+		track_objects(frame, last_frame);
 		if (use_incremental_learning) {
-			incremental_learning(static_cast<vobj_frame *>(pipeline_stage1),
+			incremental_learning(frame,
                                              5,  // min track length
                                              30, // radius
                                              5000);  // max pts
                 }
 	}
-	}
-	}
-	pyr_frame *out = pipeline_stage1;
-	pipeline_stage1 = new_f;
-	return out;
 }
 
 
@@ -258,15 +239,17 @@ int vobj_tracker::track_objects(vobj_frame *frame, vobj_frame *last_frame)
 	find_candidates(frame, candidates, last_frame);
 	TaskTimer::popTask();
 
-	TaskTimer::pushTask("verify");
+	// candidates are likely to be displayed: have their images loaded in
+	// the background. This only queues them.
+	TaskTimer::pushTask("prefetch images");
+	std::vector<img_id> images;
 	for (std::set<visual_object *>::iterator it(candidates.begin()); it!= candidates.end(); ++it)
-	{
-		vobj_instance instance;
-		if (verify(frame, *it, &instance, 3.0f)) {
-			// found object!
-			frame->visible_objects.push_back(instance);
-		}
-	}
+		if ((*it)->representative_image >= 0) images.push_back((*it)->representative_image);
+	vdb->prefetch_images(images);
+	TaskTimer::popTask();
+
+	TaskTimer::pushTask("verify");
+	verify_candidates(frame, candidates);
 	TaskTimer::popTask();
 
 	TaskTimer::popTask();
@@ -302,6 +285,120 @@ void vobj_tracker::find_candidates(vobj_frame *frame, std::set<visual_object *>
 	//std::cout << "Found " << candidates.size() << " candidates.\n";
 }
 
+namespace {
+struct candidate_result {
+	visual_object *object;
+	bool found;
+	vobj_instance instance;
+	visual_object::correspondence_vector corresp;
+};
+
+// objects with the largest support claim their keypoints first.
+bool candidate_result_cmp(const candidate_result *a, const candidate_result *b)
+{
+	if (a->instance.support != b->instance.support) return a->instance.support > b->instance.support;
+	return a->object->id() < b->object->id();
+}
+
+bool visual_object_id_cmp(const visual_object *a, const visual_object *b) { return a->id() < b->id(); }
+}
+
+/*! Candidates are verified concurrently. verify() does not modify the
+ * keypoints: a keypoint can be an inlier of several objects. The conflicts
+ * are resolved afterwards, in a deterministic order.
+ */
+void vobj_tracker::verify_candidates(vobj_frame *frame, const std::set<visual_object *> &candidates)
+{
+	if (candidates.empty()) return;
+
+	std::vector<visual_object *> objects(candidates.begin(), candidates.end());
+	std::sort(objects.begin(), objects.end(), visual_object_id_cmp);
+	const int n = objects.size();
+	std::vector<candidate_result> results(n);
+
+	// Shared state lazily updated by get_correspondences() is prepared
+	// here: idf weights, keypoint indexes and track cluster rankings.
+	vdb->idf(0);
+	for (int i=0; i<n; ++i) objects[i]->prepare();
+	if (id_clusters)
+	for (tracks::keypoint_frame_iterator it(frame->points.begin()); !it.end(); ++it) {
+		vobj_keypoint *k = (vobj_keypoint *) it.elem();
+		vobj_keypoint *prev = k->prev_match_vobj();
+		if ((prev && prev->vobj) || !k->track_is_longer(2)) continue;
+		pyr_track *track = (pyr_track *) k->track;
+		if (track && k->cid) track->id_histo.sort_results_min_ratio(.7f);
+	}
+
+	// each candidate draws its RANSAC samples from its own generator,
+	// seeded by the object and the frame: results do not depend on the
+	// scheduling.
+	std::vector<unsigned> seeds(n);
+	for (int i=0; i<n; ++i)
+		seeds[i] = (unsigned)objects[i]->id() * 2654435761u ^ (unsigned)frame->timestamp;
+
+#ifdef _OPENMP
+	// nested in the pipeline, a parallel region would get a single thread:
+	// candidates are given as tasks to the pipeline team instead.
+	if (n>1 && omp_in_parallel()) {
+		for (int i=0; i<n; ++i) {
+#pragma omp task firstprivate(i)
+			{
+				results[i].object = objects[i];
+				results[i].found = verify(frame, objects[i], &results[i].instance, 3.0f, results[i].corresp, seeds[i]);
+			}
+		}
+#pragma omp taskwait
+	} else if (n>1) {
+#pragma omp parallel for schedule(dynamic,1)
+		for (int i=0; i<n; ++i) {
+			results[i].object = objects[i];
+			results[i].found = verify(frame, objects[i], &results[i].instance, 3.0f, results[i].corresp, seeds[i]);
+		}
+	} else
+#endif
+	for (int i=0; i<n; ++i) {
+		results[i].object = objects[i];
+		results[i].found = verify(frame, objects[i], &results[i].instance, 3.0f, results[i].corresp, seeds[i]);
+	}
+
+	std::vector<candidate_result *> found;
+	for (int i=0; i<n; ++i)
+		if (results[i].found) found.push_back(&results[i]);
+	std::sort(found.begin(), found.end(), candidate_result_cmp);
+
+	for (unsigned i=0; i<found.size(); ++i) {
+		candidate_result &r = *found[i];
+		visual_object::correspondence_vector &corresp = r.corresp;
+
+		// inliers already claimed by a stronger object do not count.
+		int inliers=0;
+		for (unsigned j=0; j<corresp.size(); ++j) {
+			vobj_keypoint *k = static_cast<vobj_keypoint *>(corresp[j].frame_kpt);
+			if (k && (k->vobj==0 || k->vobj==r.object)) inliers++;
+		}
+		if (inliers < inlier_threshold(r.object)) continue;
+
+		for (unsigned j=0; j<corresp.size(); ++j) {
+			vobj_keypoint *k = static_cast<vobj_keypoint *>(corresp[j].frame_kpt);
+			if (k && (k->vobj==0 || k->vobj==r.object)) {
+				k->vobj = r.object;
+				k->obj_kpt = corresp[j].obj_kpt;
+			}
+		}
+		r.instance.support = inliers;
+		// found object!
+		frame->visible_objects.push_back(r.instance);
+		info_matches_prev_frame(frame, r.object, false, "After verification");
+	}
+}
+
+int vobj_tracker::inlier_threshold(const visual_object *obj) const
+{
+	if (obj->get_flags() & visual_object::VERIFY_HOMOGRAPHY)
+		return homography_corresp_threshold;
+	return fmat_corresp_threshold;
+}
+
 int get_correspondences(vobj_frame *frame, visual_object *obj, visual_object::correspondence_vector &corresp)
 {
 	corresp.clear();
@@ -350,12 +447,9 @@ int get_correspondences(vobj_frame *frame, visual_object *obj, visual_object::co
 			visual_object::db_keypoint_vector::iterator begin, end;
 			obj->find(k->id,begin,end);
 			for (visual_object::db_keypoint_vector::iterator i(begin); i!=end; i++) {
-                                corresp.push_back(visual_object::correspondence(const_cast<db_keypoint*>(&(*i)), k, .1f));
-				if (matched_cids.insert(k->id).second) {
-					id_cluster_collection::id2cluster_map::iterator id_it = vdb->id2cluster.find(k->id);
-					if (id_it != vdb->id2cluster.end())
-						score += vdb->idf(id_it); 
-				}
+                                corresp.push_back(visual_object::correspondence(*i, k, .1f));
+				if (matched_cids.insert(k->id).second)
+					score += vdb->idf(k->id); 
 			}
 		} else {
 
@@ -365,8 +459,8 @@ int get_correspondences(vobj_frame *frame, visual_object *obj, visual_object::co
 
 		npts++;
 
+		// results are sorted by verify_candidates().
 		bool added=false;
-		track->id_histo.sort_results_min_ratio(.7f);
 		for(incremental_query::iterator it(track->id_histo.begin()); it!=track->id_histo.end(); ++it)
 		{
 			int cid = it->c->id;
@@ -376,14 +470,13 @@ int get_correspondences(vobj_frame *frame, visual_object *obj, visual_object::co
 			if (begin == end) continue;
 
 			float idf=1;
-			id_cluster_collection::id2cluster_map::iterator id_it = vdb->id2cluster.find(cid);
-			if (id_it != vdb->id2cluster.end())
-				idf = vdb->idf(id_it);
+			if (vdb->get_postings(cid))
+				idf = vdb->idf(cid);
 
 			float s = it->score * idf;
 			for (visual_object::db_keypoint_vector::iterator i(begin); i!=end; i++) 
 			{
-				corresp.push_back(visual_object::correspondence(const_cast<db_keypoint *>(&(*i)), k, s));
+				corresp.push_back(visual_object::correspondence(*i, k, s));
 				if (!added) {
 					added=true;
 					if (matched_cids.insert(cid).second) 
@@ -441,14 +534,15 @@ void filter_correspondences(const cv::Mat H, float distance_threshold,
 	obj_pts->rows = frame_pts->rows = num_inliers;
 }
 
-bool vobj_tracker::verify(vobj_frame *frame, visual_object *obj, vobj_instance *instance, float distance_threshold)
+bool vobj_tracker::verify(vobj_frame *frame, visual_object *obj, vobj_instance *instance, float distance_threshold,
+		visual_object::correspondence_vector &corresp, unsigned rng_seed)
 {
 
 	instance->object=0;
+	instance->support=0;
 	if ((obj->get_flags() & (visual_object::VERIFY_HOMOGRAPHY | visual_object::VERIFY_FMAT)) == 0) return false;
 
 	TaskTimer::pushTask("get_correspondences");
-	visual_object::correspondence_vector corresp;
 	int nb_tracked=get_correspondences(frame, obj, corresp);
 	TaskTimer::popTask();
 
@@ -471,6 +565,7 @@ bool vobj_tracker::verify(vobj_frame *frame, visual_object *obj, vobj_instance *
 
 	int r = 0;
 	int support = -1;
+	unsigned rng_state = rng_seed;
 	TaskTimer::pushTask("FindHomography");
 	if (nb_tracked>=10) TaskTimer::pushTask("Track");
 	else TaskTimer::pushTask("Detect");
@@ -491,7 +586,8 @@ bool vobj_tracker::verify(vobj_frame *frame, visual_object *obj, vobj_instance *
 				(nb_tracked < 10 ? 50 : std::max(30, nb_tracked + 2)), // stop if we find 50 matches
 				instance->transform,
 				0, // inliers mask
-				obj_pts.ptr<float>(0),frame_pts.ptr<float>(0));
+				obj_pts.ptr<float>(0),frame_pts.ptr<float>(0),
+				&rng_state);
 
 			//std::cout << "Support: " << r << std::endl;
 			if (support >= homography_corresp_threshold && homography_is_plausible(instance->transform)) {
@@ -519,6 +615,8 @@ bool vobj_tracker::verify(vobj_frame *frame, visual_object *obj, vobj_instance *
 			}
 		}
 	} else {
+		// findFundamentalMat draws its samples from a generator of its
+		// own, with a fixed seed: the result does not depend on the thread.
 		cv::Mat F = cv::findFundamentalMat(obj_pts, frame_pts, (nb_tracked>=16 ? CV_FM_LMEDS : CV_FM_RANSAC), 4, .99);
 		if (!F.empty()) {
 			F.convertTo(M, CV_32FC1);
@@ -533,10 +631,8 @@ bool vobj_tracker::verify(vobj_frame *frame, visual_object *obj, vobj_instance *
 	}
 
 	int inliers=0;
-	int inlier_threshold;
 	if (obj->get_flags() & visual_object::VERIFY_HOMOGRAPHY) {
 		// verify homography for all points
-		inlier_threshold = homography_corresp_threshold;
 		//std::cout << "Homography checking.\n";
 		for (unsigned i=0; i<corresp.size(); ++i) {
 			vobj_keypoint *k = static_cast<vobj_keypoint *>(corresp[i].frame_kpt);
@@ -557,7 +653,6 @@ bool vobj_tracker::verify(vobj_frame *frame, visual_object *obj, vobj_instance *
 		homography_inverse(instance->transform, instance->inverse_transform);
 	} else if (obj->get_flags() & visual_object::VERIFY_FMAT) {
 		// fundamental matrix
-		inlier_threshold = fmat_corresp_threshold;
 		std::cout << "F-Mat checking.\n";
 		for (unsigned i=0; i<corresp.size(); ++i) {
 			vobj_keypoint *k = static_cast<vobj_keypoint *>(corresp[i].frame_kpt);
@@ -574,26 +669,16 @@ bool vobj_tracker::verify(vobj_frame *frame, visual_object *obj, vobj_instance *
 			<< corresp.size() << "( used: " << n_corresp << " tracked: " << nb_tracked << ")\n"
 			<<  " cvFindHomography returned: " << r << std::endl;
 	}
-	bool success = (inliers>=inlier_threshold);
+	bool success = (inliers>=inlier_threshold(obj));
 	if (success) instance->object = obj;
 	instance->support = inliers;
 	//std::cout << " success: " << success << std::endl;
 
-	if (success) 
-	for (unsigned i=0; i<corresp.size(); ++i) {
-		if (corresp[i].frame_kpt) {
-			vobj_keypoint *k = static_cast<vobj_keypoint *>(corresp[i].frame_kpt);
-			k->vobj = obj;
-			k->obj_kpt = corresp[i].obj_kpt;
-		}
-	}
-
 	/*
 	if (success)
 		std::cout << "Matched " << inliers << " features, out of " << obj->nb_points() << " (" << 100.0f*inliers/obj->nb_points() 
 			<< "%)\n";
 	*/
-	info_matches_prev_frame(frame, obj, false, "After verification");
 
 	return success;
 }
@@ -55,7 +55,7 @@ public:
 	vobj_keypoint *prev_match_vobj() { return static_cast<vobj_keypoint *>(matches.prev); }
 	vobj_keypoint *next_match_vobj() { return static_cast<vobj_keypoint *>(matches.next); }
 
-	virtual void dispose() { vobj=0; pyr_keypoint::dispose(); }
+	virtual void dispose() { vobj=0; obj_kpt=0; pyr_keypoint::dispose(); }
 
 	struct vobj_keypoint_factory_t : pyr_keypoint_factory_t {
                 virtual tkeypoint *create() { return new vobj_keypoint(); }
@@ -124,7 +124,6 @@ public:
                     //vobj_track::vobj_track_factory_t *tf=0);
 
 	virtual pyr_frame *process_frame(IplImage *im, long long timestamp);
-	virtual pyr_frame *process_frame_pipeline(IplImage *im, long long timestamp);
 	int track_objects(vobj_frame *frame, vobj_frame *last_frame);
 
 	void remove_visible_objects_from_db(vobj_frame *frame);
@@ -132,9 +131,21 @@ public:
 
 	bool use_incremental_learning;
 protected:
+	//! Adds object detection and incremental learning to STAGE_TRACK.
+	virtual void run_pipeline_stage(int stage, pyr_frame *f);
 
 	void find_candidates(vobj_frame *frame, std::set<visual_object *> &candidates, vobj_frame *last_frame);
-	bool verify(vobj_frame *frame, visual_object *obj, vobj_instance *instance, float distance_threshold);
+	//! Verifies the candidates, and adds the objects found to frame->visible_objects.
+	void verify_candidates(vobj_frame *frame, const std::set<visual_object *> &candidates);
+	/*! Fits a homography or a F-mat between obj and frame. On success,
+	 * the inliers are the elements of corresp with a non null frame_kpt.
+	 * Keypoints are not modified: candidates can be verified concurrently.
+	 * Homography samples are drawn from a private generator seeded with
+	 * rng_seed; no global generator is used or modified.
+	 */
+	bool verify(vobj_frame *frame, visual_object *obj, vobj_instance *instance, float distance_threshold,
+			visual_object::correspondence_vector &corresp, unsigned rng_seed=0);
+	int inlier_threshold(const visual_object *obj) const;
 };
 
 /*@}*/
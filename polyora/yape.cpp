@@ -34,9 +34,29 @@ using namespace std;
 #include <math.h>
 
 #include "yape.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define YAPE_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define YAPE_NEON
+#include <arm_neon.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static inline int lowest_bit(unsigned m) { unsigned long i; _BitScanForward(&i, m); return (int)i; }
+#else
+static inline int lowest_bit(unsigned m) { return __builtin_ctz(m); }
+#endif
 
 const unsigned int yape_bin_size = 1000;
 const int yape_tmp_points_array_size = 10000;
+//! Number of rows processed by a thread at once in pyr_yape::detect.
+const int yape_stripe_height = 64;
 
 bool operator <(const keypoint &p1, const keypoint &p2)
 {
@@ -58,6 +78,8 @@ yape::yape(int _width, int _height)
 
   disactivate_subpixel();
 
+  set_use_simd(true);
+
   set_minimal_neighbor_number(3);
 
   init_for_monoscale();
@@ -551,6 +573,24 @@ int yape::pick_best_points(keypoint * points, unsigned int max_point_number)
     return 0;
 }
 
+bool yape::simd_available(void)
+{
+#if defined(YAPE_SSE2) || defined(YAPE_NEON)
+  return true;
+#else
+  return false;
+#endif
+}
+
+CvRect yape::clip_roi(CvRect roi, int w, int h, int R)
+{
+  if (roi.x < int(R+1)) roi.x = R+1;
+  if (roi.y < int(R+1)) roi.y = R+1;
+  if ((roi.x + roi.width)  > int(w-R-2))  roi.width  = w - R - roi.x - 2;
+  if ((roi.y + roi.height) > int(h-R-2)) roi.height = h - R - roi.y - 2;
+  return roi;
+}
+
 /*! Detect interest points, without filtering and without selecting best ones.
 * Just find them and add them to tmp_points. tmp_points is not cleared in this
 * method.
@@ -559,28 +599,141 @@ void yape::raw_detect(IplImage *im) {
   unsigned int R = radius;
   short * dirs = Dirs->t[R];
   unsigned char dirs_nb = (unsigned char)(Dirs_nb[R]);
-  unsigned char opposite = dirs_nb / 2;
 
-  CvRect roi = cvGetImageROI(im);
-
-  if (roi.x < int(R+1)) roi.x = R+1;
-  if (roi.y < int(R+1)) roi.y = R+1;
-  if ((roi.x + roi.width)  > int(im->width-R-2))  roi.width  = im->width  - R - roi.x - 2;
-  if ((roi.y + roi.height) > int(im->height-R-2)) roi.height = im->height - R - roi.y - 2;
-
-  unsigned int xend = roi.x + roi.width;
-  unsigned int yend = roi.y + roi.height;
+  CvRect roi = clip_roi(cvGetImageROI(im), im->width, im->height, R);
 
 // This loop would be worth paralelizing for large images only...
 #ifdef _OPENMP
 #pragma omp parallel for schedule(static) if (roi.height>1024)
 #endif
-  for(int y = roi.y; y < (int)yend; y++)
+  for(int y = roi.y; y < roi.y + roi.height; y++)
+    raw_detect_rows(im, scores, dirs, dirs_nb, cvRect(roi.x, y, roi.width, 1));
+}
+
+void yape::raw_detect_rows(IplImage *im, IplImage *score_im, const short *dirs,
+                           unsigned char dirs_nb, CvRect roi)
+{
+  unsigned int R = radius;
+  unsigned char opposite = dirs_nb / 2;
+  unsigned int xend = roi.x + roi.width;
+  unsigned int yend = roi.y + roi.height;
+
+  // Two cheap tests reject most pixels before the state machine:
+  // - the pixel is flat if its neighbors at distance R on the same line are
+  //   within tau: |I[x+-R] - I[x]| < tau.
+  // - the first 4 ring samples A, B0, B1, B2 read by perform_one_point
+  //   already decide a rejection, see the first block of this method.
+  // The vector loops evaluate both tests on 16 pixels at once and run the
+  // state machine only on the remaining ones. The scores are unchanged.
+  bool vectorize = use_simd && tau > 0 && tau < 256;
+  const int dA = dirs[0];
+  const int dB0 = dirs[opposite - 1];
+  const int dB1 = dirs[opposite];
+  const int dB2 = dirs[opposite + 1];
+
+  for(unsigned int y = roi.y; y < yend; y++)
   {
     unsigned char * I = (unsigned char *)(im->imageData + y*im->widthStep);
-    short * Scores = (short *)(scores->imageData + y*scores->widthStep);
+    short * Scores = (short *)(score_im->imageData + y*score_im->widthStep);
+    unsigned int x = roi.x;
 
-    for(unsigned int x = roi.x; x < xend; x++)
+#ifdef YAPE_SSE2
+    if (vectorize)
+    {
+      const __m128i t = _mm_set1_epi8((char)tau);
+      const __m128i t1 = _mm_set1_epi8((char)(tau - 1));
+      const __m128i zero = _mm_setzero_si128();
+      for(; x + 16 <= xend; x += 16)
+      {
+        const unsigned char *p = I + x;
+        __m128i c = _mm_loadu_si128((const __m128i *)p);
+        __m128i r = _mm_loadu_si128((const __m128i *)(p + R));
+        __m128i l = _mm_loadu_si128((const __m128i *)(p - R));
+
+        // 0xff where the pixel is flat.
+        __m128i dr = _mm_or_si128(_mm_subs_epu8(c, r), _mm_subs_epu8(r, c));
+        __m128i dl = _mm_or_si128(_mm_subs_epu8(c, l), _mm_subs_epu8(l, c));
+        __m128i reject = _mm_cmpeq_epi8(_mm_or_si128(_mm_subs_epu8(dr, t1), _mm_subs_epu8(dl, t1)), zero);
+
+        // 0xff where v <= I[x] + tau, resp. v >= I[x] - tau.
+#define YAPE_NOT_SUP(v) _mm_cmpeq_epi8(_mm_subs_epu8(_mm_subs_epu8(v, c), t), zero)
+#define YAPE_NOT_INF(v) _mm_cmpeq_epi8(_mm_subs_epu8(_mm_subs_epu8(c, v), t), zero)
+        __m128i A = _mm_loadu_si128((const __m128i *)(p + dA));
+        __m128i B0 = _mm_loadu_si128((const __m128i *)(p + dB0));
+        __m128i B1 = _mm_loadu_si128((const __m128i *)(p + dB1));
+        __m128i B2 = _mm_loadu_si128((const __m128i *)(p + dB2));
+        __m128i A_ns = YAPE_NOT_SUP(A), A_ni = YAPE_NOT_INF(A);
+        __m128i B0_ns = YAPE_NOT_SUP(B0), B0_ni = YAPE_NOT_INF(B0);
+        __m128i B1_ns = YAPE_NOT_SUP(B1), B1_ni = YAPE_NOT_INF(B1);
+        __m128i B2_ns = YAPE_NOT_SUP(B2), B2_ni = YAPE_NOT_INF(B2);
+#undef YAPE_NOT_SUP
+#undef YAPE_NOT_INF
+
+        // A ~ I0: rejected if B0 ~ I0, B2 ~ I0, or B0 > I0 and B1 ~ I0.
+        __m128i B1_sim = _mm_and_si128(B1_ns, B1_ni);
+        __m128i rej_sim = _mm_or_si128(_mm_or_si128(_mm_and_si128(B0_ns, B0_ni), _mm_and_si128(B2_ns, B2_ni)),
+                                       _mm_andnot_si128(B0_ns, B1_sim));
+        reject = _mm_or_si128(reject, _mm_and_si128(_mm_and_si128(A_ns, A_ni), rej_sim));
+        // A > I0: rejected if any B is < I0. A < I0: if any B is > I0.
+        __m128i all_ns = _mm_and_si128(_mm_and_si128(B0_ns, B1_ns), B2_ns);
+        __m128i all_ni = _mm_and_si128(_mm_and_si128(B0_ni, B1_ni), B2_ni);
+        reject = _mm_or_si128(reject, _mm_andnot_si128(_mm_or_si128(A_ns, all_ni), _mm_set1_epi8((char)0xff)));
+        reject = _mm_or_si128(reject, _mm_andnot_si128(_mm_or_si128(A_ni, all_ns), _mm_set1_epi8((char)0xff)));
+
+        unsigned candidates = ~_mm_movemask_epi8(reject) & 0xffff;
+
+        _mm_storeu_si128((__m128i *)(Scores + x), zero);
+        _mm_storeu_si128((__m128i *)(Scores + x + 8), zero);
+
+        while (candidates)
+        {
+          unsigned int xi = x + lowest_bit(candidates);
+          candidates &= candidates - 1;
+          perform_one_point(I, xi, Scores, I[xi] - tau, I[xi] + tau, dirs, opposite, dirs_nb);
+        }
+      }
+    }
+#elif defined(YAPE_NEON)
+    if (vectorize)
+    {
+      const uint8x16_t t = vdupq_n_u8((unsigned char)tau);
+      const uint8x16_t t1 = vdupq_n_u8((unsigned char)(tau - 1));
+      const int16x8_t zero = vdupq_n_s16(0);
+      for(; x + 16 <= xend; x += 16)
+      {
+        const unsigned char *p = I + x;
+        uint8x16_t c = vld1q_u8(p);
+        uint8x16_t reject = vandq_u8(vcleq_u8(vabdq_u8(c, vld1q_u8(p + R)), t1),
+                                     vcleq_u8(vabdq_u8(c, vld1q_u8(p - R)), t1));
+
+        uint8x16_t A = vld1q_u8(p + dA), B0 = vld1q_u8(p + dB0);
+        uint8x16_t B1 = vld1q_u8(p + dB1), B2 = vld1q_u8(p + dB2);
+        uint8x16_t A_s = vcgtq_u8(vqsubq_u8(A, c), t), A_i = vcgtq_u8(vqsubq_u8(c, A), t);
+        uint8x16_t B0_s = vcgtq_u8(vqsubq_u8(B0, c), t), B0_i = vcgtq_u8(vqsubq_u8(c, B0), t);
+        uint8x16_t B1_s = vcgtq_u8(vqsubq_u8(B1, c), t), B1_i = vcgtq_u8(vqsubq_u8(c, B1), t);
+        uint8x16_t B2_s = vcgtq_u8(vqsubq_u8(B2, c), t), B2_i = vcgtq_u8(vqsubq_u8(c, B2), t);
+
+        // same rules as the SSE2 version above.
+        uint8x16_t rej_sim = vorrq_u8(vorrq_u8(vmvnq_u8(vorrq_u8(B0_s, B0_i)), vmvnq_u8(vorrq_u8(B2_s, B2_i))),
+                                      vbicq_u8(B0_s, vorrq_u8(B1_s, B1_i)));
+        reject = vorrq_u8(reject, vbicq_u8(rej_sim, vorrq_u8(A_s, A_i)));
+        reject = vorrq_u8(reject, vandq_u8(A_s, vorrq_u8(vorrq_u8(B0_i, B1_i), B2_i)));
+        reject = vorrq_u8(reject, vandq_u8(A_i, vorrq_u8(vorrq_u8(B0_s, B1_s), B2_s)));
+
+        unsigned char rejected[16];
+        vst1q_u8(rejected, reject);
+
+        vst1q_s16(Scores + x, zero);
+        vst1q_s16(Scores + x + 8, zero);
+
+        for (int i = 0; i < 16; i++)
+          if (!rejected[i])
+            perform_one_point(I, x + i, Scores, I[x + i] - tau, I[x + i] + tau, dirs, opposite, dirs_nb);
+      }
+    }
+#endif
+
+    for(; x < xend; x++)
     {
       int Ip = I[x] + tau;
       int Im = I[x] - tau;
@@ -673,25 +826,29 @@ static inline bool is_local_maxima(const short *p, int neighborhood, const IplIm
 */
 int yape::get_local_maxima(IplImage * image, int R, float scale /*, keypoint * points, int max_number_of_points*/)
 {
-  int nbpts=0;
+  CvRect roi = clip_roi(cvGetImageROI(image), scores->width, scores->height, R);
+
+  keypoint_vector found;
+  int nbpts = get_local_maxima_rows(scores, R, scale, roi, found);
 
-  const int next_line = scores->widthStep / sizeof(short);
-  int h = scores->height;
-  int w = scores->width;
+  for (keypoint_vector::iterator it = found.begin(); it != found.end(); ++it)
+    add_candidate(*it, scores->width, scores->height);
+  return nbpts;
+}
 
-  CvRect roi = cvGetImageROI(image);
+int yape::get_local_maxima_rows(IplImage *score_im, int R, float scale, CvRect roi,
+                                std::vector<keypoint> &pts)
+{
+  int nbpts=0;
 
-  if (roi.x < int(R+1)) roi.x = R+1;
-  if (roi.y < int(R+1)) roi.y = R+1;
-  if ((roi.x + roi.width)  > int(scores->width-R-2))  roi.width  = scores->width  - R - roi.x - 2;
-  if ((roi.y + roi.height) > int(scores->height-R-2)) roi.height = scores->height - R - roi.y - 2;
+  const int next_line = score_im->widthStep / sizeof(short);
 
   unsigned int xend = roi.x + roi.width;
   unsigned int yend = roi.y + roi.height;
 
   for(unsigned int y = roi.y; y < yend; y++)
   {
-    short * Scores = (short *)(scores->imageData + y * scores->widthStep);
+    short * Scores = (short *)(score_im->imageData + y * score_im->widthStep);
 
     for(unsigned int x = roi.x; x < xend; x++)
     {
@@ -702,29 +859,14 @@ int yape::get_local_maxima(IplImage * image, int R, float scale /*, keypoint * p
         ++x; // if this pixel is 0, the next one will not be good enough. Skip it.
       else 
       {
-        if (third_check(Sb, next_line) && is_local_maxima(Sb, R, scores))
+        if (third_check(Sb, next_line) && is_local_maxima(Sb, R, score_im))
         {
           keypoint p;
           p.u = float(x);
           p.v = float(y);
           p.scale = int(scale);
           p.score = float(abs(Sb[0]));
-
-          if (use_bins)
-          {
-            int bin_u_index = (bin_nb_u * x) / w;
-            int bin_v_index = (bin_nb_v * y) / h;
-
-            if (bin_u_index >= bin_nb_u)
-              bin_u_index = bin_nb_u - 1;
-            if (bin_v_index >= bin_nb_v)
-              bin_v_index = bin_nb_v - 1;
-
-            if (bins[bin_u_index][bin_v_index].size() < yape_bin_size)
-              bins[bin_u_index][bin_v_index].push_back(p);
-          }
-          else
-            tmp_points.push_back(p);
+          pts.push_back(p);
 
           nbpts++;
           x += R-1;
@@ -735,6 +877,25 @@ int yape::get_local_maxima(IplImage * image, int R, float scale /*, keypoint * p
   return nbpts;
 }
 
+void yape::add_candidate(const keypoint &p, int w, int h)
+{
+  if (use_bins)
+  {
+    int bin_u_index = (bin_nb_u * int(p.u)) / w;
+    int bin_v_index = (bin_nb_v * int(p.v)) / h;
+
+    if (bin_u_index >= bin_nb_u)
+      bin_u_index = bin_nb_u - 1;
+    if (bin_v_index >= bin_nb_v)
+      bin_v_index = bin_nb_v - 1;
+
+    if (bins[bin_u_index][bin_v_index].size() < yape_bin_size)
+      bins[bin_u_index][bin_v_index].push_back(p);
+  }
+  else
+    tmp_points.push_back(p);
+}
+
 /////////////////////////////////////////////////////////////////
 // Sub-pixel / sub-scale accuracy.
 /////////////////////////////////////////////////////////////////
@@ -864,11 +1025,70 @@ int pyr_yape::detect(PyrImage *image, keypoint *points, int max_point_number)
 {
   reserve_tmp_arrays();
 
+  // Each level is cut in horizontal stripes, processed in parallel. Every
+  // level has its own score image, and stripes write disjoint rows.
+  stripes.clear();
   for (int i=image->nbLev-1; i>=0; --i) 
   {
-    select_level(i);
-    raw_detect(image->images[i]);
-    get_local_maxima(image->images[i], radius, float(i));
+    IplImage *im = image->images[i];
+    split_stripes(i, clip_roi(cvGetImageROI(im), im->width, im->height, radius), stripes);
+  }
+
+  // Within a pipeline slot, nested parallel regions get a single thread:
+  // the stripes are given as tasks to the pipeline team instead, so that
+  // threads done with their own slot can take them.
+#ifdef _OPENMP
+  if (omp_in_parallel()) {
+    for (int t=0; t<(int)stripes.size(); ++t) {
+#pragma omp task firstprivate(t)
+      score_stripe(image, t);
+    }
+#pragma omp taskwait
+  } else {
+#pragma omp parallel for schedule(dynamic)
+    for (int t=0; t<(int)stripes.size(); ++t) 
+      score_stripe(image, t);
+  }
+#else
+  for (int t=0; t<(int)stripes.size(); ++t) 
+    score_stripe(image, t);
+#endif
+
+  // Local maxima need the scores of neighboring stripes: wait for all
+  // scores before searching them.
+  stripes.clear();
+  for (int i=image->nbLev-1; i>=0; --i) 
+  {
+    IplImage *s = pscores->images[i];
+    split_stripes(i, clip_roi(cvGetImageROI(image->images[i]), s->width, s->height, radius), stripes);
+  }
+  if (stripe_points.size() < stripes.size())
+    stripe_points.resize(stripes.size());
+
+#ifdef _OPENMP
+  if (omp_in_parallel()) {
+    for (int t=0; t<(int)stripes.size(); ++t) {
+#pragma omp task firstprivate(t)
+      maxima_stripe(t);
+    }
+#pragma omp taskwait
+  } else {
+#pragma omp parallel for schedule(dynamic)
+    for (int t=0; t<(int)stripes.size(); ++t) 
+      maxima_stripe(t);
+  }
+#else
+  for (int t=0; t<(int)stripes.size(); ++t) 
+    maxima_stripe(t);
+#endif
+
+  // Merge in the serial order, from the top level down, so that bins fill
+  // up exactly as a sequential detection would.
+  for (unsigned t=0; t<stripes.size(); ++t) 
+  {
+    IplImage *s = pscores->images[stripes[t].level];
+    for (keypoint_vector::iterator it = stripe_points[t].begin(); it != stripe_points[t].end(); ++it)
+      add_candidate(*it, s->width, s->height);
   }
   /*
   for (keypoint_vector::iterator it = tmp_points.begin(); it!=tmp_points.end(); ++it)
@@ -923,6 +1143,31 @@ int pyr_yape::detect(PyrImage *image, keypoint *points, int max_point_number)
   return n;
 }
 
+void pyr_yape::score_stripe(PyrImage *image, int t)
+{
+  int l = stripes[t].level;
+  raw_detect_rows(image->images[l], pscores->images[l], pDirs[l]->t[radius],
+      (unsigned char)pDirs_nb[l][radius], stripes[t].roi);
+}
+
+void pyr_yape::maxima_stripe(int t)
+{
+  int l = stripes[t].level;
+  stripe_points[t].clear();
+  get_local_maxima_rows(pscores->images[l], radius, float(l), stripes[t].roi, stripe_points[t]);
+}
+
+void pyr_yape::split_stripes(int level, CvRect roi, std::vector<stripe_t> &stripes)
+{
+  for (int y = roi.y; y < roi.y + roi.height; y += yape_stripe_height)
+  {
+    stripe_t s;
+    s.level = level;
+    s.roi = cvRect(roi.x, y, roi.width, MIN(yape_stripe_height, roi.y + roi.height - y));
+    stripes.push_back(s);
+  }
+}
+
 /*!
 * This method does the following:
 * 1) Apply a Gaussian blur filter on the provided image, putting the result in
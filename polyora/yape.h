@@ -107,6 +107,14 @@ public:
   void disactivate_subpixel(void) { set_use_subpixel(false); } // Default
   void set_use_subpixel(bool p_use_subpixel) { use_subpixel = p_use_subpixel; }
 
+  /*! Vectorized rejection of flat pixels in raw_detect. Results are
+   *  identical with or without it. Enabled by default when the CPU
+   *  supports it.
+   */
+  void set_use_simd(bool p_use_simd) { use_simd = p_use_simd && simd_available(); }
+  bool get_use_simd(void) { return use_simd; }
+  static bool simd_available(void);
+
   void set_minimal_neighbor_number(int p_minimal_neighbor_number) { minimal_neighbor_number = p_minimal_neighbor_number;} 
   int get_minimal_neighbor_number(void) { return minimal_neighbor_number; } 
 
@@ -132,6 +140,20 @@ protected:
 
   int get_local_maxima(IplImage * image, int R, float scale /*, keypoint * points, int max_point_number */);
 
+  //! Clip a region of interest to the area where the detector can work.
+  static CvRect clip_roi(CvRect roi, int w, int h, int R);
+
+  //! Compute the scores of the pixels in roi. Thread safe.
+  void raw_detect_rows(IplImage *im, IplImage *score_im, const short *dirs,
+    unsigned char dirs_nb, CvRect roi);
+
+  //! Append the local maxima of score_im found in roi to pts. Thread safe.
+  int get_local_maxima_rows(IplImage *score_im, int R, float scale, CvRect roi,
+    std::vector<keypoint> &pts);
+
+  //! Store a local maximum in its bin or in tmp_points.
+  void add_candidate(const keypoint &p, int w, int h);
+
   void perform_one_point(const unsigned char * I, const int x, short * Scores,
     const int Im, const int Ip, 
     const short * dirs, const unsigned char opposite, const unsigned char dirs_nb);
@@ -168,6 +190,8 @@ protected:
   keypoint_vector bins[10][10];
   int bin_nb_u, bin_nb_v;
 
+  bool use_simd;
+
   // Subpixel (always 'on' for pyramidal version)
   bool use_subpixel;
 
@@ -225,6 +249,19 @@ public:
   bool equalize;
 
   void select_level(int l);
+
+protected:
+  //! A horizontal stripe of a pyramid level, processed by a single thread.
+  struct stripe_t {
+    int level;
+    CvRect roi;
+  };
+  void split_stripes(int level, CvRect roi, std::vector<stripe_t> &stripes);
+  void score_stripe(PyrImage *image, int t);
+  void maxima_stripe(int t);
+
+  std::vector<stripe_t> stripes;
+  std::vector<keypoint_vector> stripe_points;
 };
 
 #endif // YAPE_H
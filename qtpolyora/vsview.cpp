@@ -86,6 +86,8 @@ VSView::VSView(QWidget *parent, const char *name, VideoSource *vs)
 	record=false;
 	record_pts=false;
 	record_movie=false;
+	saved_descriptor_history=0;
+	saved_max_frames=0;
 	viewScores=false;
 
 	tree_fn = 0;
@@ -263,10 +265,6 @@ void VSView::timerEvent(QTimerEvent *) {
 		}
 
 		tracker->remove_unmatched_tracks(tracker->get_nth_frame(2));
-		if (!record) {
-			tracks::frame_iterator it = tracker->get_nth_frame_it(512);
-			tracker->remove_frame(it);
-		}
 
 		frame_processing_time = frame_processing.elapsed();
 		update_fps_stat(frame_processing_time, pframe);
@@ -371,7 +369,7 @@ void VSView::keyPressEvent(QKeyEvent *k)
 		//case Qt::Key_S: sprintf(fn,"frame%04d.png", n++); saveCurrentFrame(fn); break;
 		case Qt::Key_S: sprintf(fn,"shot%04d.png", n++); renderAndSave(fn, im->width*2, im->height); break;
 		case Qt::Key_Tab: if (vs->isPlaying()) vs->stop(); else vs->start(); break;
-		case Qt::Key_R: record = !record; record_pts=false; break;
+		case Qt::Key_R: set_record(!record); record_pts=false; break;
 		case Qt::Key_L: if (k->modifiers() && Qt::ShiftModifier) {
 					if (viewlevel<nbLev-1) viewlevel++;
 				} else {
@@ -412,7 +410,7 @@ void VSView::keyPressEvent(QKeyEvent *k)
 		case Qt::Key_A: add_current_frame_to_db("Interactive, no geometry checking", 0);  break;
 		case Qt::Key_F: add_current_frame_to_db("Interactive, F-Mat checking", visual_object::VERIFY_FMAT); break;
 		case Qt::Key_H: add_current_frame_to_db("Interactive, homography checking", visual_object::VERIFY_HOMOGRAPHY); break;
-		case Qt::Key_P: record_pts = !record_pts; record=false; break;
+		case Qt::Key_P: record_pts = !record_pts; set_record(false); break;
 		case Qt::Key_C: entry = 0; init_query_with_frame(*query, frame); break;
 		case Qt::Key_1: view_mode = VIEW_AUTO; break;
 		case Qt::Key_2: view_mode = VIEW_KEYPOINTS; break;
@@ -546,13 +544,13 @@ static inline void glVertex(cv::Point_<float> p)
 void draw_keypoint(const pyr_keypoint *k) {
 	float x = k->u;
 	float y = k->v;
-	float angle = k->descriptor.orientation;
+	float angle = k->orientation;
 	float len=5 +   (2 << k->scale);
 	float dx = len * cosf(angle);
 	float dy = len * sinf(angle);
 
 	if (k->cid) {
-		gl_hash_mark(k->cid, k->u, k->v, k->descriptor.orientation, len);
+		gl_hash_mark(k->cid, k->u, k->v, k->orientation, len);
 	} else {
 #ifdef WITH_MSER
 		glBegin(GL_LINE_STRIP);
@@ -572,6 +570,11 @@ void draw_keypoint(const pyr_keypoint *k) {
 	}
 }
 
+void draw_keypoint(const db_keypoint *k) {
+	float len=5 +   (2 << k->scale);
+	gl_hash_mark(k->cid, k->u, k->v, k->orientation, len);
+}
+
 void VSView::createTracker()
 {
 	if (tracker==0) {
@@ -580,6 +583,12 @@ void VSView::createTracker()
 		// make sure the OpenGL context is ready, to let kpt_tracker use the GPU.
 		makeCurrent();
 		tracker = new kpt_tracker(im->width,im->height,nbLev, (int)(16), true);
+		tracker->set_max_frames(512);
+		if (record) {
+			// track recording requested on the command line
+			record = false;
+			set_record(true);
+		}
 
 		database.open(visual_db_fn);
 
@@ -693,25 +702,28 @@ void VSView::draw_selected_track()
 	for (it=first; !it.end(); --it) {
 		pyr_keypoint *k = (pyr_keypoint *) it.elem();
 
-		if (k->node) {
+		float leaf_mean[kmean_tree::descriptor_size];
+		if (k->id && tracker->quantizer && tracker->quantizer->leaf_mean(k->id, leaf_mean)) {
             cv::Mat im;
-            patch_tagger::unproject(k->node->mean.mean, &im);
+            patch_tagger::unproject(leaf_mean, &im);
 
 			point2d pos_down(pos.u, pos.v+2*r);
 			draw_icon(&pos_down, im, r, r, image->width, 0, 2*r);
 		}
-		{
+		// older frames released their descriptors
+		if (k->descriptor) {
 			float descr[kmean_tree::descriptor_size];
-            k->descriptor.array(descr);
+            k->descriptor->array(descr);
             cv::Mat im;
             patch_tagger::unproject(descr, &im);
 			point2d pos_down(pos.u, pos.v+r);
 			draw_icon(&pos_down, im, r, r, image->width, 0, 2*r);
+
+            CvMat rotated;
+            cvInitMatHeader(&rotated, patch_tagger::patch_size, patch_tagger::patch_size, CV_32FC1,
+                            k->descriptor->_rotated);
+			draw_icon(&pos, &rotated, r, r, image->width, 0, 2*r);
 		}
-        CvMat rotated;
-        cvInitMatHeader(&rotated, patch_tagger::patch_size, patch_tagger::patch_size, CV_32FC1,
-                        k->descriptor._rotated);
-		draw_icon(&pos, &rotated, r, r, image->width, 0, 2*r);
 	}
 	glPopMatrix();
 	glPopMatrix();
@@ -854,7 +866,7 @@ void VSView::draw_entry_image()
 {
 	if (!entry) return;
 
-	IplImage *entry_image = database.get_image(entry->representative_image);
+	visual_database::image_ref entry_image = database.get_image(entry->representative_image);
 	entry_tex.setImage(entry_image);
 
 	if (entry_image)
@@ -865,7 +877,8 @@ void VSView::draw_matches(pyr_frame *frame)
 {
 	if (!entry || entry->get_total() ==0) return;
 
-	IplImage *entry_image = database.get_image(entry->representative_image);
+	visual_database::image_ref entry_ref = database.get_image(entry->representative_image);
+	IplImage *entry_image = entry_ref;
 
 	if (!entry_image)
 		entry_image = image;
@@ -886,18 +899,15 @@ void VSView::draw_matches(pyr_frame *frame)
 		glPushMatrix();
 		glTranslatef(image->width,0,0);
 		for (i=begin; i!=end; i++) {
-			assert(i->cid == k->cid);
-			if (!selected_kpt || selected_kpt->cid == i->cid)
-				draw_keypoint(&(*i));
-
-			if (k==selected_kpt && i->node) {
-				point2d down(cursor.u, cursor.v+16);
-				CvMat mat, rotated; 
-				cvInitMatHeader(&mat, patch_tagger::patch_size, patch_tagger::patch_size, CV_32FC1,
-						i->node->mean.mean);
-				draw_icon(&down, &mat, 16, 16, entry_image->width,0,16);
-
-				cvInitMatHeader(&rotated, patch_tagger::patch_size, patch_tagger::patch_size, CV_32FC1, const_cast<float *>(&i->descriptor._rotated[0][0]));
+			assert((*i)->cid == k->cid);
+			if (!selected_kpt || selected_kpt->cid == (*i)->cid)
+				draw_keypoint(*i);
+
+			if (k==selected_kpt) {
+				CvMat rotated; 
+				float patch[visual_object::PATCH_FLOATS];
+				entry->get_patch(*i, patch);
+				cvInitMatHeader(&rotated, patch_tagger::patch_size, patch_tagger::patch_size, CV_32FC1, patch);
 				draw_icon(&cursor, &rotated, 16, 16, entry_image->width,0,16);
 			}
 		}
@@ -907,7 +917,7 @@ void VSView::draw_matches(pyr_frame *frame)
 	for (visual_object::correspondence_vector::iterator it(corresp.begin()); it!= corresp.end(); ++it)
 	{
 		pyr_keypoint *k = it->frame_kpt;
-		pyr_keypoint *o = it->obj_kpt;
+		db_keypoint *o = it->obj_kpt;
 
 		//assert(o->cid == k->cid);
 
@@ -923,16 +933,19 @@ void VSView::draw_matches(pyr_frame *frame)
 		}
 
 		if (k==selected_kpt) {
-			if (o->node) {
+			float leaf_mean[kmean_tree::descriptor_size];
+			if (k->id && tracker->quantizer && tracker->quantizer->leaf_mean(k->id, leaf_mean)) {
 				point2d down(cursor.u, cursor.v+16);
 				CvMat mat; 
 				cvInitMatHeader(&mat, patch_tagger::patch_size, patch_tagger::patch_size, CV_32FC1,
-						o->node->mean.mean);
+						leaf_mean);
 				draw_icon(&down, &mat, 16, 16, entry_image->width,0,16);
 			}
 
                         CvMat rotated;
-			cvInitMatHeader(&rotated, patch_tagger::patch_size, patch_tagger::patch_size, CV_32FC1, const_cast<float *>(&o->descriptor._rotated[0][0]));
+			float patch[visual_object::PATCH_FLOATS];
+			entry->get_patch(o, patch);
+			cvInitMatHeader(&rotated, patch_tagger::patch_size, patch_tagger::patch_size, CV_32FC1, patch);
 			draw_icon(&cursor, &rotated, 16, 16, entry_image->width,0,16);
 		}
 		glPopMatrix();
@@ -1095,7 +1108,7 @@ void VSView::write_descriptor(pyr_keypoint *k, long ptr)
 	}
 #endif
 #ifdef WITH_PATCH_TAGGER_DESCRIPTOR
-	if (k->descriptor.total==0) {
+	if (k->descriptor==0 || k->descriptor->total==0) {
 		std::cout << "save_descriptors: total==0!\n";
 		return;
 	}
@@ -1103,7 +1116,7 @@ void VSView::write_descriptor(pyr_keypoint *k, long ptr)
 	 
 	size_t n = fwrite(&ptr, sizeof(long), 1, descrf);
 	float _array[descr_size];
-	k->descriptor.array(_array);
+	k->descriptor->array(_array);
 	for (int i = 0; i < descr_size; ++i) {
 		assert(finite(_array[i]));
 	}
@@ -1113,6 +1126,23 @@ void VSView::write_descriptor(pyr_keypoint *k, long ptr)
 
 }
 
+void VSView::set_record(bool r)
+{
+	if (r == record) return;
+	record = r;
+	if (!tracker) return;
+	if (record) {
+		// save_tracks() needs the descriptors of whole tracks.
+		saved_descriptor_history = tracker->descriptor_history;
+		saved_max_frames = tracker->get_max_frames();
+		tracker->descriptor_history = 0;
+		tracker->set_max_frames(0);
+	} else {
+		tracker->descriptor_history = saved_descriptor_history;
+		tracker->set_max_frames(saved_max_frames);
+	}
+}
+
 void VSView::save_tracks() 
 {
 	if (descrf==0) 
@@ -72,6 +72,8 @@ private:
 	IplImage *im;
 
 	kpt_tracker *tracker;
+	// tracker settings, saved while tracks are recorded
+	int saved_descriptor_history, saved_max_frames;
 	visual_database database;
 	incremental_query *query;
 
@@ -109,6 +111,7 @@ private:
 	void show_tracks();
 	void write_descriptor(pyr_keypoint *k, long ptr);
 	void save_tracks();
+	void set_record(bool r);
 	void createTracker();
 	void draw_matches(pyr_frame *frame);
 	void draw_keypoints(pyr_frame *frame);
@@ -162,8 +162,6 @@ void track3d_view::timerEvent(QTimerEvent *) {
 
 
 		tracker->remove_unmatched_tracks(tracker->get_nth_frame(2));
-		tracks::frame_iterator it = tracker->get_nth_frame_it(512);
-		tracker->remove_frame(it);
 
 		frame_processing_time = frame_processing.elapsed();
 		if (pframe) update_fps_stat(frame_processing_time, pframe);
@@ -299,11 +297,12 @@ void track3d_view::createTracker()
 		cout << "done.\n";
 		tracker = new vobj_tracker(im->width,im->height,nbLev, (int)(16), &database, true);
 		tracker->use_incremental_learning = learning;
+		tracker->set_max_frames(512);
 
 		if (tree_fn) {
 			// old style plain file loading
 			if (tracker->load_tree(tree_fn)) {
-				cout << tree_fn << ": tree has " << tracker->tree->count_leafs() << " leafs.\n";
+				cout << tree_fn << ": tree has " << tracker->nb_leaves() << " leafs.\n";
 				if (tracker->load_clusters(clusters_fn))
 					cout << clusters_fn << ": clusters loaded.\n";
 			}
@@ -311,7 +310,7 @@ void track3d_view::createTracker()
 			// new sqlite3 style
 			cout << "Loading tree from db..." << flush;
 			if (tracker->load_tree(database.get_sqlite3_db())) {
-				cout << "done, loaded " << tracker->tree->count_leafs() << " leafs.\n";
+				cout << "done, loaded " << tracker->nb_leaves() << " leafs.\n";
 			} else {
 				cout << "failed\n";
 			}
@@ -72,6 +72,8 @@ int main(int argc, char *argv[]) {
     int work_height = height / 2;
 
     kpt_tracker tracker(work_width, work_height, 5, 10);
+    // keypoints of all frames are added to the object.
+    tracker.descriptor_history = 0;
 
     // Loads quantization tree and track clusters
     visual_database database(id_cluster_collection::QUERY_IDF_NORMALIZED);
@@ -174,8 +174,6 @@ void vobj_tracker_view::timerEvent(QTimerEvent *) {
 
 
 		tracker->remove_unmatched_tracks(tracker->get_nth_frame(2));
-		tracks::frame_iterator it = tracker->get_nth_frame_it(512);
-		tracker->remove_frame(it);
 
 		frame_processing_time = frame_processing.elapsed();
 		if (pframe) update_fps_stat(frame_processing_time, pframe);
@@ -396,13 +394,13 @@ void vobj_tracker_view::mouseReleaseEvent ( QMouseEvent * event )
 void draw_keypoint(pyr_keypoint *k) {
 	float x = k->u;
 	float y = k->v;
-	float angle = k->descriptor.orientation;
+	float angle = k->orientation;
 	float len=5 +   (2 << k->scale);
 	float dx = len * cosf(angle);
 	float dy = len * sinf(angle);
 
 	if (k->cid) {
-		gl_hash_mark(k->cid, k->u, k->v, k->descriptor.orientation, len);
+		gl_hash_mark(k->cid, k->u, k->v, k->orientation, len);
 	} else {
 		glBegin(GL_LINES);
 		glVertex2f(x,y);
@@ -425,11 +423,12 @@ void vobj_tracker_view::createTracker()
 		cout << "done.\n";
 		tracker = new vobj_tracker(im->width,im->height,nbLev, (int)(16), &database, true);
 		tracker->use_incremental_learning = learning;
+		tracker->set_max_frames(512);
 
 		if (tree_fn) {
 			// old style plain file loading
 			if (tracker->load_tree(tree_fn)) {
-				cout << tree_fn << ": tree has " << tracker->tree->count_leafs() << " leafs.\n";
+				cout << tree_fn << ": tree has " << tracker->nb_leaves() << " leafs.\n";
 				if (tracker->load_clusters(clusters_fn))
 					cout << clusters_fn << ": clusters loaded.\n";
 			}
@@ -437,7 +436,7 @@ void vobj_tracker_view::createTracker()
 			// new sqlite3 style
 			cout << "Loading tree from db..." << flush;
 			if (tracker->load_tree(database.get_sqlite3_db())) {
-				cout << "done, loaded " << tracker->tree->count_leafs() << " leafs.\n";
+				cout << "done, loaded " << tracker->nb_leaves() << " leafs.\n";
 			} else {
 				cout << "failed\n";
 			}
@@ -552,16 +551,20 @@ void vobj_tracker_view::draw_selected_track()
 #ifndef WITH_SURF
 		pyr_keypoint *k = (pyr_keypoint *) it.elem();
 
-		if (k->node) {
+		float leaf_mean[kmean_tree::descriptor_size];
+		if (k->id && tracker->quantizer && tracker->quantizer->leaf_mean(k->id, leaf_mean)) {
 			CvMat mat; cvInitMatHeader(&mat, patch_tagger::patch_size, patch_tagger::patch_size, CV_32FC1,
-					k->node->mean.mean);
+					leaf_mean);
 			point2d pos_down(pos.u, pos.v+r);
 			draw_icon(&pos_down, &mat, r, r, image->width, 0, r);
 		}
+		// older frames released their descriptors
+		if (k->descriptor) {
                 CvMat rotated;
                 cvInitMatHeader(&rotated, patch_tagger::patch_size, patch_tagger::patch_size, CV_32FC1,
-                        k->descriptor._rotated);
+                        k->descriptor->_rotated);
 		draw_icon(&pos, &rotated, r, r, image->width, 0, r);
+		}
 #endif
 	}
 	glPopMatrix();
@@ -631,7 +634,7 @@ void vobj_tracker_view::draw_entry_image(visual_object *entry)
 {
 	if (!entry) return;
 
-	IplImage *entry_image = database.get_image(entry->representative_image);
+	visual_database::image_ref entry_image = database.get_image(entry->representative_image);
 	entry_tex.setImage(entry_image);
 
 	if (entry_image)
@@ -651,7 +654,7 @@ void vobj_tracker_view::draw_matches(vobj_frame *frame)
 				glColor4f(0,1,0,1);
 			else
 				glColor4f(1,0,0,1);
-			gl_hash_mark((int)(((long)k->vobj)&0xFFFFFFFF), k->u, k->v, k->descriptor.orientation, 3);
+			gl_hash_mark((int)(((long)k->vobj)&0xFFFFFFFF), k->u, k->v, k->orientation, 3);
 		}
 
 	}